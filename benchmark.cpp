@@ -0,0 +1,911 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QBuffer>
+#include <QDateTime>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QRandomGenerator>
+#include <QSslSocket>
+#include <QSysInfo>
+#include <QTemporaryDir>
+#include <QThread>
+#include <QTimer>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <ctime>
+#include <functional>
+#include <iterator>
+
+#ifdef Q_OS_LINUX
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "applink.c"
+#include "bufferpool.h"
+#include "crypto.h"
+#include "keymanager.h"
+#include "transferprotocol.h"
+#include "fileclient.h"
+#include "fileserver.h"
+#include "httpparser.h"
+#include "httpserver.h"
+
+// Crypto, protocol and loopback transfer benchmarks. Every result is one
+// named number, so a run can be kept as JSON and later runs checked
+// against it:
+//
+//   LetsShareBench --output baseline.json
+//   LetsShareBench --baseline baseline.json            (run, then compare)
+//   LetsShareBench --baseline old.json --current new.json  (compare only)
+//
+// A comparison exits with 1 if anything got worse by more than --threshold
+// percent. The loopback transfers and HTTP requests listen on the app's
+// ports, so the app must not be running at the same time.
+
+using namespace TransferProtocol;
+
+namespace {
+
+const double megabyte = 1024.0 * 1024.0;
+const qint64 minSampleNsecs = 200 * 1000 * 1000; // Each micro benchmark runs at least this long
+const qint64 transferTimeout = 30 * 60 * 1000;   // ms, for the biggest loopback run
+
+struct Result {
+    QString name;
+    double value;
+    QString unit;
+    bool higherIsBetter;
+};
+
+class Report
+{
+public:
+    explicit Report(const QString &filter) : filter(filter) {}
+
+    bool wants(const QString &prefix) const { return filter.isEmpty() || prefix.contains(filter) || filter.contains(prefix); }
+
+    void add(const QString &name, double value, const QString &unit, bool higherIsBetter)
+    {
+        if (filter.isEmpty() || name.contains(filter)) {
+            results.append({name, value, unit, higherIsBetter});
+            std::fprintf(stderr, "%-56s %14.2f %s\n", qPrintable(name), value, qPrintable(unit));
+        }
+    }
+
+    QList<Result> results;
+
+private:
+    QString filter;
+};
+
+// Seconds per call of body, averaged over as many calls as fit in minSampleNsecs
+double timePerCall(const std::function<void()> &body)
+{
+    qint64 calls = 0;
+    QElapsedTimer timer;
+    timer.start();
+    do {
+        body();
+        calls++;
+    } while (timer.nsecsElapsed() < minSampleNsecs);
+    return timer.nsecsElapsed() / 1e9 / calls;
+}
+
+// Runs the event loop until done() or the timeout, false on timeout
+bool waitFor(const std::function<bool()> &done, qint64 timeoutMsecs)
+{
+    QTimer tick;
+    tick.start(10); // Wakes the loop up to look at done() again
+    QElapsedTimer timer;
+    timer.start();
+    while (!done()) {
+        if (timer.elapsed() > timeoutMsecs) {
+            return false;
+        }
+        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
+    }
+    return true;
+}
+
+QString cipherName(quint8 cipher)
+{
+    return cipher == Crypto::Aes256Gcm ? "aes-256-gcm" : "chacha20-poly1305";
+}
+
+// A throwaway RSA key pair for the key wrap and the encrypted transfers
+bool writeRsaKeys(const QString &publicPath, const QString &privatePath)
+{
+    EVP_PKEY *key = nullptr;
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, nullptr);
+    bool made = ctx && EVP_PKEY_keygen_init(ctx) > 0 && EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, 2048) > 0
+                && EVP_PKEY_keygen(ctx, &key) > 0;
+    EVP_PKEY_CTX_free(ctx);
+
+    FILE *publicFile = made ? fopen(QFile::encodeName(publicPath).constData(), "wb") : nullptr;
+    FILE *privateFile = made ? fopen(QFile::encodeName(privatePath).constData(), "wb") : nullptr;
+    made = publicFile && privateFile && PEM_write_PUBKEY(publicFile, key) > 0
+           && PEM_write_PrivateKey(privateFile, key, nullptr, nullptr, 0, nullptr, nullptr) > 0;
+    if (publicFile) {
+        fclose(publicFile);
+    }
+    if (privateFile) {
+        fclose(privateFile);
+    }
+    EVP_PKEY_free(key);
+    return made;
+}
+
+void benchChunkCrypto(Report &report)
+{
+    const QList<qint64> chunkSizes = {4 * 1024, 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024, 4 * 1024 * 1024};
+    const qint64 sealedBytes = 32 * 1024 * 1024; // Sealed up front for the decrypt runs
+    QByteArray aad(frameHeaderSize + chunkHeaderSize, 'h');
+
+    for (quint8 cipher : Crypto::supportedCiphers()) {
+        QByteArray key = Crypto::randomKey();
+        for (qint64 size : chunkSizes) {
+            QString name = QString("crypto/%1/%2/%3").arg(cipherName(cipher)).arg(size); // %3 is the direction
+            Crypto sender;
+            Crypto receiver;
+            sender.setKey(Crypto::Cipher(cipher), key);
+
+            QByteArray chunk(size, 'x');
+            QByteArray out(size, Qt::Uninitialized);
+            char tag[Crypto::tagSize];
+            double seconds = timePerCall([&]() { sender.encryptChunk(chunk, aad, out.data(), tag); });
+            report.add(name.arg("encrypt"), size / seconds / megabyte, "MB/s", true);
+
+            // Nonces must line up, so the receiver opens a run of chunks sealed in order
+            int count = int(qMax<qint64>(2, sealedBytes / size));
+            QList<QByteArray> sealed(count);
+            QList<QByteArray> tags(count, QByteArray(Crypto::tagSize, Qt::Uninitialized));
+            sender.setKey(Crypto::Cipher(cipher), key);
+            for (int i = 0; i < count; ++i) {
+                sealed[i] = QByteArray(size, Qt::Uninitialized);
+                sender.encryptChunk(chunk, aad, sealed[i].data(), tags[i].data());
+            }
+            bool opened = true;
+            seconds = timePerCall([&]() {
+                receiver.setKey(Crypto::Cipher(cipher), key);
+                for (int i = 0; i < count; ++i) {
+                    opened = receiver.decryptChunk(sealed[i], aad, tags[i].constData(), out.data()) && opened;
+                }
+            }) / count;
+            if (opened) {
+                report.add(name.arg("decrypt"), size / seconds / megabyte, "MB/s", true);
+            }
+        }
+    }
+}
+
+// Batches over the crypto workers, at the transfer chunk size
+void benchBatchCrypto(Report &report)
+{
+    const qint64 chunkSize = 64 * 1024;
+    const int batchSize = 64;
+    int defaultWorkers = Crypto::workerCount();
+    QByteArray aad(frameHeaderSize + chunkHeaderSize, 'h');
+
+    for (quint8 cipher : Crypto::supportedCiphers()) {
+        QList<QByteArray> chunks(batchSize, QByteArray(chunkSize, 'x'));
+        QList<QByteArray> tags(batchSize, QByteArray(Crypto::tagSize, Qt::Uninitialized));
+        QList<Crypto::Chunk> batch;
+        for (int i = 0; i < batchSize; ++i) {
+            char *memory = chunks[i].data(); // Detached first, sealed in place
+            batch.append({QByteArrayView(memory, chunkSize), aad, memory, tags[i].data()});
+        }
+
+        for (int workers : {1, 2, 4, 8, 16}) {
+            Crypto::setWorkerCount(workers);
+            Crypto crypto;
+            crypto.setKey(Crypto::Cipher(cipher), Crypto::randomKey());
+            double seconds = timePerCall([&]() { crypto.encryptChunks(batch); });
+            report.add(QString("crypto/batch-encrypt/%1/threads-%2").arg(cipherName(cipher)).arg(workers),
+                       batchSize * chunkSize / seconds / megabyte, "MB/s", true);
+        }
+    }
+    Crypto::setWorkerCount(defaultWorkers);
+}
+
+void benchKeys(Report &report, const QString &publicPath, const QString &privatePath)
+{
+    Crypto crypto;
+    QByteArray sessionKey = Crypto::randomKey();
+    QByteArray wrapped;
+    double seconds = timePerCall([&]() { wrapped = crypto.encryptAESKey(sessionKey, publicPath); });
+    report.add("keys/rsa-wrap", seconds * 1e6, "us", false);
+    seconds = timePerCall([&]() { crypto.decryptAESKey(wrapped, privatePath); });
+    report.add("keys/rsa-unwrap", seconds * 1e6, "us", false);
+
+    // What a connection costs each side with the X25519 handshake
+    KeyManager::AgreementKey receiverKey = KeyManager::shared().agreementKey(privatePath);
+    if (receiverKey.key) {
+        seconds = timePerCall([&]() {
+            QSharedPointer<EVP_PKEY> senderKey = Crypto::newAgreementKey();
+            QByteArray senderPublic = Crypto::agreementPublicKey(senderKey.data());
+            Crypto sender;
+            Crypto receiver;
+            receiver.agreeKey(Crypto::Aes256Gcm, receiverKey.key.data(), senderPublic, senderPublic + receiverKey.publicKey);
+            KeyManager::shared().verifyAgreementKey(publicPath, receiverKey.publicKey, receiverKey.signature);
+            sender.agreeKey(Crypto::Aes256Gcm, senderKey.data(), receiverKey.publicKey, senderPublic + receiverKey.publicKey);
+        });
+        report.add("keys/x25519-handshake", seconds * 1e6, "us", false);
+    }
+
+    QSharedPointer<EVP_PKEY> rsaPrivate = KeyManager::shared().privateKey(privatePath);
+    QByteArray data = KeyManager::signedData(receiverKey.publicKey);
+    seconds = timePerCall([&]() { Crypto::sign(rsaPrivate.data(), data); });
+    report.add("keys/rsa-sign", seconds * 1e6, "us", false);
+}
+
+void benchProtocol(Report &report)
+{
+    const QString fileName = "holiday-photos-2024.tar";
+    QByteArray header;
+    double seconds = timePerCall([&]() {
+        header = message(FileHeader, qint64(42), fileName, qint64(1) << 32, qint64(1700000000000), qint64(0), qint64(8) << 20);
+    });
+    report.add("protocol/file-header/serialize", seconds * 1e9, "ns", false);
+
+    seconds = timePerCall([&]() {
+        QBuffer buffer(&header);
+        buffer.open(QIODevice::ReadOnly);
+        Frame frame;
+        readFrame(&buffer, frame);
+        QDataStream in(frame.payload);
+        in.setVersion(QDataStream::Qt_6_8);
+        qint64 token, fileSize, modified, offset, length;
+        QString name;
+        in >> token >> name >> fileSize >> modified >> offset >> length;
+    });
+    report.add("protocol/file-header/parse", seconds * 1e9, "ns", false);
+
+    char chunkHeader[frameHeaderSize + chunkHeaderSize];
+    seconds = timePerCall([&]() {
+        for (int i = 0; i < 1000; ++i) {
+            writeChunkHeader(chunkHeader, Compression::None, 64 * 1024 + i, 64 * 1024 + i);
+        }
+    }) / 1000;
+    report.add("protocol/chunk-header/serialize", seconds * 1e9, "ns", false);
+
+    // What a browser sends for a file, parsed whole and a few bytes at a time as a slow link delivers it
+    const QByteArray request = "GET /Ab3dEf9h/Share/holiday-photos-2024.tar HTTP/1.1\r\n"
+                               "Host: 192.168.1.20:11234\r\n"
+                               "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+                               "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+                               "Accept-Language: en-US,en;q=0.5\r\n"
+                               "Accept-Encoding: gzip, deflate\r\n"
+                               "Connection: keep-alive\r\n"
+                               "Range: bytes=1048576-\r\n"
+                               "If-Range: Mon, 01 Jan 2024 00:00:00 GMT\r\n"
+                               "\r\n";
+    HttpParser parser;
+    seconds = timePerCall([&]() {
+        parser.reset();
+        parser.parse(request);
+    });
+    report.add("protocol/http-request/parse", seconds * 1e9, "ns", false);
+
+    seconds = timePerCall([&]() {
+        parser.reset();
+        for (qsizetype received = 16; received < request.size(); received += 16) {
+            parser.parse(QByteArrayView(request).first(received));
+        }
+        parser.parse(request);
+    });
+    report.add("protocol/http-request/parse-16-byte-reads", seconds * 1e9, "ns", false);
+}
+
+struct Workload {
+    QString name;
+    QList<qint64> sizes;
+    bool text = false; // Compressible text instead of random bytes
+};
+
+struct Mode {
+    QString name;
+    bool encrypt = false;
+    bool tls = false;
+    bool zeroCopy = false;
+    DiskBackend::Kind disk = DiskBackend::Portable;
+    qint64 cacheBypass = 0;
+    bool compress = false;
+    IncomingFiles::Durability durability = IncomingFiles::NoSync;
+};
+
+QList<Workload> workloads(bool quick)
+{
+    QRandomGenerator random(42); // Same files every run
+    Workload huge{"huge", {qint64(quick ? 256 : 2048) * 1024 * 1024}};
+
+    Workload tiny{"tiny", {}};
+    for (int i = 0; i < (quick ? 1000 : 10000); ++i) {
+        tiny.sizes.append(random.bounded(100, 4096));
+    }
+
+    // Log-uniform from 1 KB to 64 MB, the shape of a typical folder
+    Workload mix{"mix", {}};
+    for (int i = 0; i < (quick ? 40 : 200); ++i) {
+        mix.sizes.append(qint64(1024 * std::pow(2.0, random.bounded(16.0))));
+    }
+
+    // Logs and sources, where compression should pay off; huge is the media side
+    Workload text{"text", {}, true};
+    for (int i = 0; i < (quick ? 16 : 64); ++i) {
+        text.sizes.append(qint64(random.bounded(1, 16)) * 1024 * 1024);
+    }
+    return {huge, tiny, mix, text};
+}
+
+QList<Mode> modes()
+{
+    QList<Mode> list;
+    list.append({"plain"});
+    if (ZeroCopy::isAvailable()) {
+        Mode mode{"zerocopy"};
+        mode.zeroCopy = true;
+        list.append(mode);
+    }
+    if (DiskBackend::isAvailable(DiskBackend::IoUring)) {
+        Mode mode{"iouring"};
+        mode.disk = DiskBackend::IoUring;
+        list.append(mode);
+    }
+    if (PageCache::isAvailable()) {
+        Mode mode{"cache-bypass"};
+        mode.cacheBypass = 1;
+        list.append(mode);
+    }
+    Mode encrypted{"encrypted"};
+    encrypted.encrypt = true;
+    list.append(encrypted);
+    if (QSslSocket::supportsSsl()) {
+        Mode tls{"tls"};
+        tls.tls = true;
+        list.append(tls);
+    }
+    Mode compressed{"compressed"};
+    compressed.compress = true;
+    list.append(compressed);
+    Mode syncEachFile{"sync-each-file"};
+    syncEachFile.durability = IncomingFiles::SyncEachFile;
+    list.append(syncEachFile);
+    Mode syncEachBatch{"sync-each-batch"};
+    syncEachBatch.durability = IncomingFiles::SyncEachBatch;
+    list.append(syncEachBatch);
+    return list;
+}
+
+// Not every mode is worth running on every workload
+bool measures(const Mode &mode, const Workload &workload)
+{
+    if (workload.text) {
+        return mode.name == "plain" || mode.compress; // Compression's break-even, against plain on the same data
+    }
+    if (mode.compress || mode.cacheBypass) {
+        return workload.name == "huge"; // Random data, what compression costs when it cannot win
+    }
+    if (mode.durability != IncomingFiles::NoSync) {
+        return workload.name == "tiny"; // Where a sync per file hurts
+    }
+    return true;
+}
+
+// Log lines made of a small vocabulary, compresses about as well as real logs
+QByteArray textBlock(qint64 size)
+{
+    static const char *const words[] = {"GET", "POST", "/index.html", "/api/files", "200", "304", "404", "user",
+                                        "session", "started", "finished", "request", "response", "bytes", "cache",
+                                        "miss", "hit", "connection", "closed", "timeout", "retry", "INFO", "WARN"};
+    QRandomGenerator random(11);
+    QByteArray block;
+    block.reserve(size + 256);
+    while (block.size() < size) {
+        block += QByteArray::number(1700000000 + qint64(block.size()) / 64);
+        for (int i = random.bounded(4, 12); i > 0; --i) {
+            block += ' ';
+            block += words[random.bounded(int(std::size(words)))];
+        }
+        block += ' ';
+        block += QByteArray::number(random.bounded(100000));
+        block += '\n';
+    }
+    block.truncate(size);
+    return block;
+}
+
+bool writeFiles(const QString &directory, const QList<qint64> &sizes, bool text, QStringList &paths)
+{
+    QByteArray block(1024 * 1024, Qt::Uninitialized);
+    if (text) {
+        block = textBlock(block.size());
+    } else {
+        QRandomGenerator random(7);
+        random.fillRange(reinterpret_cast<quint32*>(block.data()), block.size() / sizeof(quint32)); // Incompressible
+    }
+
+    for (int i = 0; i < sizes.size(); ++i) {
+        QFile file(QDir(directory).filePath(QString("file-%1.bin").arg(i)));
+        if (!file.open(QIODevice::WriteOnly)) {
+            return false;
+        }
+        for (qint64 written = 0; written < sizes[i];) {
+            qint64 step = qMin<qint64>(block.size(), sizes[i] - written);
+            if (file.write(block.constData(), step) != step) {
+                return false;
+            }
+            written += step;
+        }
+        paths.append(file.fileName());
+    }
+    return true;
+}
+
+// Percent of the file's pages in the page cache, -1 where that cannot be told
+double cacheResidency(const QString &path)
+{
+#ifdef Q_OS_LINUX
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly) || file.size() == 0) {
+        return -1;
+    }
+    uchar *memory = file.map(0, file.size());
+    long pageSize = sysconf(_SC_PAGESIZE);
+    QList<unsigned char> pages((file.size() + pageSize - 1) / pageSize);
+    bool counted = memory && mincore(memory, size_t(file.size()), pages.data()) == 0;
+    if (memory) {
+        file.unmap(memory);
+    }
+    qsizetype resident = std::count_if(pages.cbegin(), pages.cend(), [](unsigned char page) { return page & 1; });
+    return counted ? 100.0 * resident / pages.size() : -1;
+#else
+    Q_UNUSED(path);
+    return -1;
+#endif
+}
+
+class Loopback
+{
+public:
+    Loopback(const QString &publicPath, const QString &privatePath) : publicPath(publicPath)
+    {
+        server = new FileServer();
+        server->setAllowedIPs({"127.0.0.1"});
+        server->setRSAPrivateKeyPath(privatePath);
+        serverThread = new QThread();
+        server->moveToThread(serverThread);
+        serverThread->start();
+
+        client = new FileClient();
+        client->setDeduplicationEnabled(false);
+        QObject::connect(server, &FileServer::fileReceived, client, [this]() { received++; }, Qt::QueuedConnection);
+        QObject::connect(client, &FileClient::statusUpdated, client, [this](const QString &status) {
+            if (status.contains("Failed") || status.contains("refused") || status.contains("not match")) {
+                failure = status;
+            }
+        });
+    }
+
+    ~Loopback()
+    {
+        delete client;
+        serverThread->quit();
+        serverThread->wait();
+        delete server;
+        delete serverThread;
+    }
+
+    bool isListening() const { return server->isListening(); }
+
+    void apply(const Mode &mode)
+    {
+        client->disconnectFromServer();
+        waitFor([]() { return false; }, 50); // Let the old connection go
+        client->setEncryption(mode.encrypt, publicPath);
+        client->setTlsEnabled(mode.tls);
+        client->setZeroCopyEnabled(mode.zeroCopy);
+        client->setDiskBackend(mode.disk);
+        client->setCacheBypassThreshold(mode.cacheBypass);
+        client->setCompressionEnabled(mode.compress);
+        server->setZeroCopyEnabled(mode.zeroCopy);
+        server->setDurability(mode.durability);
+        server->setDiskBackend(mode.disk);
+        server->setCacheBypassThreshold(mode.cacheBypass);
+    }
+
+    // Seconds for the whole batch to land, -1 on failure
+    double send(const QStringList &paths, const QString &downloadDirectory)
+    {
+        server->setDownloadLocation(downloadDirectory);
+        waitFor([]() { return false; }, 20); // The receivers pick the location up on their threads
+        received = 0;
+        failure.clear();
+
+        QElapsedTimer timer;
+        timer.start();
+        client->sendFiles(paths, "127.0.0.1");
+        bool done = waitFor([&]() { return received >= paths.size() || !failure.isEmpty(); }, transferTimeout);
+        if (!done || !failure.isEmpty()) {
+            std::fprintf(stderr, "  transfer failed: %s\n", qPrintable(failure.isEmpty() ? QString("timed out") : failure));
+            return -1;
+        }
+        server->syncBatch(); // SyncEachBatch is only done once this is on disk too, nothing to do otherwise
+        return timer.nsecsElapsed() / 1e9;
+    }
+
+    // Connect to accepted, median over a run of fresh connections
+    double handshake(int connections)
+    {
+        QList<double> times;
+        for (int i = 0; i < connections; ++i) {
+            client->disconnectFromServer();
+            waitFor([]() { return false; }, 5);
+            QElapsedTimer timer;
+            timer.start();
+            if (!client->connectToServer("127.0.0.1")) {
+                return -1;
+            }
+            times.append(timer.nsecsElapsed() / 1e3);
+        }
+        std::sort(times.begin(), times.end());
+        return times[times.size() / 2];
+    }
+
+private:
+    QString publicPath;
+    FileServer *server;
+    QThread *serverThread;
+    FileClient *client;
+    qsizetype received = 0;
+    QString failure;
+};
+
+void benchTransfers(Report &report, bool quick, const QString &publicPath, const QString &privatePath, const QString &scratch)
+{
+    Loopback loopback(publicPath, privatePath);
+    if (!loopback.isListening()) {
+        std::fprintf(stderr, "Cannot listen on port %d, is LetsShare running?\n", int(port));
+        return;
+    }
+
+    for (const Mode &mode : modes()) {
+        // Only what changes the connection setup
+        if (report.wants("handshake/" + mode.name) && !mode.zeroCopy && mode.disk == DiskBackend::Portable && !mode.cacheBypass
+            && !mode.compress && mode.durability == IncomingFiles::NoSync) {
+            loopback.apply(mode);
+            double micros = loopback.handshake(quick ? 10 : 50);
+            if (micros >= 0) {
+                report.add("handshake/" + mode.name, micros, "us", false);
+            }
+        }
+    }
+
+    for (const Workload &workload : workloads(quick)) {
+        if (!report.wants("transfer/" + workload.name)) {
+            continue;
+        }
+
+        QString source = QDir(scratch).filePath("source-" + workload.name);
+        QStringList paths;
+        QDir().mkpath(source);
+        if (!writeFiles(source, workload.sizes, workload.text, paths)) {
+            std::fprintf(stderr, "Cannot write the %s files\n", qPrintable(workload.name));
+            continue;
+        }
+        qint64 totalBytes = 0;
+        for (qint64 size : workload.sizes) {
+            totalBytes += size;
+        }
+
+        for (const Mode &mode : modes()) {
+            QString name = QString("transfer/%1/%2").arg(workload.name, mode.name);
+            if (!report.wants(name) || !measures(mode, workload)) {
+                continue;
+            }
+
+            // A fresh directory, or the receiver would find every file already there
+            QString download = QDir(scratch).filePath("received-" + workload.name + "-" + mode.name);
+            QDir().mkpath(download);
+            loopback.apply(mode);
+            quint64 slabsBefore = BufferPool::shared().stats().slabs;
+            std::clock_t cpuStart = std::clock();
+            double seconds = loopback.send(paths, download);
+            double cpuSeconds = double(std::clock() - cpuStart) / CLOCKS_PER_SEC;
+            if (seconds > 0) {
+                // Sender and receiver share the pool here, once it is warm a run should not grow it
+                report.add(name + "/pool-slabs", double(BufferPool::shared().stats().slabs - slabsBefore), "slabs", false);
+                report.add(name + "/throughput", totalBytes / seconds / megabyte, "MB/s", true);
+                report.add(name + "/files", paths.size() / seconds, "files/s", true);
+                report.add(name + "/cpu", cpuSeconds * 1024 * megabyte / totalBytes, "cpu-s/GB", false);
+                double resident = workload.name == "huge" ? cacheResidency(QDir(download).filePath(QFileInfo(paths.first()).fileName())) : -1;
+                if (resident >= 0) {
+                    report.add(name + "/cache-resident", resident, "%", false);
+                }
+            }
+            QDir(download).removeRecursively();
+        }
+        QDir(source).removeRecursively();
+    }
+
+    // Over every run above
+    BufferPool::Stats pool = BufferPool::shared().stats();
+    report.add("pool/acquired", double(pool.acquired), "buffers", false);
+    report.add("pool/slabs", double(pool.slabs), "slabs", false);
+    report.add("pool/huge-page-slabs", double(pool.hugePageSlabs), "slabs", true);
+    report.add("pool/peak-outstanding", pool.peakOutstanding, "buffers", false);
+    report.add("pool/outstanding", pool.outstanding, "buffers", false);
+    report.add("pool/free", pool.free, "buffers", false);
+}
+
+// Requests for a small shared file against the HTTP server: one connection
+// per request, one kept-alive connection, and pipelined batches on one
+void benchHttp(Report &report, bool quick, const QString &scratch)
+{
+    const int requests = quick ? 200 : 2000;
+    const int pipelineDepth = 16;
+
+    QString sharedPath = QDir(scratch).filePath("http-small.txt");
+    QFile shared(sharedPath);
+    if (!shared.open(QIODevice::WriteOnly) || shared.write(QByteArray(4096, 'x')) != 4096) {
+        return;
+    }
+    shared.close();
+
+    HttpServer *server = new HttpServer();
+    QString url;
+    QObject::connect(server, &HttpServer::serverStarted, server, [&url](const QString &started) { url = started; });
+    server->setAllowedIPs({"127.0.0.1"});
+    server->addSharedFile(sharedPath);
+    if (!waitFor([&]() { return !url.isEmpty(); }, 5000)) {
+        std::fprintf(stderr, "The HTTP server did not start, is LetsShare running?\n");
+        delete server;
+        return;
+    }
+    QUrl base(url);
+    QByteArray target = base.path().toUtf8() + "http-small.txt";
+
+    // How many of the expected responses came in whole (by Content-Length) before the connection closed
+    auto readResponses = [](QTcpSocket &socket, QByteArray &buffer, int expected) {
+        int complete = 0;
+        waitFor([&]() {
+            buffer += socket.readAll();
+            qsizetype end;
+            while ((end = buffer.indexOf("\r\n\r\n")) >= 0) {
+                qsizetype lengthAt = buffer.indexOf("Content-Length: ");
+                qint64 length = buffer.mid(lengthAt + 16, buffer.indexOf("\r\n", lengthAt) - lengthAt - 16).toLongLong();
+                if (buffer.size() < end + 4 + length) {
+                    break;
+                }
+                buffer.remove(0, end + 4 + length);
+                complete++;
+            }
+            return complete >= expected || socket.state() == QAbstractSocket::UnconnectedState;
+        }, 5000);
+        return complete;
+    };
+
+    QByteArray request = "GET " + target + " HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+    QByteArray closingRequest = "GET " + target + " HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: close\r\n\r\n";
+
+    if (report.wants("http/new-connection")) {
+        QElapsedTimer timer;
+        timer.start();
+        int served = 0;
+        for (; served < requests; ++served) {
+            QTcpSocket socket;
+            QByteArray buffer;
+            socket.connectToHost(QHostAddress::LocalHost, base.port());
+            socket.write(closingRequest);
+            if (readResponses(socket, buffer, 1) != 1) {
+                break;
+            }
+        }
+        if (served == requests) {
+            report.add("http/new-connection", requests / (timer.nsecsElapsed() / 1e9), "requests/s", true);
+        }
+    }
+
+    for (int depth : {1, pipelineDepth}) {
+        QString name = depth == 1 ? "http/keep-alive" : "http/pipelined";
+        if (!report.wants(name)) {
+            continue;
+        }
+        // The server closes after its per-connection cap, so reconnect when it does
+        QTcpSocket socket;
+        QByteArray buffer;
+        QElapsedTimer timer;
+        timer.start();
+        int served = 0;
+        while (served < requests) {
+            if (socket.state() != QAbstractSocket::ConnectedState) {
+                socket.abort();
+                buffer.clear();
+                socket.connectToHost(QHostAddress::LocalHost, base.port());
+                if (!waitFor([&]() { return socket.state() == QAbstractSocket::ConnectedState; }, 5000)) {
+                    break;
+                }
+            }
+            QByteArray batch;
+            for (int i = 0; i < depth; ++i) {
+                batch += request;
+            }
+            socket.write(batch);
+            int answered = readResponses(socket, buffer, depth);
+            if (answered == 0 || (answered < depth && socket.state() == QAbstractSocket::ConnectedState)) {
+                break; // Fewer answers are only fine when the cap closed the connection part way
+            }
+            served += answered;
+        }
+        if (served >= requests) {
+            report.add(name, served / (timer.nsecsElapsed() / 1e9), "requests/s", true);
+        }
+    }
+
+    server->stopServer();
+    delete server;
+}
+
+QJsonObject toJson(const QList<Result> &results)
+{
+    QJsonArray list;
+    for (const Result &result : results) {
+        list.append(QJsonObject{{"name", result.name}, {"value", result.value},
+                                {"unit", result.unit}, {"higherIsBetter", result.higherIsBetter}});
+    }
+
+    QJsonObject machine{{"cpu", QSysInfo::currentCpuArchitecture()}, {"os", QSysInfo::prettyProductName()},
+                        {"threads", QThread::idealThreadCount()}};
+    return QJsonObject{{"tool", "LetsShareBench"}, {"protocolVersion", int(version)},
+                       {"date", QDateTime::currentDateTimeUtc().toString(Qt::ISODate)},
+                       {"machine", machine}, {"results", list}};
+}
+
+QList<Result> fromJson(const QJsonObject &object)
+{
+    QList<Result> results;
+    for (const QJsonValue &value : object["results"].toArray()) {
+        QJsonObject result = value.toObject();
+        results.append({result["name"].toString(), result["value"].toDouble(),
+                        result["unit"].toString(), result["higherIsBetter"].toBool(true)});
+    }
+    return results;
+}
+
+bool readJson(const QString &path, QJsonObject &object)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        std::fprintf(stderr, "Cannot read %s\n", qPrintable(path));
+        return false;
+    }
+    object = QJsonDocument::fromJson(file.readAll()).object();
+    return !object.isEmpty();
+}
+
+// Table of changes to stderr, the number of results worse than threshold percent
+int compare(const QList<Result> &baseline, const QList<Result> &current, double threshold)
+{
+    QHash<QString, Result> before;
+    for (const Result &result : baseline) {
+        before.insert(result.name, result);
+    }
+
+    int regressions = 0;
+    std::fprintf(stderr, "\n%-56s %14s %14s %9s\n", "benchmark", "baseline", "current", "change");
+    for (const Result &result : current) {
+        auto found = before.constFind(result.name);
+        if (found == before.constEnd() || found->value == 0) {
+            std::fprintf(stderr, "%-56s %14s %14.2f %9s\n", qPrintable(result.name), "-", result.value, "new");
+            continue;
+        }
+
+        // Positive is better, whichever way the unit goes
+        double change = (result.value - found->value) / found->value * 100.0;
+        if (!result.higherIsBetter) {
+            change = -change;
+        }
+        bool worse = change < -threshold;
+        regressions += worse ? 1 : 0;
+        std::fprintf(stderr, "%-56s %14.2f %14.2f %+8.1f%%%s\n", qPrintable(result.name), found->value, result.value,
+                     change, worse ? "  REGRESSION" : "");
+    }
+    std::fprintf(stderr, "%d regression(s) beyond %.1f%%\n", regressions, threshold);
+    return regressions;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("LetsShareBench");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Crypto, protocol and loopback transfer benchmarks for LetsShare.");
+    parser.addHelpOption();
+    QCommandLineOption outputOption("output", "Write the results as JSON to <file> (default: stdout).", "file");
+    QCommandLineOption baselineOption("baseline", "Compare against the results saved in <file>.", "file");
+    QCommandLineOption currentOption("current", "With --baseline: compare <file> instead of running.", "file");
+    QCommandLineOption thresholdOption("threshold", "Percent a result may get worse before it counts (default 5).", "percent", "5");
+    QCommandLineOption filterOption("filter", "Only run benchmarks whose name contains <text>.", "text");
+    QCommandLineOption quickOption("quick", "Smaller transfers, for a fast sanity run.");
+    QCommandLineOption verboseOption("verbose", "Keep the debug output of the transfer code.");
+    parser.addOptions({outputOption, baselineOption, currentOption, thresholdOption, filterOption, quickOption, verboseOption});
+    parser.process(app);
+
+    if (!parser.isSet(verboseOption)) {
+        qInstallMessageHandler([](QtMsgType type, const QMessageLogContext &, const QString &message) {
+            if (type != QtDebugMsg && type != QtInfoMsg) {
+                std::fprintf(stderr, "%s\n", qPrintable(message));
+            }
+        });
+    }
+
+    double threshold = parser.value(thresholdOption).toDouble();
+    QJsonObject baseline;
+    if (parser.isSet(baselineOption) && !readJson(parser.value(baselineOption), baseline)) {
+        return 2;
+    }
+
+    QList<Result> results;
+    if (parser.isSet(currentOption)) {
+        QJsonObject current;
+        if (!readJson(parser.value(currentOption), current)) {
+            return 2;
+        }
+        results = fromJson(current);
+    } else {
+        QTemporaryDir scratch;
+        QString publicPath = QDir(scratch.path()).filePath("bench-public.pem");
+        QString privatePath = QDir(scratch.path()).filePath("bench-private.pem");
+        if (!scratch.isValid() || !writeRsaKeys(publicPath, privatePath)) {
+            std::fprintf(stderr, "Cannot set up the scratch directory\n");
+            return 2;
+        }
+
+        Report report(parser.value(filterOption));
+        if (report.wants("crypto/")) {
+            benchChunkCrypto(report);
+            benchBatchCrypto(report);
+        }
+        if (report.wants("keys/")) {
+            benchKeys(report, publicPath, privatePath);
+        }
+        if (report.wants("protocol/")) {
+            benchProtocol(report);
+        }
+        if (report.wants("http/")) {
+            benchHttp(report, parser.isSet(quickOption), scratch.path());
+        }
+        if (report.wants("handshake/") || report.wants("transfer/")) {
+            benchTransfers(report, parser.isSet(quickOption), publicPath, privatePath, scratch.path());
+        }
+        results = report.results;
+
+        QByteArray json = QJsonDocument(toJson(results)).toJson();
+        if (parser.isSet(outputOption)) {
+            QFile output(parser.value(outputOption));
+            if (!output.open(QIODevice::WriteOnly) || output.write(json) != json.size()) {
+                std::fprintf(stderr, "Cannot write %s\n", qPrintable(parser.value(outputOption)));
+                return 2;
+            }
+        } else {
+            std::fwrite(json.constData(), 1, size_t(json.size()), stdout);
+        }
+    }
+
+    if (!baseline.isEmpty()) {
+        return compare(fromJson(baseline), results, threshold) > 0 ? 1 : 0;
+    }
+    return 0;
+}
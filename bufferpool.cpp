@@ -0,0 +1,181 @@
+#include "bufferpool.h"
+
+#include <utility>
+
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#endif
+#ifdef Q_OS_WIN
+#include <windows.h>
+#endif
+
+namespace {
+
+const qint64 sharedReserve = 4 * 1024 * 1024; // 64 chunks: a sender's read-ahead, or a receiver's burst
+
+char *allocatePages(qint64 size, bool hugePages, bool &huge)
+{
+    huge = false;
+#if defined(Q_OS_LINUX)
+    // Explicit huge pages only exist when the admin reserved some, transparent ones are the fallback
+    if (hugePages) {
+        void *memory = ::mmap(nullptr, size_t(size), PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (memory != MAP_FAILED) {
+            huge = true;
+            return static_cast<char *>(memory);
+        }
+    }
+    void *memory = ::mmap(nullptr, size_t(size), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return nullptr;
+    }
+    if (hugePages) {
+        ::madvise(memory, size_t(size), MADV_HUGEPAGE);
+    }
+    return static_cast<char *>(memory);
+#elif defined(Q_OS_UNIX)
+    Q_UNUSED(hugePages);
+    void *memory = ::mmap(nullptr, size_t(size), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    return memory == MAP_FAILED ? nullptr : static_cast<char *>(memory);
+#elif defined(Q_OS_WIN)
+    Q_UNUSED(hugePages); // Large pages need a privilege ordinary accounts do not have
+    return static_cast<char *>(VirtualAlloc(nullptr, SIZE_T(size), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+#endif
+}
+
+void freePages(char *memory, qint64 size)
+{
+#if defined(Q_OS_UNIX)
+    ::munmap(memory, size_t(size));
+#elif defined(Q_OS_WIN)
+    Q_UNUSED(size);
+    VirtualFree(memory, 0, MEM_RELEASE);
+#endif
+}
+
+}
+
+BufferPool::Buffer::Buffer(Buffer &&other) noexcept
+    : pool(std::exchange(other.pool, nullptr)), memory(std::exchange(other.memory, nullptr)),
+      begin(std::exchange(other.begin, 0)), end(std::exchange(other.end, 0))
+{
+}
+
+BufferPool::Buffer &BufferPool::Buffer::operator=(Buffer &&other) noexcept
+{
+    if (this != &other) {
+        release();
+        pool = std::exchange(other.pool, nullptr);
+        memory = std::exchange(other.memory, nullptr);
+        begin = std::exchange(other.begin, 0);
+        end = std::exchange(other.end, 0);
+    }
+    return *this;
+}
+
+void BufferPool::Buffer::release()
+{
+    if (memory) {
+        pool->giveBack(memory);
+    }
+    pool = nullptr;
+    memory = nullptr;
+    begin = 0;
+    end = 0;
+}
+
+BufferPool &BufferPool::shared()
+{
+    static BufferPool pool(sharedReserve, true);
+    return pool;
+}
+
+BufferPool::BufferPool(qint64 reservedBytes, bool hugePages)
+    : hugePages(hugePages), reservedMemory(nullptr), reservedBytes(0)
+{
+    // Pages are only touched, and so only really allocated, once a buffer is used
+    QMutexLocker locker(&mutex);
+    qint64 size = (qMax(reservedBytes, slabSize) + slabSize - 1) / slabSize * slabSize;
+    if (addSlab(size)) {
+        reservedMemory = slabs.first().memory;
+        this->reservedBytes = size;
+    }
+}
+
+BufferPool::~BufferPool()
+{
+    Q_ASSERT(counters.outstanding == 0);
+    for (const Slab &slab : std::as_const(slabs)) {
+        freePages(slab.memory, slab.size);
+    }
+}
+
+BufferPool::Buffer BufferPool::acquire()
+{
+    QMutexLocker locker(&mutex);
+    if (freeBuffers.isEmpty() && !addSlab(slabSize)) {
+        return Buffer();
+    }
+
+    Buffer buffer;
+    buffer.pool = this;
+    buffer.memory = freeBuffers.takeLast(); // The most recently used, likely still in the cache
+    counters.acquired++;
+    counters.outstanding++;
+    counters.peakOutstanding = qMax(counters.peakOutstanding, counters.outstanding);
+    return buffer;
+}
+
+BufferPool::Stats BufferPool::stats() const
+{
+    QMutexLocker locker(&mutex);
+    Stats stats = counters;
+    stats.free = freeBuffers.size();
+    return stats;
+}
+
+bool BufferPool::isReserved(const char *data, qint64 size) const
+{
+    return reservedMemory && data >= reservedMemory && data + size <= reservedMemory + reservedBytes;
+}
+
+bool BufferPool::addSlab(qint64 size)
+{
+    bool huge;
+    char *memory = allocatePages(size, hugePages, huge);
+    if (!memory) {
+        return false;
+    }
+
+    slabs.append({memory, size});
+    counters.slabs++;
+    counters.hugePageSlabs += huge ? 1 : 0;
+
+    // Room for every buffer at once, so giving them back never allocates
+    qint64 total = 0;
+    for (const Slab &slab : std::as_const(slabs)) {
+        total += slab.size / bufferSize;
+    }
+    freeBuffers.reserve(total);
+    for (qint64 offset = size - bufferSize; offset >= 0; offset -= bufferSize) {
+        freeBuffers.append(memory + offset);
+    }
+    return true;
+}
+
+void BufferPool::giveBack(char *memory)
+{
+    QMutexLocker locker(&mutex);
+    freeBuffers.append(memory);
+    counters.outstanding--;
+}
+
+QDebug operator<<(QDebug debug, const BufferPool::Stats &stats)
+{
+    QDebugStateSaver saver(debug);
+    debug.nospace() << "BufferPool(acquired " << stats.acquired << ", slabs " << stats.slabs << " (" << stats.hugePageSlabs
+                    << " huge), outstanding " << stats.outstanding << ", peak " << stats.peakOutstanding << ", free "
+                    << stats.free << ')';
+    return debug;
+}
@@ -0,0 +1,101 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <QByteArrayView>
+#include <QDebug>
+#include <QMutex>
+#include <QList>
+#include <QtGlobal>
+
+// Fixed-size, page-aligned buffers for the chunks of the transfer paths.
+// A buffer is taken with acquire() and goes back to the pool when its handle
+// is released or destroyed, on whatever thread that happens. Memory comes
+// from the system in slabs of many buffers, backed by huge pages where the
+// system has them, and is kept for reuse: once a transfer has warmed the pool
+// up, its chunks no longer touch the heap. stats() shows whether they do.
+class BufferPool
+{
+public:
+    static constexpr qint64 bufferSize = 64 * 1024;     // The transfer chunk size
+    static constexpr qint64 slabSize = 2 * 1024 * 1024; // One huge page
+
+    // Move-only handle to one buffer. The bytes in use start at data() and
+    // may be moved forward with skip(), e.g. past a header read with them.
+    class Buffer
+    {
+    public:
+        Buffer() = default;
+        Buffer(Buffer &&other) noexcept;
+        Buffer &operator=(Buffer &&other) noexcept;
+        ~Buffer() { release(); }
+
+        bool isNull() const { return memory == nullptr; }
+        char *data() { return memory + begin; }
+        const char *constData() const { return memory + begin; }
+        qint64 capacity() const { return bufferSize - begin; }
+        qint64 size() const { return end - begin; }
+        void setSize(qint64 size) { end = begin + qBound<qint64>(0, size, capacity()); }
+        void skip(qint64 bytes) { begin = qMin(begin + qMax<qint64>(bytes, 0), end); }
+
+        // The bytes in use, valid while the buffer is held
+        QByteArrayView view() const { return QByteArrayView(constData(), size()); }
+
+        void release(); // Back to the pool now rather than with the handle
+
+    private:
+        friend class BufferPool;
+        Q_DISABLE_COPY(Buffer)
+
+        BufferPool *pool = nullptr;
+        char *memory = nullptr;
+        qint64 begin = 0;
+        qint64 end = 0;
+    };
+
+    struct Stats {
+        quint64 acquired = 0;       // Buffers handed out
+        quint64 slabs = 0;          // Times the pool went to the system for memory
+        quint64 hugePageSlabs = 0;  // Of those, backed by huge pages
+        int outstanding = 0;        // Handed out and not back yet
+        int peakOutstanding = 0;
+        int free = 0;
+    };
+
+    // Shared by every transfer path. Its first reservedBytes are one region
+    // set aside up front, which io_uring can register with the kernel.
+    static BufferPool &shared();
+
+    BufferPool(qint64 reservedBytes, bool hugePages);
+    ~BufferPool(); // Every buffer must be back
+
+    Buffer acquire(); // A null buffer only when the system is out of memory
+    Stats stats() const;
+
+    const char *reserved() const { return reservedMemory; }
+    qint64 reservedSize() const { return reservedBytes; }
+    bool isReserved(const char *data, qint64 size) const; // Lies inside the reserved region
+
+private:
+    Q_DISABLE_COPY(BufferPool)
+
+    struct Slab {
+        char *memory;
+        qint64 size;
+    };
+
+    bool addSlab(qint64 size); // Its buffers go on the free list; called with the mutex held
+    void giveBack(char *memory);
+
+    mutable QMutex mutex;
+    bool hugePages;
+    char *reservedMemory;
+    qint64 reservedBytes;
+    QList<Slab> slabs;
+    QList<char*> freeBuffers;
+    Stats counters;
+};
+
+// Steady state is slabs staying put while acquired climbs
+QDebug operator<<(QDebug debug, const BufferPool::Stats &stats);
+
+#endif // BUFFERPOOL_H
@@ -0,0 +1,118 @@
+#include "compression.h"
+
+#include <cstring>
+
+#ifdef LETSSHARE_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace Compression {
+
+namespace {
+
+const qsizetype sampleSize = 4 * 1024;
+const int zlibLevel = 1;
+const int zstdLevel = 1;
+
+#ifdef LETSSHARE_HAVE_ZSTD
+// One context per thread so the zstd tables are not rebuilt for every chunk
+struct ZstdContexts {
+    ZSTD_CCtx *compress = ZSTD_createCCtx();
+    ZSTD_DCtx *decompress = ZSTD_createDCtx();
+
+    ~ZstdContexts()
+    {
+        ZSTD_freeCCtx(compress);
+        ZSTD_freeDCtx(decompress);
+    }
+};
+
+ZstdContexts &zstdContexts()
+{
+    thread_local ZstdContexts contexts;
+    return contexts;
+}
+#endif
+
+}
+
+QList<quint8> supportedCodecs()
+{
+#ifdef LETSSHARE_HAVE_ZSTD
+    return {Zstd, Zlib};
+#else
+    return {Zlib};
+#endif
+}
+
+bool isSupported(quint8 codec)
+{
+    return codec == None || supportedCodecs().contains(codec);
+}
+
+bool looksCompressible(Codec codec, QByteArrayView chunk)
+{
+    // Media and archives barely shrink; one small trial keeps us from burning
+    // CPU on the whole chunk for nothing
+    if (chunk.size() <= sampleSize) {
+        return true;
+    }
+
+    char packed[sampleSize];
+    return compress(codec, chunk.first(sampleSize), packed, sampleSize * 9 / 10) > 0;
+}
+
+qint64 compress(Codec codec, QByteArrayView chunk, char *out, qint64 capacity)
+{
+    if (codec == Zlib) {
+        QByteArray packed = qCompress(reinterpret_cast<const uchar *>(chunk.data()), chunk.size(), zlibLevel);
+        if (packed.isEmpty() || packed.size() > capacity) {
+            return -1;
+        }
+        std::memcpy(out, packed.constData(), size_t(packed.size()));
+        return packed.size();
+    }
+
+#ifdef LETSSHARE_HAVE_ZSTD
+    if (codec == Zstd) {
+        // Fails with dstSize_tooSmall rather than overrun out
+        size_t size = ZSTD_compressCCtx(zstdContexts().compress, out, size_t(capacity),
+                                        chunk.data(), size_t(chunk.size()), zstdLevel);
+        return ZSTD_isError(size) ? -1 : qint64(size);
+    }
+#endif
+
+    return -1;
+}
+
+bool decompress(Codec codec, QByteArrayView payload, char *out, qint64 rawSize)
+{
+    if (codec == None) {
+        if (payload.size() != rawSize) {
+            return false;
+        }
+        std::memcpy(out, payload.data(), size_t(rawSize));
+        return true;
+    }
+
+    if (codec == Zlib) {
+        QByteArray chunk = qUncompress(reinterpret_cast<const uchar *>(payload.data()), payload.size());
+        if (chunk.size() != rawSize) {
+            return false;
+        }
+        std::memcpy(out, chunk.constData(), size_t(rawSize));
+        return true;
+    }
+
+#ifdef LETSSHARE_HAVE_ZSTD
+    if (codec == Zstd) {
+        size_t size = ZSTD_decompressDCtx(zstdContexts().decompress, out, size_t(rawSize),
+                                          payload.data(), size_t(payload.size()));
+        return !ZSTD_isError(size) && qint64(size) == rawSize;
+    }
+#endif
+
+    return false;
+}
+
+}
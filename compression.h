@@ -0,0 +1,31 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <QByteArray>
+#include <QByteArrayView>
+#include <QList>
+
+// Per-chunk compression for the transfer port. zlib (through qCompress) is
+// always there, zstd is used when the build found it. The codec is agreed
+// per connection and every chunk says whether it was actually compressed.
+// Chunks are packed into and unpacked into caller memory, a pool buffer on
+// the transfer paths; zstd does that without any allocation of its own.
+namespace Compression {
+
+enum Codec : quint8 {
+    None = 0,
+    Zlib = 1,
+    Zstd = 2
+};
+
+const qint64 maxChunkSize = 16 * 1024 * 1024; // Refuse frames claiming more than this
+
+QList<quint8> supportedCodecs(); // Best first
+bool isSupported(quint8 codec);
+bool looksCompressible(Codec codec, QByteArrayView chunk); // Cheap test on a small sample
+qint64 compress(Codec codec, QByteArrayView chunk, char *out, qint64 capacity); // Bytes packed, -1 if it failed or did not fit
+bool decompress(Codec codec, QByteArrayView payload, char *out, qint64 rawSize); // Exactly rawSize bytes at out
+
+}
+
+#endif // COMPRESSION_H
@@ -0,0 +1,230 @@
+#include "contentindex.h"
+
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QCryptographicHash>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+ContentIndex::ContentIndex() : scanned(false)
+{
+}
+
+void ContentIndex::setRoot(const QString &path)
+{
+    QMutexLocker locker(&mutex);
+    if (root == path) {
+        return;
+    }
+
+    // The walk happens on the first lookup, not here on the caller's thread
+    root = path;
+    scanned = false;
+    entries.clear();
+    pathsBySize.clear();
+}
+
+QString ContentIndex::find(const QByteArray &contentHash, qint64 size)
+{
+    if (contentHash.isEmpty()) {
+        return QString();
+    }
+
+    QStringList candidates;
+    {
+        QMutexLocker locker(&mutex);
+        if (!scanned) {
+            scanLocked();
+        }
+        candidates = pathsBySize.values(size);
+    }
+
+    bool learned = false;
+    QString match;
+
+    for (const QString &path : candidates) {
+        QFileInfo fileInfo(path);
+        qint64 modified = fileInfo.lastModified().toMSecsSinceEpoch();
+
+        QByteArray hash;
+        {
+            QMutexLocker locker(&mutex);
+            if (!entries.contains(path)) {
+                continue;
+            }
+            const Entry &entry = entries[path];
+            if (!fileInfo.isFile() || fileInfo.size() != entry.size || modified != entry.modified) {
+                // Changed or gone since the walk, forget it
+                entries.remove(path);
+                pathsBySize.remove(size, path);
+                continue;
+            }
+            hash = entry.hash;
+        }
+
+        if (hash.isEmpty()) {
+            // Hash outside the lock, this can take a while for big files
+            hash = hashFile(path);
+            if (hash.isEmpty()) {
+                continue;
+            }
+
+            QMutexLocker locker(&mutex);
+            if (entries.contains(path)) {
+                entries[path].hash = hash;
+                learned = true;
+            }
+        }
+
+        if (hash == contentHash) {
+            match = path;
+            break;
+        }
+    }
+
+    if (learned) {
+        QMutexLocker locker(&mutex);
+        saveLocked();
+    }
+    return match;
+}
+
+void ContentIndex::add(const QString &filePath, const QByteArray &contentHash)
+{
+    QFileInfo fileInfo(filePath);
+    if (!fileInfo.isFile()) {
+        return;
+    }
+
+    QMutexLocker locker(&mutex);
+    if (!scanned) {
+        return; // The walk will pick it up
+    }
+
+    QString path = fileInfo.absoluteFilePath();
+    if (entries.contains(path)) {
+        pathsBySize.remove(entries[path].size, path);
+    }
+
+    entries[path] = {fileInfo.size(), fileInfo.lastModified().toMSecsSinceEpoch(), contentHash};
+    pathsBySize.insert(fileInfo.size(), path);
+    if (!contentHash.isEmpty()) {
+        saveLocked();
+    }
+}
+
+void ContentIndex::scanLocked()
+{
+    scanned = true;
+    if (root.isEmpty()) {
+        return;
+    }
+
+    // Hashes we computed in an earlier session, valid while size and mtime match
+    QJsonObject saved;
+    QFile indexFile(indexPath());
+    if (indexFile.open(QIODevice::ReadOnly)) {
+        saved = QJsonDocument::fromJson(indexFile.readAll()).object();
+        indexFile.close();
+    }
+
+    QDirIterator it(root, QDir::Files | QDir::NoDotAndDotDot, QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        QFileInfo fileInfo = it.nextFileInfo();
+        QString suffix = fileInfo.suffix();
+        if (suffix == "lsjournal" || suffix == "lspart" || suffix == "lsdelta" || suffix == "lsdedup" || fileInfo.fileName() == ".lsindex.json") {
+            continue; // Our own bookkeeping and half-written files
+        }
+
+        QString path = fileInfo.absoluteFilePath();
+        Entry entry = {fileInfo.size(), fileInfo.lastModified().toMSecsSinceEpoch(), QByteArray()};
+
+        QJsonObject known = saved[path].toObject();
+        if (known["size"].toInteger() == entry.size && known["modified"].toInteger() == entry.modified) {
+            entry.hash = QByteArray::fromHex(known["hash"].toString().toLatin1());
+        }
+
+        entries[path] = entry;
+        pathsBySize.insert(entry.size, path);
+    }
+}
+
+void ContentIndex::saveLocked()
+{
+    if (root.isEmpty()) {
+        return;
+    }
+
+    // Only hashed entries are worth keeping, the rest is a cheap stat away
+    QJsonObject saved;
+    for (auto it = entries.constBegin(); it != entries.constEnd(); ++it) {
+        if (it.value().hash.isEmpty()) {
+            continue;
+        }
+        QJsonObject known;
+        known["size"] = it.value().size;
+        known["modified"] = it.value().modified;
+        known["hash"] = QString::fromLatin1(it.value().hash.toHex());
+        saved[it.key()] = known;
+    }
+
+    QFile indexFile(indexPath());
+    if (indexFile.open(QIODevice::WriteOnly)) {
+        indexFile.write(QJsonDocument(saved).toJson(QJsonDocument::Compact));
+        indexFile.close();
+    }
+}
+
+QString ContentIndex::indexPath() const
+{
+    return QDir(root).filePath(".lsindex.json");
+}
+
+QByteArray ContentIndex::hashFile(const QString &filePath)
+{
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return QByteArray();
+    }
+
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    if (!hash.addData(&file)) {
+        return QByteArray();
+    }
+    return hash.result();
+}
+
+bool ContentIndex::materialize(const QString &source, const QString &target)
+{
+    // Build next to the target first so a failure never leaves a half file behind
+    QString temp = target + ".lsdedup";
+    QFile::remove(temp);
+
+#ifdef Q_OS_WIN
+    bool linked = CreateHardLinkW(reinterpret_cast<LPCWSTR>(QDir::toNativeSeparators(temp).utf16()),
+                                  reinterpret_cast<LPCWSTR>(QDir::toNativeSeparators(source).utf16()), nullptr);
+#else
+    bool linked = ::link(QFile::encodeName(source).constData(), QFile::encodeName(temp).constData()) == 0;
+#endif
+
+    if (!linked && !QFile::copy(source, temp)) {
+        QFile::remove(temp);
+        return false;
+    }
+
+    QFile::remove(target);
+    if (!QFile::rename(temp, target)) {
+        QFile::remove(temp);
+        return false;
+    }
+    return true;
+}
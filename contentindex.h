@@ -0,0 +1,45 @@
+#ifndef CONTENTINDEX_H
+#define CONTENTINDEX_H
+
+#include <QString>
+#include <QByteArray>
+#include <QHash>
+#include <QMultiHash>
+#include <QMutex>
+
+// Remembers what content already sits under the download location so a
+// sender can be told "I have that" instead of streaming the bytes again.
+// Files are grouped by size from a one-time directory walk, and a file is
+// only hashed the first time something of the same size is looked up.
+// Hashes are persisted in .lsindex.json at the root. Thread safe.
+class ContentIndex
+{
+public:
+    ContentIndex();
+
+    void setRoot(const QString &path);
+    QString find(const QByteArray &contentHash, qint64 size); // Path of a file with this content, or empty
+    void add(const QString &filePath, const QByteArray &contentHash = QByteArray());
+
+    static QByteArray hashFile(const QString &filePath); // SHA-256 of the whole file, empty on error
+    static bool materialize(const QString &source, const QString &target); // Hard link, or copy if that fails
+
+private:
+    struct Entry {
+        qint64 size;
+        qint64 modified;
+        QByteArray hash; // Empty until first needed
+    };
+
+    void scanLocked();
+    void saveLocked();
+    QString indexPath() const;
+
+    QMutex mutex;
+    QString root;
+    bool scanned;
+    QHash<QString, Entry> entries;          // By absolute path
+    QMultiHash<qint64, QString> pathsBySize;
+};
+
+#endif // CONTENTINDEX_H
@@ -3,26 +3,90 @@
 
 #include <QObject>
 #include <QByteArray>
+#include <QByteArrayView>
+#include <QList>
+#include <QSharedPointer>
 #include <openssl/evp.h>
 #include <openssl/pem.h>
 
+// Encrypted transfers. Each connection agrees on its session key with X25519:
+// the sender brings a fresh key pair, the receiver a short-lived one signed
+// with its RSA key, so the sender knows who it talks to. Chunks are then
+// sealed with an AEAD cipher under that key, each with the next nonce of a counter,
+// so a chunk that is altered, replayed, dropped or reordered fails to open.
+// One context per direction is keyed once, a chunk only sets its nonce.
+// Batches of chunks are spread over a shared pool of worker threads, each
+// with its own copy of the keyed context; their nonces are still handed out
+// in order, so the batch lands exactly as if it had been done one by one.
 class Crypto : public QObject
 {
     Q_OBJECT
 
 public:
+    enum Cipher : quint8 {
+        NoCipher = 0,
+        Aes256Gcm = 1,
+        ChaCha20Poly1305 = 2
+    };
+
+    static constexpr int keySize = 32;
+    static constexpr int tagSize = 16; // Follows every sealed chunk
+
     explicit Crypto(QObject *parent = nullptr);
     ~Crypto();
 
+    static QList<quint8> supportedCiphers(); // Fastest on this machine first, timed on first use
+    static QByteArray randomKey();
+
+    // RSA-OAEP with the keys KeyManager keeps, the files are not read again
     QByteArray encryptAESKey(const QByteArray &aesKey, const QString &rsaPublicKeyPath);
     QByteArray decryptAESKey(const QByteArray &encryptedAESKey, const QString &rsaPrivateKeyPath);
 
-    QByteArray encryptChunk(const QByteArray &chunk, const QByteArray &aesKey);
-    QByteArray decryptChunk(const QByteArray &encryptedChunk, const QByteArray &aesKey);
+    static QSharedPointer<EVP_PKEY> newAgreementKey(); // X25519 key pair, null on failure
+    static QByteArray agreementPublicKey(EVP_PKEY *key); // Raw, as it goes on the wire
+
+    // Session key from X25519 with the peer's public key, through HKDF-SHA256
+    // salted with context (both public keys and the receiver's nonce), then setKey()
+    bool agreeKey(Cipher cipher, EVP_PKEY *ownKey, const QByteArray &peerPublicKey, const QByteArray &context);
+
+    // RSA-PSS over SHA-256, vouches for a receiver's agreement key
+    static QByteArray sign(EVP_PKEY *rsaPrivateKey, const QByteArray &data);
+    static bool verify(EVP_PKEY *rsaPublicKey, const QByteArray &data, const QByteArray &signature);
+
+    bool setKey(Cipher cipher, const QByteArray &key); // Both directions, nonces start over
+    Cipher cipher() const { return currentCipher; }
+
+    // chunk.size() bytes to out plus the tag; aad is authenticated but not
+    // encrypted. out may be chunk's own memory.
+    bool encryptChunk(QByteArrayView chunk, QByteArrayView aad, char *out, char *tag);
+    bool decryptChunk(QByteArrayView sealed, QByteArrayView aad, const char *tag, char *out); // False if it was tampered with
+
+    struct Chunk {
+        QByteArrayView input;
+        QByteArrayView aad;
+        char *output; // May be input's own memory
+        char *tag;    // Written when encrypting, checked when decrypting
+    };
+
+    // Like that many encryptChunk()/decryptChunk() calls in list order, on
+    // the workers and the calling thread at once. False if any chunk failed.
+    bool encryptChunks(QList<Chunk> &chunks);
+    bool decryptChunks(QList<Chunk> &chunks);
+
+    static void setWorkerCount(int count); // Threads a batch is spread over, the caller's included; 1 = no workers
+    static int workerCount();
 
 private:
+    bool runBatch(QList<Chunk> &chunks, bool encrypt);
+    void dropWorkerContexts();
+
     EVP_CIPHER_CTX *encryptCtx;
     EVP_CIPHER_CTX *decryptCtx;
+    QList<EVP_CIPHER_CTX*> workerEncryptCtx; // Copies of the keyed contexts, one per extra thread of a batch
+    QList<EVP_CIPHER_CTX*> workerDecryptCtx;
+    Cipher currentCipher;
+    quint64 encryptCounter; // Nonce of the next chunk each way
+    quint64 decryptCounter;
 };
 
 #endif // CRYPTO_H
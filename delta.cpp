@@ -0,0 +1,206 @@
+#include "delta.h"
+
+#include <QFile>
+#include <QMultiHash>
+#include <QCryptographicHash>
+#include <QtEndian>
+#include <QtMath>
+
+namespace Delta {
+
+namespace {
+
+const qint64 readSize = 4 * 1024 * 1024;
+
+// rsync's weak checksum, cheap to slide forward by one byte
+struct RollingChecksum {
+    quint32 a = 0;
+    quint32 b = 0;
+    quint32 length = 0;
+
+    void reset(const uchar *data, qint64 size)
+    {
+        a = 0;
+        b = 0;
+        length = quint32(size);
+        for (qint64 i = 0; i < size; ++i) {
+            a += data[i];
+            b += quint32(size - i) * data[i];
+        }
+        a &= 0xffff;
+        b &= 0xffff;
+    }
+
+    void roll(uchar out, uchar in)
+    {
+        a = (a - out + in) & 0xffff;
+        b = (b - length * out + a) & 0xffff;
+    }
+
+    quint32 value() const { return a | (b << 16); }
+};
+
+}
+
+qint32 blockSizeFor(qint64 fileSize)
+{
+    // Roughly sqrt(size) like rsync, rounded to 1 KB and kept in a sane range
+    qint64 blockSize = qint64(qSqrt(double(fileSize)));
+    blockSize = (blockSize + 1023) / 1024 * 1024;
+    return qint32(qBound<qint64>(4 * 1024, blockSize, 128 * 1024));
+}
+
+Signatures computeSignatures(const QString &filePath, qint32 blockSize)
+{
+    Signatures signatures = {0, blockSize, QByteArray(), QByteArray()};
+
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return signatures;
+    }
+
+    signatures.fileSize = file.size();
+    qint64 blockCount = signatures.fileSize / blockSize;
+    signatures.weak.reserve(blockCount * 4);
+    signatures.strong.reserve(blockCount * 16);
+
+    // Only full blocks are indexed, a short tail is always sent as literal data
+    const qint64 blocksPerRead = qMax<qint64>(1, readSize / blockSize);
+    for (qint64 block = 0; block < blockCount; block += blocksPerRead) {
+        QByteArray data = file.read(qMin(blocksPerRead, blockCount - block) * blockSize);
+        const uchar *bytes = reinterpret_cast<const uchar*>(data.constData());
+
+        for (qint64 offset = 0; offset + blockSize <= data.size(); offset += blockSize) {
+            RollingChecksum rolling;
+            rolling.reset(bytes + offset, blockSize);
+
+            uchar weak[4];
+            qToLittleEndian<quint32>(rolling.value(), weak);
+            signatures.weak.append(reinterpret_cast<const char*>(weak), 4);
+            signatures.strong.append(QCryptographicHash::hash(QByteArrayView(data).mid(offset, blockSize), QCryptographicHash::Md5));
+        }
+
+        if (data.size() < qMin(blocksPerRead, blockCount - block) * blockSize) {
+            break; // Short read, the signatures cover what we got
+        }
+    }
+
+    return signatures;
+}
+
+Plan computeDelta(const QString &filePath, const Signatures &signatures)
+{
+    Plan plan = {false, signatures.fileSize, signatures.blockSize, QList<Op>(), 0, QByteArray()};
+
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly) || signatures.blockSize <= 0) {
+        return plan;
+    }
+
+    const qint64 fileSize = file.size();
+    const qint64 blockSize = signatures.blockSize;
+    const qint64 blockCount = qMin(signatures.weak.size() / 4, signatures.strong.size() / 16);
+
+    QMultiHash<quint32, qint64> blocksByWeak;
+    blocksByWeak.reserve(blockCount);
+    for (qint64 block = 0; block < blockCount; ++block) {
+        blocksByWeak.insert(qFromLittleEndian<quint32>(signatures.weak.constData() + block * 4), block);
+    }
+
+    QCryptographicHash fileHash(QCryptographicHash::Md5);
+    QByteArray buffer;        // Holds the current window and whatever was read ahead
+    qint64 bufferStart = 0;   // File offset of buffer[0]
+    qint64 position = 0;      // Start of the current window
+    qint64 literalStart = 0;  // Start of bytes not covered by a block match yet
+    RollingChecksum rolling;
+    bool rollingValid = false;
+
+    auto appendLiteral = [&](qint64 end) {
+        if (end > literalStart) {
+            plan.ops.append({Op::Literal, literalStart, end - literalStart});
+            plan.literalBytes += end - literalStart;
+        }
+    };
+
+    while (position + blockSize <= fileSize) {
+        // Keep the window plus the byte after it in memory for rolling
+        qint64 needEnd = qMin(position + blockSize + 1, fileSize);
+        if (bufferStart + buffer.size() < needEnd) {
+            buffer.remove(0, position - bufferStart);
+            bufferStart = position;
+
+            QByteArray more = file.read(qMax(readSize, needEnd - (bufferStart + buffer.size())));
+            if (more.isEmpty()) {
+                return plan; // File shrank under us
+            }
+            fileHash.addData(more);
+            buffer.append(more);
+        }
+
+        const uchar *window = reinterpret_cast<const uchar*>(buffer.constData()) + (position - bufferStart);
+        if (!rollingValid) {
+            rolling.reset(window, blockSize);
+            rollingValid = true;
+        }
+
+        qint64 matchedBlock = -1;
+        quint32 weak = rolling.value();
+        QByteArray strong;
+        for (auto it = blocksByWeak.constFind(weak); it != blocksByWeak.constEnd() && it.key() == weak; ++it) {
+            if (strong.isEmpty()) {
+                strong = QCryptographicHash::hash(QByteArrayView(window, blockSize), QCryptographicHash::Md5);
+            }
+            if (QByteArrayView(signatures.strong).mid(it.value() * 16, 16) == strong) {
+                matchedBlock = it.value();
+                break;
+            }
+        }
+
+        if (matchedBlock >= 0) {
+            appendLiteral(position);
+
+            // Runs of consecutive blocks become one copy
+            if (!plan.ops.isEmpty() && plan.ops.last().type == Op::Copy
+                && plan.ops.last().position + plan.ops.last().length == matchedBlock) {
+                plan.ops.last().length++;
+            } else {
+                plan.ops.append({Op::Copy, matchedBlock, 1});
+            }
+
+            position += blockSize;
+            literalStart = position;
+            rollingValid = false;
+            continue;
+        }
+
+        if (position + blockSize < fileSize) {
+            rolling.roll(window[0], window[blockSize]);
+        }
+        position++;
+    }
+
+    // Hash whatever the window never reached
+    while (!file.atEnd()) {
+        QByteArray more = file.read(readSize);
+        if (more.isEmpty()) {
+            break;
+        }
+        fileHash.addData(more);
+    }
+
+    appendLiteral(fileSize);
+    plan.fileHash = fileHash.result();
+    plan.ok = true;
+    return plan;
+}
+
+bool isWorthIt(const Plan &plan, qint64 fileSize)
+{
+    // Every op costs a small record on the wire, and assembling from the old
+    // copy is extra disk work on the receiver, so ask for at least 10% savings
+    const qint64 opOverhead = 17;
+    qint64 deltaBytes = plan.literalBytes + plan.ops.size() * opOverhead;
+    return plan.ok && deltaBytes < fileSize - fileSize / 10;
+}
+
+}
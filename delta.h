@@ -0,0 +1,50 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <QByteArray>
+#include <QList>
+#include <QString>
+
+// rsync-style delta encoding. The receiver describes the copy it already has
+// as per-block signatures, the sender walks its file with a rolling checksum
+// and produces a list of block references and literal byte ranges.
+namespace Delta {
+
+const qint64 minimumFileSize = 1024 * 1024; // Smaller files are cheaper to send whole
+
+struct Signatures {
+    qint64 fileSize;
+    qint32 blockSize;
+    QByteArray weak;   // Little-endian quint32 rolling checksum per full block
+    QByteArray strong; // MD5 per full block
+};
+
+struct Op {
+    enum Type : quint8 {
+        End = 0,     // Followed by the MD5 of the whole new file
+        Copy = 1,    // position = first block of the old file, length = block count
+        Literal = 2  // position = offset in the new file, length = bytes
+    };
+
+    Type type;
+    qint64 position;
+    qint64 length;
+};
+
+struct Plan {
+    bool ok;
+    qint64 baseSize;   // Old file the plan was made against
+    qint32 blockSize;
+    QList<Op> ops;
+    qint64 literalBytes;
+    QByteArray fileHash; // MD5 of the whole new file, checked by the receiver
+};
+
+qint32 blockSizeFor(qint64 fileSize);
+Signatures computeSignatures(const QString &filePath, qint32 blockSize);
+Plan computeDelta(const QString &filePath, const Signatures &signatures);
+bool isWorthIt(const Plan &plan, qint64 fileSize); // False when the delta would not save enough bytes
+
+}
+
+#endif // DELTA_H
@@ -0,0 +1,369 @@
+#include "diskbackend.h"
+
+#include <QList>
+#include <QFileInfo>
+#include <QDir>
+
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef Q_OS_WIN
+#include <windows.h>
+#endif
+#if defined(Q_OS_LINUX) && defined(LETSSHARE_HAVE_LIBURING)
+#include <vector>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <liburing.h>
+#endif
+
+namespace {
+
+// Everything done on the spot, the completions wait for the next poll()
+class PortableBackend : public DiskBackend
+{
+public:
+    Kind kind() const override { return Portable; }
+    int pending() const override { return finished.size(); }
+
+    void read(QFile *file, qint64 position, char *buffer, qint64 size, Completion done) override
+    {
+        qint64 result = file->seek(position) ? file->read(buffer, size) : -1;
+        finished.emplaceBack(std::move(done), result);
+    }
+
+    void write(QFile *file, qint64 position, BufferPool::Buffer data, bool sync, Completion done) override
+    {
+        bool ok = file->seek(position) && file->write(data.constData(), data.size()) == data.size()
+                  && (!sync || syncFile(*file));
+        finished.emplaceBack(std::move(done), ok ? data.size() : -1);
+    }
+
+    void sync(QFile *file, Completion done) override
+    {
+        finished.emplaceBack(std::move(done), syncFile(*file) ? 0 : -1);
+    }
+
+    void submit() override {}
+
+    int poll(bool block) override
+    {
+        Q_UNUSED(block); // Nothing is ever left running
+        QList<std::pair<Completion, qint64>> batch;
+        batch.swap(finished);
+        for (auto &[done, result] : batch) {
+            if (done) {
+                done(result);
+            }
+        }
+        return batch.size();
+    }
+
+    void wait() override
+    {
+        while (!finished.isEmpty()) {
+            poll(false);
+        }
+    }
+
+    int notifier() override { return -1; }
+
+private:
+    QList<std::pair<Completion, qint64>> finished;
+};
+
+#if defined(Q_OS_LINUX) && defined(LETSSHARE_HAVE_LIBURING)
+// Up to depth operations in one ring. The buffer pool's reserved region is
+// registered with the kernel up front, which spares it mapping the pages of
+// every request that uses a buffer from there. A write that asks for a sync
+// is drained behind everything queued before it and linked to its fsync.
+class UringBackend : public DiskBackend
+{
+public:
+    explicit UringBackend(int depth) : ready(false), registered(false), eventFd(-1), inFlight(0)
+    {
+        // A synced write takes two entries
+        if (io_uring_queue_init(unsigned(depth * 2), &ring, 0) != 0) {
+            return;
+        }
+        ready = true;
+
+        ops.resize(size_t(depth) * 2);
+        for (int i = int(ops.size()) - 1; i >= 0; --i) {
+            freeOps.append(i);
+        }
+
+        // Without it (locked memory limit) every buffer works, just unregistered
+        const BufferPool &pool = BufferPool::shared();
+        if (pool.reserved()) {
+            iovec region = {const_cast<char *>(pool.reserved()), size_t(pool.reservedSize())};
+            registered = io_uring_register_buffers(&ring, &region, 1) == 0;
+        }
+    }
+
+    ~UringBackend() override
+    {
+        if (ready) {
+            wait();
+            io_uring_queue_exit(&ring);
+        }
+        if (eventFd >= 0) {
+            ::close(eventFd);
+        }
+    }
+
+    bool isValid() const { return ready; }
+
+    Kind kind() const override { return IoUring; }
+    int pending() const override { return inFlight; }
+
+    void read(QFile *file, qint64 position, char *buffer, qint64 size, Completion done) override
+    {
+        int index = takeOp(1);
+        Op &op = ops[size_t(index)];
+        op.type = Op::Read;
+        op.size = size;
+        op.done = std::move(done);
+
+        io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+        if (isRegistered(buffer, size)) {
+            io_uring_prep_read_fixed(sqe, file->handle(), buffer, unsigned(size), __u64(position), 0);
+        } else {
+            io_uring_prep_read(sqe, file->handle(), buffer, unsigned(size), __u64(position));
+        }
+        io_uring_sqe_set_data(sqe, reinterpret_cast<void *>(quintptr(index)));
+    }
+
+    void write(QFile *file, qint64 position, BufferPool::Buffer data, bool sync, Completion done) override
+    {
+        int index = takeOp(sync ? 2 : 1);
+        Op &op = ops[size_t(index)];
+        op.type = Op::Write;
+        op.size = data.size();
+        op.data = std::move(data); // Kept until the kernel is done with it
+
+        io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+        if (isRegistered(op.data.constData(), op.size)) {
+            io_uring_prep_write_fixed(sqe, file->handle(), op.data.constData(), unsigned(op.size), __u64(position), 0);
+        } else {
+            io_uring_prep_write(sqe, file->handle(), op.data.constData(), unsigned(op.size), __u64(position));
+        }
+        io_uring_sqe_set_data(sqe, reinterpret_cast<void *>(quintptr(index)));
+
+        if (!sync) {
+            op.done = std::move(done);
+            return;
+        }
+
+        // The fsync reports for both, a failed write cancels it
+        sqe->flags |= IOSQE_IO_DRAIN | IOSQE_IO_LINK;
+        op.linked = freeOps.takeLast();
+        prepareSync(op.linked, file, std::move(done));
+        ops[size_t(op.linked)].size = op.size;
+    }
+
+    void sync(QFile *file, Completion done) override
+    {
+        prepareSync(takeOp(1), file, std::move(done));
+    }
+
+    void submit() override
+    {
+        io_uring_submit(&ring);
+    }
+
+    int poll(bool block) override
+    {
+        // Unsubmitted entries wait for submit() or for a blocking poll, so they go to the kernel in batches
+        if (block) {
+            submit();
+        }
+
+        // Rearm the notifier before looking, so a completion landing after the look still fires it
+        if (eventFd >= 0) {
+            eventfd_t value;
+            eventfd_read(eventFd, &value);
+        }
+
+        int count = 0;
+        io_uring_cqe *cqe;
+        if (block && inFlight > 0 && io_uring_wait_cqe(&ring, &cqe) == 0) {
+            complete(cqe);
+            count++;
+        }
+        while (inFlight > 0 && io_uring_peek_cqe(&ring, &cqe) == 0) {
+            complete(cqe);
+            count++;
+        }
+        return count;
+    }
+
+    void wait() override
+    {
+        while (inFlight > 0) {
+            poll(true);
+        }
+    }
+
+    int notifier() override
+    {
+        if (eventFd < 0) {
+            eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (eventFd >= 0 && io_uring_register_eventfd(&ring, eventFd) != 0) {
+                ::close(eventFd);
+                eventFd = -1;
+            }
+        }
+        return eventFd;
+    }
+
+private:
+    struct Op {
+        enum Type { Read, Write, Sync } type = Read;
+        Completion done;
+        BufferPool::Buffer data; // Written from, held until the write completes
+        qint64 size = 0;
+        int linked = -1;     // The fsync following this write
+        bool failed = false; // The write ahead of this fsync did not go through
+    };
+
+    bool isRegistered(const char *buffer, qint64 size) const
+    {
+        return registered && BufferPool::shared().isReserved(buffer, size);
+    }
+
+    // Room for count entries, waiting for the disk if they are all taken. Takes the first.
+    int takeOp(int count)
+    {
+        while (freeOps.size() < count) {
+            poll(true);
+        }
+        inFlight++;
+        return freeOps.takeLast();
+    }
+
+    void prepareSync(int index, QFile *file, Completion done)
+    {
+        Op &op = ops[size_t(index)];
+        op.type = Op::Sync;
+        op.done = std::move(done);
+
+        io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+        io_uring_prep_fsync(sqe, file->handle(), 0);
+        sqe->flags |= IOSQE_IO_DRAIN;
+        io_uring_sqe_set_data(sqe, reinterpret_cast<void *>(quintptr(index)));
+    }
+
+    void complete(io_uring_cqe *cqe)
+    {
+        int index = int(quintptr(io_uring_cqe_get_data(cqe)));
+        qint64 res = cqe->res;
+        io_uring_cqe_seen(&ring, cqe);
+
+        Op op = std::move(ops[size_t(index)]);
+        ops[size_t(index)] = Op();
+        freeOps.append(index);
+
+        // The head of a synced write, its fsync completes for both
+        if (op.linked >= 0) {
+            ops[size_t(op.linked)].failed = res != op.size;
+            return;
+        }
+
+        inFlight--;
+        qint64 result;
+        if (op.type == Op::Read) {
+            result = res >= 0 ? res : -1;
+        } else if (op.type == Op::Write) {
+            result = res == op.size ? res : -1; // A short write to a local file means the disk is full
+        } else {
+            result = res >= 0 && !op.failed ? op.size : -1;
+        }
+
+        if (op.done) {
+            op.done(result);
+        }
+    }
+
+    io_uring ring;
+    bool ready;
+    bool registered; // The pool's reserved region is buffer 0
+    int eventFd;
+    int inFlight; // Operations the caller is waiting on, a synced write counts once
+    std::vector<Op> ops; // Move-only, they hold the buffers being written
+    QList<int> freeOps;
+};
+#endif
+
+}
+
+bool DiskBackend::isAvailable(Kind kind)
+{
+#if defined(Q_OS_LINUX) && defined(LETSSHARE_HAVE_LIBURING)
+    if (kind == IoUring) {
+        // Kernels before 5.1, or sandboxes that block the syscalls, cannot set up a ring
+        static const bool works = UringBackend(1).isValid();
+        return works;
+    }
+#endif
+    return kind == Portable;
+}
+
+DiskBackend *DiskBackend::create(Kind kind, int depth)
+{
+#if defined(Q_OS_LINUX) && defined(LETSSHARE_HAVE_LIBURING)
+    if (kind == IoUring) {
+        UringBackend *backend = new UringBackend(depth);
+        if (backend->isValid()) {
+            return backend;
+        }
+        delete backend;
+    }
+#else
+    Q_UNUSED(kind);
+    Q_UNUSED(depth);
+#endif
+    return new PortableBackend;
+}
+
+bool DiskBackend::syncFile(QFile &file)
+{
+    if (!file.flush()) {
+        return false;
+    }
+#ifdef Q_OS_UNIX
+    return ::fsync(file.handle()) == 0;
+#else
+    return syncPath(file.fileName());
+#endif
+}
+
+bool DiskBackend::syncPath(const QString &path)
+{
+#ifdef Q_OS_UNIX
+    int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = ::fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+#elif defined(Q_OS_WIN)
+    if (QFileInfo(path).isDir()) {
+        return true; // Windows cannot flush a directory, NTFS journals the rename itself
+    }
+    HANDLE handle = CreateFileW(reinterpret_cast<LPCWSTR>(QDir::toNativeSeparators(path).utf16()), GENERIC_WRITE,
+                                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+                                FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (handle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    bool ok = FlushFileBuffers(handle);
+    CloseHandle(handle);
+    return ok;
+#else
+    Q_UNUSED(path);
+    return true;
+#endif
+}
@@ -0,0 +1,52 @@
+#ifndef DISKBACKEND_H
+#define DISKBACKEND_H
+
+#include <QFile>
+#include <QString>
+#include <QByteArray>
+
+#include <functional>
+
+#include "bufferpool.h"
+
+// File I/O for the transfer paths that want many operations in flight. The
+// portable backend is plain QFile calls made on the spot. The io_uring one
+// (Linux, built with liburing) queues reads and writes in a ring the kernel
+// works through on its own, so one thread can keep an NVMe drive busy for
+// many transfers. Either way completions only run inside poll() or wait(),
+// on the thread that owns the backend. One backend per thread.
+class DiskBackend
+{
+public:
+    enum Kind {
+        Portable,
+        IoUring
+    };
+
+    using Completion = std::function<void(qint64 result)>; // Bytes moved, -1 on error
+
+    static bool isAvailable(Kind kind);
+    static DiskBackend *create(Kind kind, int depth); // Portable when kind cannot be used here
+
+    static bool syncFile(QFile &file);         // Flush and fsync() an open file
+    static bool syncPath(const QString &path); // fsync() by name, for closed files and directories
+
+    virtual ~DiskBackend() = default;
+
+    virtual Kind kind() const = 0;
+    virtual int pending() const = 0; // Queued and not yet completed
+
+    // The file stays open and a read's buffer valid until done runs, a write
+    // holds on to its buffer until then. Both wait for a completion first if
+    // depth operations are already in flight.
+    virtual void read(QFile *file, qint64 position, char *buffer, qint64 size, Completion done) = 0; // Short at the end of the file
+    virtual void write(QFile *file, qint64 position, BufferPool::Buffer data, bool sync, Completion done) = 0; // sync: fsync() after it and every earlier write
+    virtual void sync(QFile *file, Completion done) = 0; // fsync() after every write queued before it
+
+    virtual void submit() = 0;        // Hand what is queued to the disk
+    virtual int poll(bool block) = 0; // Runs finished completions; block submits and waits for one if any is pending
+    virtual void wait() = 0;          // Until nothing is pending
+    virtual int notifier() = 0;       // Readable while completions wait for poll(), -1 if they never do
+};
+
+#endif // DISKBACKEND_H
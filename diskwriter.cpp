@@ -0,0 +1,139 @@
+#include "diskwriter.h"
+
+namespace {
+
+const int writeDepth = 64; // Writes in flight at once, where the backend can have several
+
+}
+
+DiskWriter::DiskWriter(int capacity, qint64 maxQueuedBytes, std::function<void()> onSpace)
+    : ring(capacity), maxQueuedBytes(maxQueuedBytes), queuedBytes(0), spaceWanted(false), onSpace(std::move(onSpace)),
+      wantedBackend(DiskBackend::Portable)
+{
+    start();
+}
+
+DiskWriter::~DiskWriter()
+{
+    requestInterruption();
+    jobsQueued.release(); // Woken with nothing to pop, run() returns
+    wait();
+}
+
+bool DiskWriter::hasRoom(int jobs) const
+{
+    return ring.capacity() - ring.size() >= jobs && queuedBytes.load(std::memory_order_relaxed) < maxQueuedBytes;
+}
+
+bool DiskWriter::reserve(int jobs)
+{
+    if (hasRoom(jobs)) {
+        return true;
+    }
+
+    spaceWanted.store(true);
+    return hasRoom(jobs); // The writer may have made room before it saw the flag
+}
+
+void DiskWriter::push(Job job)
+{
+    qint64 bytes = job.data.size();
+
+    // Only reachable without reserve(); the writer is always making progress
+    while (!ring.push(job)) {
+        QThread::yieldCurrentThread();
+    }
+
+    queuedBytes.fetch_add(bytes, std::memory_order_relaxed);
+    jobsQueued.release();
+}
+
+int DiskWriter::occupancy() const
+{
+    return ring.size() * 100 / ring.capacity();
+}
+
+void DiskWriter::setBackend(DiskBackend::Kind kind)
+{
+    wantedBackend.store(DiskBackend::isAvailable(kind) ? kind : DiskBackend::Portable);
+    jobsQueued.release(); // Wake the writer with nothing to pop, it picks the backend up
+}
+
+void DiskWriter::run()
+{
+    Job job;
+    backend.reset(DiskBackend::create(DiskBackend::Kind(wantedBackend.load()), writeDepth));
+
+    for (;;) {
+        backend->poll(false);
+        wakeProducer();
+
+        // Hand the disk everything queued so far, and only wait on it when no new job is coming
+        if (!jobsQueued.tryAcquire()) {
+            backend->submit();
+            if (backend->pending() > 0) {
+                backend->poll(true);
+                wakeProducer();
+                continue;
+            }
+            jobsQueued.acquire();
+        }
+
+        if (backend->kind() != wantedBackend.load()) {
+            backend->wait();
+            backend.reset(DiskBackend::create(DiskBackend::Kind(wantedBackend.load()), writeDepth));
+        }
+
+        if (!ring.pop(job)) {
+            if (isInterruptionRequested()) {
+                backend->wait();
+                return;
+            }
+            continue; // Only woken for the backend switch
+        }
+
+        process(job);
+        job = Job();
+    }
+}
+
+void DiskWriter::process(Job &job)
+{
+    qint64 bytes = job.data.size();
+    QSharedPointer<QFile> file = job.file;
+    QSharedPointer<QAtomicInt> failed = job.failed;
+
+    // The completions keep the file open and count the bytes as queued until they are on disk
+    if (bytes > 0 && !failed->loadRelaxed()) {
+        backend->write(file.data(), job.position, std::move(job.data), job.sync, [this, file, failed, bytes](qint64 written) {
+            if (written != bytes) {
+                failed->storeRelaxed(1);
+            }
+            queuedBytes.fetch_sub(bytes, std::memory_order_relaxed);
+        });
+    } else {
+        job.data.release();
+        queuedBytes.fetch_sub(bytes, std::memory_order_relaxed);
+        if (job.sync && file && !failed->loadRelaxed()) {
+            backend->sync(file.data(), [file, failed](qint64 result) {
+                if (result < 0) {
+                    failed->storeRelaxed(1);
+                }
+            });
+        }
+    }
+
+    if (job.then) {
+        backend->wait();
+        job.then();
+    }
+}
+
+void DiskWriter::wakeProducer()
+{
+    // Wake the receiver with room for a good batch, not one slot at a time
+    if (spaceWanted.load() && ring.size() <= ring.capacity() / 2
+        && queuedBytes.load(std::memory_order_relaxed) < maxQueuedBytes && spaceWanted.exchange(false)) {
+        onSpace();
+    }
+}
@@ -0,0 +1,66 @@
+#ifndef DISKWRITER_H
+#define DISKWRITER_H
+
+#include <QThread>
+#include <QFile>
+#include <QSharedPointer>
+#include <QAtomicInt>
+#include <QSemaphore>
+#include <QScopedPointer>
+
+#include <atomic>
+#include <functional>
+
+#include "spscring.h"
+#include "diskbackend.h"
+#include "bufferpool.h"
+
+// Disk side of the receive pipeline. The receiving thread queues filled
+// buffers in a bounded lock-free ring and this thread writes them out, so a
+// slow disk or an fsync stall does not keep the sockets from being drained.
+// Once the ring is full the receiver stops reading and TCP slows the sender.
+// Writes go through a DiskBackend, with io_uring many of them are in flight
+// at once; a job's then still only runs once everything before it is written.
+// The buffers travel with the jobs, nothing is copied on the way to the disk.
+class DiskWriter : public QThread
+{
+public:
+    struct Job {
+        QSharedPointer<QFile> file;
+        qint64 position = 0;
+        BufferPool::Buffer data;           // Written at position, nothing to write if empty; back to the pool once written
+        QSharedPointer<QAtomicInt> failed; // Set once a write to this range does not go through, later ones are skipped
+        std::function<void()> then;        // Runs on the writer thread once the data is written
+        bool sync = false;                 // fsync() the file after this job's data and everything before it
+    };
+
+    // onSpace runs on the writer thread after a failed reserve(), once the ring is half empty
+    DiskWriter(int capacity, qint64 maxQueuedBytes, std::function<void()> onSpace);
+    ~DiskWriter(); // Writes what is queued, then stops
+
+    // Producer side, one thread only
+    bool reserve(int jobs); // Room for that many more jobs? If not, onSpace follows
+    void push(Job job);     // Waits for a slot if reserve() was skipped and the ring is full
+
+    int occupancy() const; // Percent of the ring in use, high means the disk is the bottleneck
+    void setBackend(DiskBackend::Kind kind); // Any thread, switched once the writes in flight are done
+
+protected:
+    void run() override;
+
+private:
+    bool hasRoom(int jobs) const;
+    void process(Job &job);
+    void wakeProducer();
+
+    SpscRing<Job> ring;
+    QSemaphore jobsQueued;
+    qint64 maxQueuedBytes;
+    std::atomic<qint64> queuedBytes;
+    std::atomic<bool> spaceWanted;
+    std::function<void()> onSpace;
+    std::atomic<int> wantedBackend;
+    QScopedPointer<DiskBackend> backend; // Writer thread only
+};
+
+#endif // DISKWRITER_H
@@ -2,12 +2,51 @@
 #include <QFileInfo>
 #include <QDebug>
 #include <QThread>
+#include <QDateTime>
+#include "contentindex.h"
 
+using namespace TransferProtocol;
+
+namespace {
+
+const int readAheadChunks = 8; // Per stream, what the disk backend reads ahead of the socket
+const int readDepth = 64;      // Reads in flight across all streams
+const qint64 cacheDropWindow = 8 * 1024 * 1024; // Sent data is dropped this far behind, in steps this big
+const int maxSealBatch = 32;   // Chunks sealed together on an encrypted stream
+
+// Two chunks per crypto thread, so a slow one does not hold the batch up
+int sealBatchSize()
+{
+    return qMin(2 * Crypto::workerCount(), maxSealBatch);
+}
+
+static_assert(Crypto::tagSize == chunkTagSize, "FileData frames carry the cipher's whole tag");
+
+// Frame header plus the FileData fields in front of the chunk bytes
+QByteArray chunkHeader(Compression::Codec codec, qint64 rawSize, qint64 payloadSize)
+{
+    QByteArray header(frameHeaderSize + chunkHeaderSize, Qt::Uninitialized);
+    writeChunkHeader(header.data(), codec, rawSize, payloadSize);
+    return header;
+}
+
+}
 
 FileClient::FileClient(QObject *parent) : QObject(parent),
-    currentFileIndex(0), totalFilesSize(0), totalBytesSent(0)
+    currentFileIndex(0), deduplicate(true), compress(false), zeroCopy(false), encrypt(false), tls(false), hashing(false),
+    diskNotifier(nullptr), cacheBypassThreshold(0), totalFilesSize(0), totalBytesSent(0), batchId(0),
+    highWatermark(1024 * 1024), lowWatermark(256 * 1024), sending(false),
+    streamCount(1), maxStreams(8), stripeSize(8 * 1024 * 1024),
+    probeBytes(0), bestThroughput(0)
 {
-    socket = QSharedPointer<QTcpSocket>::create(this);
+    socket = QSharedPointer<QSslSocket>::create(this); // Plain unless TLS is turned on
+
+    // The primary connection is stream 0, extra streams are opened per batch
+    addStream(socket);
+
+    probeTimer = new QTimer(this);
+    probeTimer->setInterval(2000);
+    connect(probeTimer, &QTimer::timeout, this, &FileClient::onProbeTimeout);
 }
 
 FileClient::~FileClient()
@@ -18,30 +57,113 @@ FileClient::~FileClient()
 
 bool FileClient::connectToServer(const QString &ipAddress)
 {
-    if (socket->state() == QAbstractSocket::ConnectedState) {
+    TransferStream *primary = streams.first().data();
+    if (socket->state() == QAbstractSocket::ConnectedState && primary->accepted) {
         return true; // Already connected
     }
 
-    socket->connectToHost(ipAddress, 12345); // Replace with your port
+    if (socket->state() != QAbstractSocket::UnconnectedState) {
+        socket->abort(); // Left over from a handshake that never finished
+    }
+
+    serverAddress = ipAddress;
+    primary->rejected = false;
+    startConnection(primary);
 
-    if (!socket->waitForConnected(5000)) { // Wait for 5 seconds
+    // With TLS the handshake is part of connecting
+    QSslSocket *ssl = qobject_cast<QSslSocket*>(socket.data());
+    if (primary->tls ? !ssl->waitForEncrypted(5000) : !socket->waitForConnected(5000)) { // Wait for 5 seconds
+        socket->abort();
         return false; // Connection failed
     }
 
-    // Check if server rejected the connection
-    if (socket->waitForReadyRead(500)) {  // Wait up to 500ms for a response
-        QByteArray response = socket->readAll();
-        if (response == "BLOCKED") {
-            // qDebug() << "Connection blocked by server.";
-            socket->disconnectFromHost();
-            return false;
+    sendHello(primary);
+
+    // onServerMessage() sees the answer through readyRead; go as soon as it is there
+    QElapsedTimer timer;
+    timer.start();
+    while (!primary->accepted && !primary->rejected && timer.elapsed() < 5000) {
+        if (!socket->waitForReadyRead(5000 - timer.elapsed())) {
+            break;
         }
     }
 
+    if (!primary->accepted) {
+        socket->abort();
+        return false;
+    }
+
     return true; // Connection successful
 }
 
 
+void FileClient::setWriteWatermarks(qint64 high, qint64 low)
+{
+    const qint64 chunkSize = 64 * 1024;
+    highWatermark = qMax(high, chunkSize);
+    lowWatermark = qBound<qint64>(0, low, highWatermark - 1);
+}
+
+void FileClient::setStreamCount(int count)
+{
+    streamCount = qBound(0, count, maxStreams);
+}
+
+void FileClient::setDeduplicationEnabled(bool enabled)
+{
+    deduplicate = enabled;
+}
+
+void FileClient::setCompressionEnabled(bool enabled)
+{
+    compress = enabled;
+}
+
+void FileClient::setZeroCopyEnabled(bool enabled)
+{
+    zeroCopy = enabled && ZeroCopy::isAvailable();
+    for (const QSharedPointer<TransferStream> &stream : streams) {
+        stream->zeroCopy = zeroCopy && stream->accepted;
+    }
+}
+
+void FileClient::setEncryption(bool enabled, const QString &rsaPublicKeyPath)
+{
+    encrypt = enabled;
+    this->rsaPublicKeyPath = rsaPublicKeyPath;
+}
+
+void FileClient::setTlsEnabled(bool enabled)
+{
+    tls = enabled;
+}
+
+void FileClient::setDiskBackend(DiskBackend::Kind kind)
+{
+    if ((disk ? disk->kind() : DiskBackend::Portable) == kind) {
+        return;
+    }
+
+    delete diskNotifier;
+    diskNotifier = nullptr;
+    if (disk) {
+        disk->wait(); // Reads in flight land in their PendingRead, they are simply not used
+    }
+    disk.reset();
+
+    // The portable backend would only add a queue in front of QFile::read()
+    if (kind != DiskBackend::Portable && DiskBackend::isAvailable(kind)) {
+        disk = QSharedPointer<DiskBackend>(DiskBackend::create(kind, readDepth));
+        diskNotifier = new QSocketNotifier(disk->notifier(), QSocketNotifier::Read, this);
+        connect(diskNotifier, &QSocketNotifier::activated, this, &FileClient::onDiskReady);
+    }
+}
+
+void FileClient::setCacheBypassThreshold(qint64 bytes)
+{
+    cacheBypassThreshold = PageCache::isAvailable() ? qMax<qint64>(0, bytes) : 0;
+}
+
 void FileClient::sendFiles(const QStringList &files, const QString &ipAddress)
 {
     if (files.isEmpty()) {
@@ -49,18 +171,37 @@ void FileClient::sendFiles(const QStringList &files, const QString &ipAddress)
         return;
     }
 
+    // Calculate the total size of the new files
+    qint64 newFilesSize = 0;
+    for (const QString &filePath : files) {
+        QFileInfo fileInfo(filePath);
+        newFilesSize += fileInfo.size();
+    }
+
+    if (sending) {
+        // A batch is still streaming, queue these behind it
+        filesToSend.append(files);
+        totalFilesSize += newFilesSize;
+        sendResumeQueries();
+        fillAllStreams();
+        return;
+    }
+
     filesToSend = files;
     currentFileIndex = 0;
+    queriedFiles.clear();
+    pendingPieces.clear();
+    fileBytesUnqueued.clear();
+    fileBytesUnacked.clear();
+    streams.first()->awaitingAck.clear();
+    deltaPlans.clear();
+    deltaJobs.clear();
+    deltaResultsPending.clear();
+    batchId++;
 
-    totalFilesSize = 0;
+    totalFilesSize = newFilesSize;
     totalBytesSent = 0;
 
-    // Calculate the total size of all files
-    for (const QString &filePath : filesToSend) {
-        QFileInfo fileInfo(filePath);
-        totalFilesSize += fileInfo.size();
-    }
-
     // Attempt to connect to the server
     if (!connectToServer(ipAddress)) {
         emit statusUpdated("Connection Failed.");
@@ -68,76 +209,1075 @@ void FileClient::sendFiles(const QStringList &files, const QString &ipAddress)
     }
 
     // Start sending files if connection is successful
-    sendNextFile();
+    sending = true;
+
+    if (streamCount == 0) {
+        // Auto: start with one stream and add more while throughput keeps improving
+        bestThroughput = 0;
+        probeBytes = 0;
+        probeClock.start();
+        probeTimer->start();
+    } else {
+        for (int i = 1; i < streamCount; ++i) {
+            openExtraStream();
+        }
+    }
+
+    // Nothing is sent until the receiver says what it already has
+    sendResumeQueries();
+    checkFinished();
 }
 
 
-void FileClient::sendNextFile()
+FileClient::TransferStream *FileClient::addStream(const QSharedPointer<QTcpSocket> &streamSocket)
 {
-    while (currentFileIndex < filesToSend.size())
-    {
-        QString filePath = filesToSend[currentFileIndex];
-        QFile file(filePath);
+    QSharedPointer<TransferStream> stream = QSharedPointer<TransferStream>::create();
+    stream->socket = streamSocket;
+    stream->piece = {0, 0, 0};
+    stream->bytesRemaining = 0;
+    stream->bytesQueued = 0;
+    stream->opIndex = 0;
+    stream->accepted = false;
+    stream->rejected = false;
+    stream->codec = Compression::None;
+    stream->skipChunks = 0;
+    stream->skipBackoff = 0;
+    stream->zeroCopy = false;
+    stream->dropBehind = false;
+    stream->droppedUpTo = 0;
+    stream->tls = false;
+    streams.append(stream);
+
+    TransferStream *raw = stream.data();
+
+    // The socket drives the send loop: every time the kernel takes some of our
+    // queued bytes we top the buffer back up instead of blocking on each chunk.
+    connect(streamSocket.data(), &QTcpSocket::bytesWritten, this, [this, raw]() { onStreamBytesWritten(raw); });
+    connect(streamSocket.data(), &QTcpSocket::errorOccurred, this, [this, raw]() { onStreamError(raw); });
+    connect(streamSocket.data(), &QTcpSocket::readyRead, this, [this, raw]() { onServerMessage(raw->socket.data()); });
+    if (QSslSocket *ssl = qobject_cast<QSslSocket*>(streamSocket.data())) {
+        connect(ssl, &QSslSocket::sslErrors, this, [this, raw](const QList<QSslError> &errors) { onSslErrors(raw, errors); });
+    }
+    connect(streamSocket.data(), &QTcpSocket::disconnected, this, [raw]() {
+        // The handshake, codec and key are per connection, a new one starts over
+        raw->accepted = false;
+        raw->codec = Compression::None;
+        raw->zeroCopy = false;
+        raw->agreementKey.reset();
+        raw->crypto.reset();
+    });
+    return raw;
+}
+
+void FileClient::openExtraStream()
+{
+    if (streams.size() >= maxStreams || serverAddress.isEmpty()) {
+        return;
+    }
 
-        if (!file.open(QIODevice::ReadOnly)) {
+    // deleteLater because the socket may go away from inside one of its own signals
+    QSharedPointer<QTcpSocket> streamSocket(new QSslSocket, &QObject::deleteLater);
+    TransferStream *stream = addStream(streamSocket);
+    connect(streamSocket.data(), &QTcpSocket::connected, this, [this, stream]() {
+        if (!stream->tls) {
+            sendHello(stream);
+        }
+    });
+    connect(qobject_cast<QSslSocket*>(streamSocket.data()), &QSslSocket::encrypted, this, [this, stream]() { sendHello(stream); });
+    startConnection(stream);
+}
+
+void FileClient::startConnection(TransferStream *stream)
+{
+    QSslSocket *ssl = qobject_cast<QSslSocket*>(stream->socket.data());
+    stream->tls = tls && ssl;
+    if (!stream->tls) {
+        stream->socket->connectToHost(serverAddress, TransferProtocol::port);
+        return;
+    }
+
+    ssl->setSslConfiguration(tlsConfiguration());
+    ssl->connectToHostEncrypted(serverAddress, TransferProtocol::port);
+}
+
+QSslConfiguration FileClient::tlsConfiguration() const
+{
+    // TLS 1.3 only. No session resumption: Qt gives every server socket a context of its
+    // own, so the receiver could not honour a ticket and each connection is a full handshake
+    QSslConfiguration configuration = QSslConfiguration::defaultConfiguration();
+    configuration.setProtocol(QSsl::TlsV1_3OrLater);
+    configuration.setPeerVerifyMode(QSslSocket::VerifyPeer);
+    return configuration;
+}
+
+void FileClient::onSslErrors(TransferStream *stream, const QList<QSslError> &errors)
+{
+    // The receiver's certificate is self-signed, it is good if it carries the public key we were given
+    QSslSocket *ssl = qobject_cast<QSslSocket*>(stream->socket.data());
+    QSslKey pinned(KeyManager::shared().publicKeyPem(rsaPublicKeyPath), QSsl::Rsa, QSsl::Pem, QSsl::PublicKey);
+    bool trusted = !pinned.isNull() && ssl->peerCertificate().publicKey() == pinned;
+    for (const QSslError &error : errors) {
+        trusted = trusted && (error.error() == QSslError::SelfSignedCertificate
+                              || error.error() == QSslError::CertificateUntrusted
+                              || error.error() == QSslError::HostNameMismatch);
+    }
+
+    if (trusted) {
+        ssl->ignoreSslErrors(errors);
+        return;
+    }
+    emit statusUpdated("The receiver's TLS certificate does not match its public key.");
+    stream->rejected = true; // Qt drops the connection
+}
+
+void FileClient::closeExtraStreams()
+{
+    while (streams.size() > 1) {
+        QSharedPointer<TransferStream> stream = streams.takeLast();
+        stream->socket->disconnect(this);
+        stream->socket->disconnectFromHost();
+        if (stream->file) {
+            stream->file->close();
+        }
+    }
+}
+
+FileClient::TransferStream *FileClient::streamFor(QTcpSocket *streamSocket) const
+{
+    for (const QSharedPointer<TransferStream> &stream : streams) {
+        if (stream->socket.data() == streamSocket) {
+            return stream.data();
+        }
+    }
+    return nullptr;
+}
+
+void FileClient::sendHello(TransferStream *stream)
+{
+    QList<quint8> ciphers;
+    QByteArray agreementKey;
+    stream->agreementKey.reset();
+    stream->crypto.reset();
+
+    // A fresh key pair per connection; the public key is parsed once, by the key manager
+    if (encrypt) {
+        stream->agreementKey = KeyManager::shared().publicKey(rsaPublicKeyPath) ? Crypto::newAgreementKey() : QSharedPointer<EVP_PKEY>();
+        agreementKey = Crypto::agreementPublicKey(stream->agreementKey.data());
+        if (agreementKey.isEmpty()) {
+            emit statusUpdated("Cannot encrypt with the public key " + rsaPublicKeyPath);
+            stream->agreementKey.reset();
+            stream->rejected = true;
+            stream->socket->disconnectFromHost();
+            return;
+        }
+        ciphers = Crypto::supportedCiphers();
+    }
+
+    stream->socket->write(message(Hello, magic, version, Compression::supportedCodecs(), ciphers, agreementKey));
+}
+
+bool FileClient::hasMoreWork() const
+{
+    return !pendingPieces.isEmpty() || !queriedFiles.isEmpty() || currentFileIndex < filesToSend.size()
+           || !deltaJobs.isEmpty() || !deltaResultsPending.isEmpty() || !fileBytesUnacked.isEmpty();
+}
+
+void FileClient::sendResumeQueries()
+{
+    // Queries are frames of their own, they can go out between any two data frames
+    while (currentFileIndex < filesToSend.size()) {
+        qint64 fileIndex = currentFileIndex;
+        QString filePath = filesToSend[fileIndex];
+        QFileInfo fileInfo(filePath);
+        qint64 fileSize = fileInfo.size();
+        qint64 modified = fileInfo.lastModified().toMSecsSinceEpoch();
+
+        if (!fileInfo.isFile()) {
             emit statusUpdated("Failed to open file: " + filePath);
             currentFileIndex++;
             continue;  // Skip to the next file
         }
 
-        QFileInfo fileInfo(file);
-        QString fileName = fileInfo.fileName();
-        qint64 fileSize = fileInfo.size();
-
         if (fileSize == 0) {
-            emit statusUpdated("Skipping 0-byte file: " + fileName);
-            file.close();
+            emit statusUpdated("Skipping 0-byte file: " + fileInfo.fileName());
             currentFileIndex++;
             continue;  // Skip to the next file
         }
 
-        QDataStream out(socket.data());
-        out.setVersion(QDataStream::Qt_6_8);
-        out << fileName << fileSize;
+        // The manifest carries a content hash, wait for it in file order
+        QByteArray contentHash;
+        if (deduplicate) {
+            const CachedHash cached = hashCache.value(filePath, {-1, -1, QByteArray()});
+            if (cached.size != fileSize || cached.modified != modified) {
+                startHashing(fileIndex);
+                return;
+            }
+            contentHash = cached.hash;
+        }
 
-        const qint64 chunkSize = 64 * 1024;  // 64 KB
-        qint64 bytesRemaining = fileSize;
+        currentFileIndex++;
+        queriedFiles[fileIndex] = {fileSize, modified};
 
-        while (bytesRemaining > 0) {
-            QByteArray chunk = file.read(qMin(chunkSize, bytesRemaining));
-            if (chunk.isEmpty()) {
-                emit statusUpdated("Failed to read file chunk: " + fileName);
-                break;
+        socket->write(message(ResumeQuery, fileIndex, fileInfo.fileName(), fileSize, modified, contentHash));
+    }
+}
+
+void FileClient::startHashing(qint64 fileIndex)
+{
+    if (hashing) {
+        return;
+    }
+
+    hashing = true;
+    QString filePath = filesToSend[fileIndex];
+    QFileInfo fileInfo(filePath);
+    CachedHash cached = {fileInfo.size(), fileInfo.lastModified().toMSecsSinceEpoch(), QByteArray()};
+
+    // Hashing reads the whole file, keep it off this thread. It overlaps with
+    // sending the files before it.
+    QFutureWatcher<QByteArray> *watcher = new QFutureWatcher<QByteArray>(this);
+    connect(watcher, &QFutureWatcher<QByteArray>::finished, this, [this, watcher, filePath, cached]() mutable {
+        cached.hash = watcher->result();
+        watcher->deleteLater();
+        hashing = false;
+        hashCache[filePath] = cached;
+
+        if (!sending) {
+            return; // Batch was reset while we were busy, the hash stays cached
+        }
+
+        sendResumeQueries();
+        fillAllStreams();
+        checkFinished();
+    });
+    watcher->setFuture(QtConcurrent::run(ContentIndex::hashFile, filePath));
+}
+
+void FileClient::onServerMessage(QTcpSocket *from)
+{
+    Frame frame;
+    ReadResult result;
+
+    while ((result = readFrame(from, frame)) == FrameReady) {
+        // A handler may have dropped the stream (and aborted the batch)
+        TransferStream *stream = streamFor(from);
+        if (!stream) {
+            return;
+        }
+
+        QDataStream in(frame.payload);
+        in.setVersion(QDataStream::Qt_6_8);
+
+        if (frame.type == Accept) {
+            quint16 serverVersion = 0;
+            quint8 codec = Compression::None;
+            quint8 cipher = Crypto::NoCipher;
+            QByteArray receiverKey;
+            QByteArray signature;
+            QByteArray nonce;
+            in >> serverVersion >> codec >> cipher >> receiverKey >> signature >> nonce;
+            stream->accepted = in.status() == QDataStream::Ok;
+            stream->codec = Compression::isSupported(codec) ? Compression::Codec(codec) : Compression::None;
+
+            // Never fall back to plaintext when encryption was asked for, and only
+            // agree on a key the holder of the receiver's private key vouched for
+            if (stream->accepted && stream->agreementKey) {
+                QByteArray context = Crypto::agreementPublicKey(stream->agreementKey.data()) + receiverKey + nonce;
+                stream->crypto = QSharedPointer<Crypto>::create();
+                if (!Crypto::supportedCiphers().contains(cipher)
+                    || !KeyManager::shared().verifyAgreementKey(rsaPublicKeyPath, receiverKey, signature)
+                    || !stream->crypto->agreeKey(Crypto::Cipher(cipher), stream->agreementKey.data(), receiverKey, context)) {
+                    emit statusUpdated("The receiver could not prove it holds the private key, or did not agree on a cipher.");
+                    stream->accepted = false;
+                    stream->rejected = true;
+                    stream->crypto.reset();
+                }
+                stream->agreementKey.reset();
             }
+            stream->zeroCopy = zeroCopy && stream->accepted;
+            fillStream(stream);
+            continue;
+        }
+
+        if (frame.type == Reject) {
+            QString reason;
+            in >> reason;
+            stream->rejected = true;
+            emit statusUpdated("Connection refused by the receiver: " + reason);
+            continue;
+        }
+
+        if (!sending) {
+            continue; // Replies for a batch that was reset
+        }
+
+        qint64 fileIndex = 0;
+        ByteRanges ranges;
+        Delta::Signatures signatures = {0, 0, QByteArray(), QByteArray()};
+        qint64 offset = 0;
+        qint64 length = 0;
+        bool ok = false;
+
+        in >> fileIndex;
+        if (frame.type == ResumeReply) {
+            in >> ranges;
+        } else if (frame.type == DeltaSignatures) {
+            in >> signatures.fileSize >> signatures.blockSize >> signatures.weak >> signatures.strong;
+        } else if (frame.type == FileAck) {
+            in >> offset >> length >> ok;
+        } else if (frame.type == DeltaResult) {
+            in >> ok;
+        }
+
+        if (in.status() != QDataStream::Ok) {
+            continue; // Malformed, nothing sensible to do with it
+        }
+
+        if (frame.type == ResumeReply) {
+            handleResumeReply(fileIndex, ranges);
+        } else if (frame.type == DeltaSignatures) {
+            handleDeltaSignatures(fileIndex, signatures);
+        } else if (frame.type == FileAck) {
+            handleFileAck(stream, fileIndex, offset, length, ok);
+        } else if (frame.type == DeltaResult) {
+            handleDeltaResult(stream, fileIndex, ok);
+        }
+    }
+
+    if (result == FrameTooLarge) {
+        emit statusUpdated("Invalid reply from the receiver.");
+        if (TransferStream *stream = streamFor(from)) {
+            onStreamError(stream);
+        }
+        from->abort();
+    }
+}
+
+void FileClient::handleResumeReply(qint64 fileIndex, const ByteRanges &ranges)
+{
+    if (!queriedFiles.contains(fileIndex)) {
+        return;
+    }
+
+    QueriedFile queried = queriedFiles.take(fileIndex);
+    QString fileName = QFileInfo(filesToSend[fileIndex]).fileName();
+    ByteRanges missing = missingRanges(ranges, queried.size);
+    qint64 bytesMissing = rangesSize(missing);
+
+    // Count what the receiver already has as sent
+    totalBytesSent += queried.size - bytesMissing;
+
+    if (missing.isEmpty()) {
+        emit statusUpdated("Already delivered: " + fileName);
+    } else {
+        if (bytesMissing < queried.size) {
+            emit statusUpdated(QString("Resuming %1 from %2%").arg(fileName)
+                                   .arg((queried.size - bytesMissing) * 100 / queried.size));
+        }
+        queueRanges(fileIndex, queried.size, missing);
+    }
+
+    calculateProgress();
+    fillAllStreams();
+    checkFinished();
+}
+
+void FileClient::handleDeltaSignatures(qint64 fileIndex, const Delta::Signatures &signatures)
+{
+    if (!queriedFiles.contains(fileIndex)) {
+        return;
+    }
+
+    QueriedFile queried = queriedFiles.take(fileIndex);
+    QString filePath = filesToSend[fileIndex];
+    quint64 batch = batchId;
+    deltaJobs.insert(fileIndex);
+
+    // Rolling over the whole file is CPU heavy, keep it off this thread
+    QFutureWatcher<Delta::Plan> *watcher = new QFutureWatcher<Delta::Plan>(this);
+    connect(watcher, &QFutureWatcher<Delta::Plan>::finished, this, [this, watcher, fileIndex, queried, batch]() {
+        QSharedPointer<Delta::Plan> plan = QSharedPointer<Delta::Plan>::create(watcher->result());
+        watcher->deleteLater();
+
+        if (batch != batchId || !sending) {
+            return; // Batch was reset while we were busy
+        }
+        deltaJobs.remove(fileIndex);
+
+        QString fileName = QFileInfo(filesToSend[fileIndex]).fileName();
+        if (Delta::isWorthIt(*plan, queried.size)) {
+            emit statusUpdated(QString("Sending changes only for %1 (%2% of the file)").arg(fileName)
+                                   .arg(plan->literalBytes * 100 / queried.size));
+            deltaPlans[fileIndex] = plan;
+            deltaResultsPending.insert(fileIndex);
+            fileBytesUnqueued[fileIndex] = queried.size;
+            pendingPieces.append({fileIndex, 0, queried.size});
+
+            // Blocks the receiver copies locally count as sent
+            totalBytesSent += queried.size - plan->literalBytes;
+        } else {
+            queueRanges(fileIndex, queried.size, {{0, queried.size}});
+        }
+
+        calculateProgress();
+        fillAllStreams();
+        checkFinished();
+    });
+    watcher->setFuture(QtConcurrent::run(Delta::computeDelta, filePath, signatures));
+}
+
+void FileClient::handleFileAck(TransferStream *stream, qint64 fileIndex, qint64 offset, qint64 length, bool ok)
+{
+    acknowledgePiece(stream, fileIndex, offset);
+
+    if (fileBytesUnacked.contains(fileIndex)) {
+        QString fileName = QFileInfo(filesToSend[fileIndex]).fileName();
+        qint64 &unacked = fileBytesUnacked[fileIndex];
+        unacked -= length;
+
+        if (!ok) {
+            fileBytesUnacked.remove(fileIndex);
+            emit statusUpdated("Receiver failed to save file: " + fileName);
+        } else if (unacked <= 0) {
+            // Only now is every range on the receiver's disk
+            fileBytesUnacked.remove(fileIndex);
+            emit statusUpdated("File sent: " + fileName);
+        }
+    }
+
+    checkFinished();
+}
+
+void FileClient::handleDeltaResult(TransferStream *stream, qint64 fileIndex, bool ok)
+{
+    acknowledgePiece(stream, fileIndex, 0);
+
+    if (!deltaResultsPending.remove(fileIndex)) {
+        return;
+    }
+
+    deltaPlans.remove(fileIndex);
+    if (ok) {
+        emit statusUpdated("File sent: " + QFileInfo(filesToSend[fileIndex]).fileName());
+    } else {
+        // The receiver could not rebuild it (old copy changed?), send it whole
+        QFileInfo fileInfo(filesToSend[fileIndex]);
+        emit statusUpdated("Delta rejected, sending the whole file: " + fileInfo.fileName());
+        totalBytesSent -= fileInfo.size(); // Copied blocks and literals both counted already
+        queueRanges(fileIndex, fileInfo.size(), {{0, fileInfo.size()}});
+        fillAllStreams();
+    }
+
+    checkFinished();
+}
 
-            qint64 bytesSent = socket->write(chunk);
-            if (bytesSent == -1) {
-                emit statusUpdated("Failed to send file chunk: " + fileName);
-                break;
+void FileClient::acknowledgePiece(TransferStream *stream, qint64 fileIndex, qint64 offset)
+{
+    for (int i = 0; i < stream->awaitingAck.size(); ++i) {
+        if (stream->awaitingAck[i].fileIndex == fileIndex && stream->awaitingAck[i].offset == offset) {
+            stream->awaitingAck.removeAt(i);
+            return;
+        }
+    }
+}
+
+void FileClient::queueRanges(qint64 fileIndex, qint64 fileSize, const ByteRanges &ranges)
+{
+    fileBytesUnqueued[fileIndex] += rangesSize(ranges);
+    fileBytesUnacked[fileIndex] += rangesSize(ranges);
+
+    // Only stripe when more than one stream may be used and it is worth it
+    bool stripe = streamCount != 1 && fileSize >= 2 * stripeSize;
+    for (const ByteRange &range : ranges) {
+        qint64 end = range.first + range.second;
+        qint64 step = stripe ? stripeSize : range.second;
+        for (qint64 offset = range.first; offset < end; offset += step) {
+            pendingPieces.append({fileIndex, offset, qMin(step, end - offset)});
+        }
+    }
+}
+
+void FileClient::fillAllStreams()
+{
+    const QList<QSharedPointer<TransferStream>> current = streams; // fillStream may drop streams
+    for (const QSharedPointer<TransferStream> &stream : current) {
+        fillStream(stream.data());
+    }
+}
+
+bool FileClient::takeNextPiece(FilePiece &piece)
+{
+    if (pendingPieces.isEmpty()) {
+        return false;
+    }
+
+    piece = pendingPieces.takeFirst();
+    return true;
+}
+
+bool FileClient::startPiece(TransferStream *stream)
+{
+    FilePiece piece;
+    while (takeNextPiece(piece)) {
+        QString filePath = filesToSend[piece.fileIndex];
+        QSharedPointer<QFile> file = QSharedPointer<QFile>::create(filePath);
+
+        if (!file->open(QIODevice::ReadOnly) || !file->seek(piece.offset)) {
+            emit statusUpdated("Failed to open file: " + filePath);
+
+            // None of its other pieces can be sent either, stop waiting for them
+            pendingPieces.removeIf([&piece](const FilePiece &other) { return other.fileIndex == piece.fileIndex; });
+            fileBytesUnqueued.remove(piece.fileIndex);
+            fileBytesUnacked.remove(piece.fileIndex);
+            deltaResultsPending.remove(piece.fileIndex);
+            deltaPlans.remove(piece.fileIndex);
+
+            // Later, the caller is still working on this stream
+            QMetaObject::invokeMethod(this, &FileClient::checkFinished, Qt::QueuedConnection);
+            continue;  // Skip to the next piece
+        }
+
+        QFileInfo fileInfo(*file);
+        QString fileName = fileInfo.fileName();
+        qint64 fileSize = fileInfo.size();
+        qint64 modified = fileInfo.lastModified().toMSecsSinceEpoch();
+
+        stream->file = file;
+        stream->fileName = fileName;
+        stream->piece = piece;
+        stream->bytesQueued = 0;
+        stream->opIndex = 0;
+        stream->plan = deltaPlans.value(piece.fileIndex);
+        stream->skipChunks = 0;
+        stream->skipBackoff = 0;
+        stream->dropBehind = cacheBypassThreshold > 0 && fileSize >= cacheBypassThreshold && !stream->plan;
+        stream->droppedUpTo = piece.offset;
+        if (stream->dropBehind) {
+            PageCache::startBypass(*file);
+        }
+
+        if (stream->plan) {
+            // Delta header, the ops follow one by one from fillStream()
+            stream->socket->write(message(DeltaHeader, piece.fileIndex, fileName, fileSize, modified,
+                                          stream->plan->baseSize, stream->plan->blockSize));
+            stream->bytesRemaining = 0;
+        } else {
+            // Header: name, full size and mtime, then the range carried by this stream
+            stream->socket->write(message(FileHeader, piece.fileIndex, fileName, fileSize, modified,
+                                          piece.offset, piece.length));
+            stream->bytesRemaining = piece.length;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+void FileClient::fillStream(TransferStream *stream)
+{
+    const qint64 chunkSize = 64 * 1024;  // 64 KB
+    const qint64 directChunkSize = 256 * 1024; // sendfile() chunks, a partial send copies at most one
+
+    if (!sending || !stream->accepted || stream->socket->state() != QAbstractSocket::ConnectedState) {
+        return;
+    }
+
+    while (stream->socket->bytesToWrite() < highWatermark) {
+        if (!stream->file && !startPiece(stream)) {
+            break;
+        }
+
+        if (stream->bytesRemaining > 0) {
+            qint64 bytesSent = 0;
+            bool direct = canSendDirect(stream);
+
+            if (direct) {
+                // sendfile() bypasses the socket buffer, so it has to be empty first;
+                // its bytesWritten brings us back here
+                if (stream->socket->bytesToWrite() > 0) {
+                    break;
+                }
+
+                bytesSent = sendChunkDirect(stream, qMin(directChunkSize, stream->bytesRemaining), chunkSize);
+                if (bytesSent <= 0) {
+                    emit statusUpdated("Failed to send file chunk: " + stream->fileName);
+                    abortSending();
+                    return;
+                }
+            } else if (stream->crypto) {
+                bytesSent = sendSealedChunks(stream, chunkSize);
+                if (bytesSent == 0) {
+                    break; // Still on its way from the disk, onDiskReady() brings us back
+                }
+                if (bytesSent < 0) {
+                    emit statusUpdated("Failed to send file chunk: " + stream->fileName);
+                    abortSending();
+                    return;
+                }
+            } else {
+                BufferPool::Buffer chunk;
+                int read = readChunk(stream, qMin(chunkSize, stream->bytesRemaining), chunk);
+                if (read == 0) {
+                    break; // Still on its way from the disk, onDiskReady() brings us back
+                }
+                if (read < 0) {
+                    emit statusUpdated("Failed to read file chunk: " + stream->fileName);
+                    abortSending();
+                    return;
+                }
+
+                if (!writeChunk(stream, chunk.view())) {
+                    emit statusUpdated("Failed to send file chunk: " + stream->fileName);
+                    abortSending();
+                    return;
+                }
+                bytesSent = chunk.size();
             }
 
-            bytesRemaining -= bytesSent;
+            // Progress counts file bytes, whatever they shrank to on the wire
+            stream->bytesRemaining -= bytesSent;
+            stream->bytesQueued += bytesSent;
             totalBytesSent += bytesSent;
+            if (direct) {
+                calculateProgress(); // No bytesWritten for what sendfile() took
+            }
+            dropSent(stream, false);
+            continue;
+        }
+
+        if (stream->plan) {
+            if (stream->opIndex < stream->plan->ops.size()) {
+                const Delta::Op &op = stream->plan->ops[stream->opIndex++];
+                if (op.type == Delta::Op::Copy) {
+                    stream->socket->write(message(DeltaCopy, op.position, op.length));
+                } else {
+                    // Literal bytes go out as FileData frames like range data
+                    if (!stream->file->seek(op.position)) {
+                        emit statusUpdated("Failed to read file chunk: " + stream->fileName);
+                        abortSending();
+                        return;
+                    }
+                    stream->bytesRemaining = op.length;
+                }
+                continue;
+            }
+
+            stream->socket->write(message(DeltaEnd, stream->plan->fileHash));
+        }
+
+        finishPiece(stream);
+    }
+}
+
+int FileClient::readChunk(TransferStream *stream, qint64 size, BufferPool::Buffer &chunk)
+{
+    // Delta literals jump around the file, read them on the spot
+    if (!disk || stream->plan) {
+        chunk = BufferPool::shared().acquire();
+        if (chunk.isNull()) {
+            return -1;
+        }
+        chunk.setSize(stream->file->read(chunk.data(), qMin(size, chunk.capacity())));
+        return chunk.size() > 0 ? 1 : -1;
+    }
+
+    // Whatever was read for another file or position is of no use now
+    qint64 position = stream->file->pos();
+    if (!stream->readAhead.isEmpty() && (stream->readAhead.first()->file != stream->file
+                                         || stream->readAhead.first()->offset != position)) {
+        stream->readAhead.clear();
+    }
+
+    // Keep the next few chunks of the piece in flight, a whole batch of them when they are sealed together
+    qint64 end = stream->piece.offset + stream->piece.length;
+    qint64 next = stream->readAhead.isEmpty() ? position : stream->readAhead.last()->offset + stream->readAhead.last()->size;
+    int depth = stream->crypto ? qMax(readAheadChunks, sealBatchSize()) : readAheadChunks;
+    bool queued = false;
+    while (stream->readAhead.size() < depth && next < end) {
+        QSharedPointer<PendingRead> read = QSharedPointer<PendingRead>::create();
+        read->file = stream->file;
+        read->offset = next;
+        read->data = BufferPool::shared().acquire();
+        if (read->data.isNull()) {
+            break; // Whatever is in flight still arrives, the rest is tried again next time
+        }
+        read->size = qMin(qMin(size, read->data.capacity()), end - next);
+        disk->read(read->file.data(), next, read->data.data(), read->size, [read](qint64 result) {
+            read->result = result;
+        });
+        stream->readAhead.append(read);
+        next += read->size;
+        queued = true;
+    }
+    if (stream->readAhead.isEmpty()) {
+        return -1;
+    }
+    if (queued) {
+        disk->submit();
+    }
+
+    QSharedPointer<PendingRead> read = stream->readAhead.first();
+    if (read->result == -2) {
+        return 0;
+    }
+
+    stream->readAhead.removeFirst();
+    if (read->result != read->size || read->size != size) {
+        return -1;
+    }
+
+    // The direct path and delta literals go by the file position, keep it in step
+    if (!stream->file->seek(position + size)) {
+        return -1;
+    }
+    chunk = std::move(read->data);
+    chunk.setSize(read->size);
+    return 1;
+}
+
+void FileClient::onDiskReady()
+{
+    if (disk->poll(false) > 0) {
+        fillAllStreams();
+    }
+}
+
+Compression::Codec FileClient::packChunk(TransferStream *stream, QByteArrayView chunk, BufferPool::Buffer &packed)
+{
+    // No codec in common, or compression switched off: frames carry the raw chunk
+    if (!compress || stream->codec == Compression::None) {
+        return Compression::None;
+    }
+    if (stream->skipChunks > 0) {
+        stream->skipChunks--;
+        return Compression::None;
+    }
+
+    // Anything that does not fit in 90% of the chunk is not worth it
+    if (Compression::looksCompressible(stream->codec, chunk)) {
+        packed = BufferPool::shared().acquire();
+        if (!packed.isNull()) {
+            packed.setSize(Compression::compress(stream->codec, chunk, packed.data(),
+                                                 qMin(packed.capacity(), chunk.size() * 9 / 10)));
+        }
+    }
+
+    if (packed.size() > 0) {
+        stream->skipBackoff = 0;
+        return stream->codec;
+    }
+
+    // Already compressed data rarely changes mid file, sample again less and less often
+    packed.release();
+    stream->skipBackoff = qMin(qMax(1, stream->skipBackoff * 2), 64);
+    stream->skipChunks = stream->skipBackoff;
+    return Compression::None;
+}
+
+bool FileClient::writeChunk(TransferStream *stream, QByteArrayView chunk)
+{
+    if (stream->crypto) {
+        // A chunk that is not part of a batch is a batch of its own
+        BufferPool::Buffer copy = BufferPool::shared().acquire();
+        if (copy.isNull() || chunk.size() > copy.capacity()) {
+            return false;
+        }
+        memcpy(copy.data(), chunk.data(), size_t(chunk.size()));
+        copy.setSize(chunk.size());
+        sealBatch.clear();
+        sealBatch.push_back({std::move(copy), BufferPool::Buffer(), Compression::None, {}, {}});
+        return sealAndWrite(stream);
+    }
+
+    BufferPool::Buffer packed;
+    Compression::Codec codec = packChunk(stream, chunk, packed);
+
+    // The header from the stack and the payload from its buffer, both copied into the socket's buffer
+    QByteArrayView payload = codec == Compression::None ? chunk : packed.view();
+    char header[frameHeaderSize + chunkHeaderSize];
+    writeChunkHeader(header, codec, chunk.size(), payload.size());
+    return stream->socket->write(header, sizeof(header)) == qint64(sizeof(header))
+           && stream->socket->write(payload.data(), payload.size()) == payload.size();
+}
+
+qint64 FileClient::sendSealedChunks(TransferStream *stream, qint64 chunkSize)
+{
+    // Read ahead a batch, as far as the socket buffer will take it
+    qint64 bytes = 0;
+    sealBatch.clear();
+    while (int(sealBatch.size()) < sealBatchSize() && bytes < stream->bytesRemaining
+           && stream->socket->bytesToWrite() + bytes < highWatermark) {
+        BufferPool::Buffer chunk;
+        int read = readChunk(stream, qMin(chunkSize, stream->bytesRemaining - bytes), chunk);
+        if (read == 0) {
+            break;
+        }
+        if (read < 0) {
+            return -1;
+        }
+        bytes += chunk.size();
+        sealBatch.push_back({std::move(chunk), BufferPool::Buffer(), Compression::None, {}, {}});
+    }
+    if (sealBatch.empty()) {
+        return 0;
+    }
+
+    return sealAndWrite(stream) ? bytes : -1;
+}
+
+bool FileClient::sealAndWrite(TransferStream *stream)
+{
+    // Compressed first, sealed in place on the crypto workers, then written in order
+    sealChunks.clear();
+    for (SealedChunk &sealed : sealBatch) {
+        sealed.codec = packChunk(stream, sealed.data.view(), sealed.packed);
+        BufferPool::Buffer &payload = sealed.codec == Compression::None ? sealed.data : sealed.packed;
+        writeChunkHeader(sealed.header, sealed.codec, sealed.data.size(), payload.size() + chunkTagSize);
+        sealChunks.append({payload.view(), QByteArrayView(sealed.header, sizeof(sealed.header)), payload.data(), sealed.tag});
+    }
+    if (!stream->crypto->encryptChunks(sealChunks)) {
+        return false;
+    }
+
+    for (SealedChunk &sealed : sealBatch) {
+        QByteArrayView payload = sealed.codec == Compression::None ? sealed.data.view() : sealed.packed.view();
+        if (stream->socket->write(sealed.header, sizeof(sealed.header)) != qint64(sizeof(sealed.header))
+            || stream->socket->write(payload.data(), payload.size()) != payload.size()
+            || stream->socket->write(sealed.tag, sizeof(sealed.tag)) != qint64(sizeof(sealed.tag))) {
+            return false;
+        }
+    }
+
+    // Buffers back to the pool now rather than with the next batch
+    sealBatch.clear();
+    return true;
+}
 
-            // Calculate and emit progress after each chunk
-            calculateProgress();
+bool FileClient::canSendDirect(TransferStream *stream)
+{
+    // Compressed and sealed chunks need their bytes in memory anyway, and TLS encrypts in user space
+    return stream->zeroCopy && !(compress && stream->codec != Compression::None) && !stream->crypto && !stream->tls;
+}
 
-            // Wait for data to be written before proceeding
-            if (!socket->waitForBytesWritten(30000)) {
-                emit statusUpdated("Timeout while sending file: " + fileName);
-                break;
+qint64 FileClient::sendChunkDirect(TransferStream *stream, qint64 size, qint64 fallbackSize)
+{
+    qintptr descriptor = stream->socket->socketDescriptor();
+    qint64 offset = stream->file->pos();
+    QByteArray header = chunkHeader(Compression::None, size, size);
+
+    qint64 headerSent = ZeroCopy::sendBytes(descriptor, header);
+    qint64 dataSent = 0;
+
+    if (headerSent <= 0) {
+        if (headerSent < 0) {
+            stream->zeroCopy = false; // Let the socket report whatever went wrong
+        }
+
+        // Nothing went out, so an ordinary chunk can take this one's place
+        BufferPool::Buffer chunk = BufferPool::shared().acquire();
+        if (chunk.isNull()) {
+            return -1;
+        }
+        chunk.setSize(stream->file->read(chunk.data(), qMin(qMin(fallbackSize, size), chunk.capacity())));
+        return chunk.size() > 0 && writeChunk(stream, chunk.view()) ? chunk.size() : -1;
+    }
+
+    if (headerSent == header.size()) {
+        dataSent = ZeroCopy::sendFile(descriptor, stream->file->handle(), offset, size);
+        if (dataSent < 0) {
+            stream->zeroCopy = false; // Not for this file or socket, copy from now on
+            dataSent = 0;
+        }
+    }
+
+    // sendfile() does not move the file position
+    if (!stream->file->seek(offset + dataSent)) {
+        return -1;
+    }
+
+    // The frame is started, whatever the kernel did not take of it goes through the socket buffer
+    if (headerSent < header.size() || dataSent < size) {
+        qint64 rest = header.size() - headerSent;
+        if (rest > 0 && stream->socket->write(header.constData() + headerSent, rest) != rest) {
+            return -1;
+        }
+
+        BufferPool::Buffer data = BufferPool::shared().acquire();
+        while (dataSent < size) {
+            data.setSize(data.isNull() ? 0 : stream->file->read(data.data(), qMin(data.capacity(), size - dataSent)));
+            if (data.size() <= 0 || stream->socket->write(data.constData(), data.size()) != data.size()) {
+                return -1;
             }
+            dataSent += data.size();
         }
+    }
 
-        file.close();
-        emit statusUpdated("File sent: " + fileName);
-        currentFileIndex++;
+    return size;
+}
+
+void FileClient::dropSent(TransferStream *stream, bool all)
+{
+    if (!stream->dropBehind) {
+        return;
     }
 
+    // A window behind, sendfile() may still have the latest pages queued on the socket
+    qint64 end = all ? stream->file->pos() : stream->file->pos() - cacheDropWindow;
+    if (end - stream->droppedUpTo >= (all ? 1 : cacheDropWindow)) {
+        PageCache::dropRead(*stream->file, stream->droppedUpTo, end - stream->droppedUpTo);
+        stream->droppedUpTo = end;
+    }
+}
+
+void FileClient::finishPiece(TransferStream *stream)
+{
+    dropSent(stream, true);
+    stream->readAhead.clear();
+    stream->file->close();
+    stream->file.reset();
+    stream->plan.reset();
+
+    // Move on without waiting for the wire, the receiver's ack settles the piece
+    stream->awaitingAck.append(stream->piece);
+    qint64 &unqueued = fileBytesUnqueued[stream->piece.fileIndex];
+    unqueued -= stream->piece.length;
+    if (unqueued <= 0) {
+        fileBytesUnqueued.remove(stream->piece.fileIndex);
+    }
+}
+
+void FileClient::onStreamBytesWritten(TransferStream *stream)
+{
+    if (!sending) {
+        return;
+    }
+
+    calculateProgress();
+
+    if (stream->socket->bytesToWrite() <= lowWatermark) {
+        fillStream(stream);
+    }
+
+    checkFinished();
+}
+
+void FileClient::onStreamError(TransferStream *stream)
+{
+    if (!sending) {
+        return;
+    }
+
+    if (stream == streams.first().data()) {
+        emit statusUpdated("Failed to send files: " + socket->errorString());
+        abortSending();
+        return;
+    }
+
+    // An extra stream dropped: hand its range back so another stream re-sends it whole
+    if (stream->file) {
+        stream->file->close();
+        stream->file.reset();
+        stream->plan.reset();
+        pendingPieces.prepend(stream->piece);
+        totalBytesSent -= stream->bytesQueued;
+    }
+
+    // Same for pieces that were queued but never confirmed
+    for (const FilePiece &piece : stream->awaitingAck) {
+        QSharedPointer<Delta::Plan> plan = deltaPlans.value(piece.fileIndex);
+        pendingPieces.prepend(piece);
+        fileBytesUnqueued[piece.fileIndex] += piece.length;
+        totalBytesSent -= plan ? plan->literalBytes : piece.length;
+    }
+    stream->awaitingAck.clear();
+
+    stream->socket->disconnect(this);
+    for (int i = 1; i < streams.size(); ++i) {
+        if (streams[i].data() == stream) {
+            streams.removeAt(i);
+            break;
+        }
+    }
+
+    fillStream(streams.first().data());
+}
+
+void FileClient::onProbeTimeout()
+{
+    qint64 sent = bytesOnWire();
+    double elapsed = probeClock.restart() / 1000.0;
+    double throughput = elapsed > 0 ? (sent - probeBytes) / elapsed : 0;
+    probeBytes = sent;
+
+    // Keep adding streams while each one buys at least 10% more throughput
+    if (throughput > bestThroughput * 1.1 && streams.size() < maxStreams && hasMoreWork()) {
+        bestThroughput = throughput;
+        openExtraStream();
+        return;
+    }
+
+    if (streams.size() > 1) {
+        emit statusUpdated(QString("Sending over %1 parallel connections").arg(streams.size()));
+    }
+    probeTimer->stop();
+}
+
+void FileClient::checkFinished()
+{
+    if (!sending || hasMoreWork()) {
+        return;
+    }
+
+    for (const QSharedPointer<TransferStream> &stream : streams) {
+        if (stream->file || !stream->awaitingAck.isEmpty() || stream->socket->bytesToWrite() > 0) {
+            return;
+        }
+    }
+
+    finishSending();
+}
+
+void FileClient::finishSending()
+{
+    sending = false;
+    probeTimer->stop();
+    closeExtraStreams();
     emit statusUpdated("All files sent successfully.");
     emit progressUpdated(100);
 }
 
+void FileClient::abortSending()
+{
+    // The receiver expects the rest of the announced range, so the stream
+    // cannot be resumed after a partial range. Drop the connection instead,
+    // the receiver's journal keeps what already arrived.
+    sending = false;
+    probeTimer->stop();
+    closeExtraStreams();
+
+    TransferStream *primary = streams.first().data();
+    primary->awaitingAck.clear();
+    primary->bytesRemaining = 0;
+    primary->plan.reset();
+    if (primary->file) {
+        primary->file->close();
+        primary->file.reset();
+    }
+    if (socket->state() != QAbstractSocket::UnconnectedState) {
+        socket->abort();
+    }
+}
+
+qint64 FileClient::bytesOnWire() const
+{
+    // Bytes still sitting in the socket buffers have not left this machine yet
+    qint64 buffered = 0;
+    for (const QSharedPointer<TransferStream> &stream : streams) {
+        buffered += stream->socket->bytesToWrite();
+    }
+    return qMax<qint64>(0, totalBytesSent - buffered);
+}
+
 void FileClient::calculateProgress()
 {
     if (totalFilesSize == 0) {
@@ -145,16 +1285,36 @@ void FileClient::calculateProgress()
         return;
     }
 
-    int percentage = static_cast<int>((totalBytesSent * 100) / totalFilesSize);
-    emit progressUpdated(percentage);
+    int percentage = static_cast<int>((bytesOnWire() * 100) / totalFilesSize);
+    emit progressUpdated(qMin(percentage, 100));
 }
 
 void FileClient::reset()
 {
     currentFileIndex = 0;
     filesToSend.clear();
+    queriedFiles.clear();
+    pendingPieces.clear();
+    fileBytesUnqueued.clear();
+    fileBytesUnacked.clear();
+    deltaPlans.clear();
+    deltaJobs.clear();
+    deltaResultsPending.clear();
+    batchId++;
     totalFilesSize = 0;
     totalBytesSent = 0;
+    sending = false;
+    probeTimer->stop();
+    closeExtraStreams();
+
+    TransferStream *primary = streams.first().data();
+    primary->awaitingAck.clear();
+    primary->bytesRemaining = 0;
+    primary->plan.reset();
+    if (primary->file) {
+        primary->file->close();
+        primary->file.reset();
+    }
     if (socket->state() != QAbstractSocket::UnconnectedState) {
         socket->disconnectFromHost();
     }
@@ -2,15 +2,36 @@
 #define FILECLIENT_H
 
 #include <QTcpSocket>
+#include <QSslSocket>
+#include <QSslConfiguration>
+#include <QSslError>
+#include <QSslKey>
 #include <QFile>
 
 #include <QSharedPointer>
 #include <QObject>
+#include <QList>
+#include <QHash>
+#include <QSet>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QSocketNotifier>
+#include <vector>
 
 #include <openssl/rsa.h>
 #include <openssl/evp.h>
 #include <openssl/pem.h>
 
+#include "transferprotocol.h"
+#include "delta.h"
+#include "compression.h"
+#include "bufferpool.h"
+#include "zerocopy.h"
+#include "diskbackend.h"
+#include "pagecache.h"
+#include "crypto.h"
+#include "keymanager.h"
+
 #include <QtConcurrent/QtConcurrentRun>
 #include <QFuture>
 #include <QFutureWatcher>
@@ -24,22 +45,173 @@ public:
     ~FileClient();
     void sendFiles(const QStringList &files, const QString &ipAddress);
     void reset();
-    bool connectToServer(const QString &ipAddress); // Return connection status
+    bool connectToServer(const QString &ipAddress); // True once the receiver accepted the handshake
     void disconnectFromServer();
+    void setWriteWatermarks(qint64 high, qint64 low); // Bytes queued in the socket before we pause/resume reading the file
+    void setStreamCount(int count); // Parallel connections used for large files, 0 = auto
+    void setDeduplicationEnabled(bool enabled); // Hash files first so the receiver can skip content it already has
+    void setCompressionEnabled(bool enabled);   // Compress range data on connections where the receiver agrees
+    void setZeroCopyEnabled(bool enabled);      // Linux: sendfile() raw chunks straight from the page cache
+    void setDiskBackend(DiskBackend::Kind kind); // io_uring: keep reads of the next chunks in flight while sending
+    void setCacheBypassThreshold(qint64 bytes);  // Files this big are dropped from the page cache as they are sent, 0 = never
+    void setEncryption(bool enabled, const QString &rsaPublicKeyPath); // Seal range data for the holder of the matching private key; new connections only
+    void setTlsEnabled(bool enabled); // TLS 1.3 around the whole connection, the receiver is trusted by the public key above; new connections only
 
 signals:
     void statusUpdated(const QString &message);
     void progressUpdated(int percentage);
 
+private slots:
+    void onProbeTimeout();
+
 private:
+    // A byte range of one file. Small files are sent as a single range,
+    // large files are cut into stripes that any stream can pick up.
+    struct FilePiece {
+        qint64 fileIndex;
+        qint64 offset;
+        qint64 length;
+    };
+
+    // A chunk asked of the disk ahead of the stream, filled in by the backend
+    struct PendingRead {
+        QSharedPointer<QFile> file; // Also keeps it open until the read is done
+        qint64 offset;
+        qint64 size;
+        BufferPool::Buffer data;    // Read into, handed on to the stream once filled
+        qint64 result = -2;         // Bytes read, -1 on error, -2 while in flight
+    };
+
+    // One TCP connection to the server and the range it is currently sending
+    struct TransferStream {
+        QSharedPointer<QTcpSocket> socket;
+        QSharedPointer<QFile> file; // Null while the stream is idle
+        QString fileName;
+        FilePiece piece;
+        qint64 bytesRemaining;      // Bytes of the piece (or current literal) not yet queued
+        qint64 bytesQueued;         // Bytes of the piece already queued
+        QSharedPointer<Delta::Plan> plan; // Set while sending a delta instead of a range
+        qint64 opIndex;                   // Next delta op to queue
+        bool accepted;                    // Handshake done, frames may be sent
+        bool rejected;
+        Compression::Codec codec;         // Picked by the receiver in its Accept
+        int skipChunks;                   // Chunks left to send raw before trying to compress again
+        int skipBackoff;                  // Grows while the data keeps not compressing
+        bool zeroCopy;                    // Raw chunks go out with sendfile(), cleared if it is refused
+        QList<FilePiece> awaitingAck;     // Fully queued, not yet confirmed by the receiver
+        QList<QSharedPointer<PendingRead>> readAhead; // Next chunks of the piece, in file order
+        bool dropBehind;                  // Huge file, sent data is dropped from the page cache
+        qint64 droppedUpTo;               // File offset the piece is dropped up to
+        QSharedPointer<EVP_PKEY> agreementKey; // Ours for this connection, until the receiver's Accept
+        bool tls;                         // Connected with TLS, the kernel only ever sees records
+        QSharedPointer<Crypto> crypto;    // Set while the connection is encrypted
+    };
+
+    // What we announced in a resume query, kept until the receiver answers
+    struct QueriedFile {
+        qint64 size;
+        qint64 modified;
+    };
+
     QSharedPointer<QTcpSocket> socket;
+    QString serverAddress;
     QStringList filesToSend;
-    qint64 currentFileIndex;
+    qint64 currentFileIndex; // Next file to send a resume query for
+    QHash<qint64, QueriedFile> queriedFiles; // Per file index, waiting for a resume reply
+
+    // Content hashes for the manifest, cached so a re-sent file is not read twice
+    struct CachedHash {
+        qint64 size;
+        qint64 modified;
+        QByteArray hash; // Empty if the file could not be read
+    };
+
+    bool deduplicate;
+    bool compress;
+    bool zeroCopy;
+    bool encrypt;
+    QString rsaPublicKeyPath;              // The receiver's, checks the agreement key it signed and its TLS certificate
+    bool tls;
+    bool hashing;                          // A hash job is running
+    QSharedPointer<DiskBackend> disk;      // Null for plain QFile reads
+    QSocketNotifier *diskNotifier;         // Fires when the disk has finished reads
+    qint64 cacheBypassThreshold;           // 0 = never
+    QHash<QString, CachedHash> hashCache;  // By file path
 
     qint64 totalFilesSize; // Total size of all files
     qint64 totalBytesSent; // Total bytes sent so far
 
-    void sendNextFile();
+    QList<QSharedPointer<TransferStream>> streams; // streams[0] always uses socket
+    QList<FilePiece> pendingPieces;                // Cut but not yet picked up
+    QHash<qint64, qint64> fileBytesUnqueued;       // Per file index, bytes not yet queued
+    QHash<qint64, qint64> fileBytesUnacked;        // Per file index, range bytes the receiver has not confirmed
+
+    QHash<qint64, QSharedPointer<Delta::Plan>> deltaPlans; // Per file index, files sent as a delta
+    QSet<qint64> deltaJobs;           // Delta being computed against the receiver's signatures
+    QSet<qint64> deltaResultsPending; // Delta sent, waiting for the receiver to confirm the rebuild
+    quint64 batchId;                  // Bumped per batch so late delta jobs can be dropped
+
+    // A chunk of an encrypted stream on its way out, its buffers held until it is written
+    struct SealedChunk {
+        BufferPool::Buffer data;
+        BufferPool::Buffer packed; // Holds the payload unless codec is None
+        Compression::Codec codec;
+        char header[TransferProtocol::frameHeaderSize + TransferProtocol::chunkHeaderSize];
+        char tag[TransferProtocol::chunkTagSize];
+    };
+    std::vector<SealedChunk> sealBatch; // Reused from batch to batch
+    QList<Crypto::Chunk> sealChunks;
+
+    qint64 highWatermark; // Stop queueing once bytesToWrite() reaches this
+    qint64 lowWatermark;  // Start queueing again once bytesToWrite() drops to this
+    bool sending;
+
+    int streamCount;             // Requested streams, 0 = auto
+    int maxStreams;
+    qint64 stripeSize;
+    QTimer *probeTimer;          // Auto mode: measures throughput after each new stream
+    QElapsedTimer probeClock;
+    qint64 probeBytes;
+    double bestThroughput;
+
+    TransferStream *addStream(const QSharedPointer<QTcpSocket> &streamSocket);
+    void openExtraStream();
+    void closeExtraStreams();
+    TransferStream *streamFor(QTcpSocket *streamSocket) const;
+    void startConnection(TransferStream *stream); // connectToHost(), with TLS if it is on
+    QSslConfiguration tlsConfiguration() const;
+    void onSslErrors(TransferStream *stream, const QList<QSslError> &errors);
+    void sendHello(TransferStream *stream);
+    bool hasMoreWork() const;
+    void sendResumeQueries(); // Ask the receiver what it already has of every new file
+    void startHashing(qint64 fileIndex);
+    void onServerMessage(QTcpSocket *from);
+    void handleResumeReply(qint64 fileIndex, const TransferProtocol::ByteRanges &ranges);
+    void handleDeltaSignatures(qint64 fileIndex, const Delta::Signatures &signatures);
+    void handleFileAck(TransferStream *stream, qint64 fileIndex, qint64 offset, qint64 length, bool ok);
+    void handleDeltaResult(TransferStream *stream, qint64 fileIndex, bool ok);
+    void acknowledgePiece(TransferStream *stream, qint64 fileIndex, qint64 offset);
+    void queueRanges(qint64 fileIndex, qint64 fileSize, const TransferProtocol::ByteRanges &ranges);
+    void fillAllStreams();
+    bool takeNextPiece(FilePiece &piece);
+    bool startPiece(TransferStream *stream); // Open the next range and queue its header, false when nothing is left
+    void fillStream(TransferStream *stream); // Queue chunks until the high watermark is reached
+    int readChunk(TransferStream *stream, qint64 size, BufferPool::Buffer &chunk); // 1 with the next chunk, 0 while it is on its way, -1 on error
+    void onDiskReady();
+    Compression::Codec packChunk(TransferStream *stream, QByteArrayView chunk, BufferPool::Buffer &packed); // The codec packed holds, None to send chunk raw
+    bool writeChunk(TransferStream *stream, QByteArrayView chunk); // One FileData frame, compressed if it pays, sealed if encrypted
+    qint64 sendSealedChunks(TransferStream *stream, qint64 chunkSize); // Up to a batch of sealed frames, file bytes queued, 0 while reading, -1 on error
+    bool sealAndWrite(TransferStream *stream); // Compress, seal and queue the chunks in sealBatch
+    bool canSendDirect(TransferStream *stream); // Zero-copy on and no compression or encryption wanted on this stream
+    qint64 sendChunkDirect(TransferStream *stream, qint64 size, qint64 fallbackSize); // Raw FileData frame through sendfile(), file bytes sent or -1
+    void dropSent(TransferStream *stream, bool all); // Page cache behind the stream, all at the end of the piece
+    void finishPiece(TransferStream *stream);
+    void onStreamBytesWritten(TransferStream *stream);
+    void onStreamError(TransferStream *stream);
+    void checkFinished();
+    void finishSending();
+    void abortSending();
+    qint64 bytesOnWire() const;
     void calculateProgress(); // Helper function to calculate progress
 
 };
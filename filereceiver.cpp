@@ -0,0 +1,1001 @@
+#include "filereceiver.h"
+#include <QFileInfo>
+#include <QDebug>
+#include <QDir>
+#include <QDateTime>
+#include <QPointer>
+#include <QFutureWatcher>
+#include <QtConcurrent/QtConcurrentRun>
+
+#include <cstring>
+
+using namespace TransferProtocol;
+
+namespace {
+
+const qint64 checkpointSize = 8 * 1024 * 1024; // Journal progress every 8 MB
+const qint64 spliceReadBufferSize = 64 * 1024; // Qt's share of a zero-copy connection, the rest stays in the kernel for splice()
+const int writeQueueJobs = 256;                  // Chunks waiting for the disk, per receiver
+const qint64 writeQueueBytes = 32 * 1024 * 1024; // Whatever the chunks' size
+const int jobsPerFrame = 3;                      // Most a frame can queue: data, checkpoint, ack
+const int maxOpenBatch = 32;                     // Sealed frames opened together
+const char tlsHandshakeRecord = 0x16;            // First byte of a ClientHello; our Hello starts with a zero length byte
+const int batchSyncDelay = 500;                  // ms without a new file before the batch is synced
+
+}
+
+FileReceiver::FileReceiver(ContentIndex *contentIndex, IncomingFiles *incomingFiles, QObject *parent)
+    : QObject(parent), contentIndex(contentIndex), incomingFiles(incomingFiles), zeroCopy(false),
+      cacheBypassThreshold(0)
+{
+    writer = new DiskWriter(writeQueueJobs, writeQueueBytes, [this]() {
+        QMetaObject::invokeMethod(this, [this]() { resumeStalled(); }, Qt::QueuedConnection);
+    });
+
+    // The sync goes behind the queued writes, on the writer thread
+    batchSyncTimer = new QTimer(this);
+    batchSyncTimer->setSingleShot(true);
+    batchSyncTimer->setInterval(batchSyncDelay);
+    connect(batchSyncTimer, &QTimer::timeout, this, [this]() {
+        IncomingFiles *files = this->incomingFiles;
+        writer->push({nullptr, 0, BufferPool::Buffer(), nullptr, [files]() { files->syncBatch(); }});
+    });
+}
+
+FileReceiver::~FileReceiver()
+{
+    delete writer; // Finishes the queued writes
+}
+
+void FileReceiver::addConnection(qintptr socketDescriptor)
+{
+    // Counted right away so FileServer does not pile every new connection on us
+    connections.ref();
+    QMetaObject::invokeMethod(this, [this, socketDescriptor]() { openConnection(socketDescriptor); }, Qt::QueuedConnection);
+}
+
+int FileReceiver::connectionCount() const
+{
+    return connections.loadRelaxed();
+}
+
+int FileReceiver::writeQueueFill() const
+{
+    return writer->occupancy();
+}
+
+void FileReceiver::setDownloadLocation(const QString &path)
+{
+    downloadLocation = path;
+}
+
+void FileReceiver::setAllowedIPs(const QSet<QString> &allowedIPs)
+{
+    this->allowedIPs = allowedIPs;
+}
+
+void FileReceiver::setZeroCopyEnabled(bool enabled)
+{
+    zeroCopy = enabled && ZeroCopy::isAvailable();
+}
+
+void FileReceiver::setRSAPrivateKeyPath(const QString &path)
+{
+    rsaPrivateKeyPath = path;
+}
+
+void FileReceiver::setDiskBackend(DiskBackend::Kind kind)
+{
+    writer->setBackend(kind);
+}
+
+void FileReceiver::setCacheBypassThreshold(qint64 bytes)
+{
+    cacheBypassThreshold = PageCache::isAvailable() ? qMax<qint64>(0, bytes) : 0;
+}
+
+void FileReceiver::openConnection(qintptr socketDescriptor)
+{
+    // Plain until the first bytes turn out to be a TLS ClientHello
+    QSslSocket *socket = new QSslSocket(this);
+    if (!socket->setSocketDescriptor(socketDescriptor)) {
+        connections.deref();
+        delete socket;
+        return;
+    }
+    connect(socket, &QTcpSocket::disconnected, socket, &QTcpSocket::deleteLater);
+    connect(socket, &QTcpSocket::disconnected, this, [this]() { connections.deref(); });
+
+    QString clientIP = socket->peerAddress().toString();
+    clientIP = clientIP.remove("::ffff:"); // Normalize IPv4-mapped IPv6
+
+    if (allowedIPs.isEmpty() || !allowedIPs.contains(clientIP)) {
+        // qDebug() << "Blocked connection from" << clientIP;
+        socket->write(message(Reject, QString("Not on the receiver's allowed IP list")));
+        socket->disconnectFromHost(); // Flushes the Reject first
+        emit statusUpdated("Blocked " + clientIP + " for attempting to connect");
+        return;
+    }
+
+    qDebug() << "Connection allowed from" << clientIP;
+    connect(socket, &QTcpSocket::readyRead, this, [this, socket]() { readFile(socket); });
+    connect(socket, &QTcpSocket::disconnected, this, [this, socket]() {
+        connectionCodecs.remove(socket);
+        connectionCiphers.remove(socket);
+        splicePipes.remove(socket);
+        stalledSockets.remove(socket);
+
+        if (!transferInfo.contains(socket)) {
+            return;
+        }
+
+        if (transferInfo[socket].delta) {
+            // A half-built delta is worthless, the old copy is still in place
+            FileTransferInfo info = transferInfo.take(socket);
+            info.file->close();
+            info.file->remove();
+            return;
+        }
+
+        // Keep whatever part of an unfinished range made it to disk. The
+        // file closes once the writer lets go of it.
+        checkpointRange(socket);
+        transferInfo.remove(socket);
+    });
+}
+
+
+void FileReceiver::readFile(QTcpSocket *socket)
+{
+    // The handshake runs inside Qt, our Hello comes once it is done
+    if (!connectionCodecs.contains(socket) && startTls(socket)) {
+        return;
+    }
+
+    // Frames are sent back to back, so keep going while whole ones are there
+    Frame frame;
+    ChunkFrame chunk;
+    ReadResult result = NeedMoreData;
+
+    while (socket->state() == QAbstractSocket::ConnectedState) {
+        // Leave the rest in the socket while the disk catches up, TCP slows the sender down
+        if (!writer->reserve(jobsPerFrame)) {
+            stalledSockets.insert(socket);
+            updateReadBuffer(socket);
+            return;
+        }
+
+        // Raw range data on a zero-copy connection skips the frame reader
+        if (isSplicing(socket) || startSplice(socket)) {
+            result = NeedMoreData;
+            spliceFileData(socket);
+            if (isSplicing(socket)) {
+                break; // The rest of the chunk is still on its way
+            }
+            continue;
+        }
+
+        // Range data goes from the socket into a pool buffer and on to the writer in it
+        if (transferInfo.contains(socket) && connectionCiphers.contains(socket)) {
+            bool ok = true;
+            if ((result = readSealedChunks(socket, ok)) != OtherFrame) {
+                if (result != FrameReady || !ok) {
+                    break;
+                }
+                continue;
+            }
+        } else if (transferInfo.contains(socket) && (result = readChunkFrame(socket, chunk, false)) != OtherFrame) {
+            if (result != FrameReady || !readFileData(socket, chunk)) {
+                break;
+            }
+            continue;
+        }
+
+        if ((result = readFrame(socket, frame)) != FrameReady || !handleFrame(socket, frame)) {
+            break;
+        }
+    }
+
+    if (result == NeedMoreData && socket->readBufferSize() > 0 && socket->bytesAvailable() >= socket->readBufferSize()
+        && transferInfo.contains(socket)) {
+        transferInfo[socket].limitReads = false; // A frame bigger than the zero-copy read buffer, let all of it in
+        updateReadBuffer(socket);
+    }
+
+    if (result != NeedMoreData) {
+        emit statusUpdated("Invalid metadata received.");
+        socket->disconnectFromHost();
+    }
+}
+
+void FileReceiver::resumeStalled()
+{
+    const QList<QTcpSocket*> sockets = stalledSockets.values();
+    stalledSockets.clear();
+
+    for (QTcpSocket *socket : sockets) {
+        updateReadBuffer(socket);
+        readFile(socket); // Frames Qt buffered before the stall
+    }
+}
+
+void FileReceiver::updateReadBuffer(QTcpSocket *socket)
+{
+    if (stalledSockets.contains(socket)) {
+        socket->setReadBufferSize(1); // Qt stops reading, the kernel buffer fills and the window closes
+    } else if (transferInfo.contains(socket) && transferInfo[socket].limitReads) {
+        socket->setReadBufferSize(spliceReadBufferSize);
+    } else {
+        socket->setReadBufferSize(0);
+    }
+}
+
+bool FileReceiver::handleFrame(QTcpSocket *socket, const Frame &frame)
+{
+    QDataStream in(frame.payload);
+    in.setVersion(QDataStream::Qt_6_8);
+
+    // Nothing but the handshake until it is accepted
+    if (!connectionCodecs.contains(socket)) {
+        return frame.type == Hello && answerHello(socket, in);
+    }
+
+    bool receiving = transferInfo.contains(socket);
+    bool delta = receiving && transferInfo[socket].delta;
+
+    if (frame.type == ResumeQuery) {
+        return answerResumeQuery(socket, in);
+    } else if (frame.type == FileHeader) {
+        return !receiving && readRangeHeader(socket, in);
+    } else if (frame.type == DeltaHeader) {
+        return !receiving && readDeltaHeader(socket, in);
+    } else if (frame.type == FileData) {
+        return receiving && readFileData(socket, in);
+    } else if (frame.type == DeltaCopy) {
+        qint64 firstBlock;
+        qint64 blockCount;
+        in >> firstBlock >> blockCount;
+        if (!delta || in.status() != QDataStream::Ok) {
+            return false;
+        }
+        copyBaseBlocks(socket, firstBlock, blockCount);
+        return true;
+    } else if (frame.type == DeltaEnd) {
+        QByteArray fileHash;
+        in >> fileHash;
+        if (!delta || in.status() != QDataStream::Ok) {
+            return false;
+        }
+        finishDelta(socket, fileHash);
+        return true;
+    }
+
+    return false;
+}
+
+bool FileReceiver::startTls(QTcpSocket *socket)
+{
+    QSslSocket *ssl = qobject_cast<QSslSocket*>(socket);
+    char first;
+    if (!ssl || ssl->mode() != QSslSocket::UnencryptedMode || ssl->peek(&first, 1) != 1 || first != tlsHandshakeRecord) {
+        return false;
+    }
+
+    KeyManager::TlsIdentity identity = KeyManager::shared().tlsIdentity(rsaPrivateKeyPath);
+    if (identity.certificate.isEmpty()) {
+        socket->disconnectFromHost(); // A Reject frame would only confuse the sender's TLS stack
+        emit statusUpdated("Refused a TLS connection, set the RSA private key.");
+        return true;
+    }
+
+    // Rebuilt only when the key changed
+    if (identity.certificate != tlsCertificate) {
+        tlsConfiguration = QSslConfiguration::defaultConfiguration();
+        tlsConfiguration.setProtocol(QSsl::TlsV1_3OrLater);
+        tlsConfiguration.setLocalCertificate(QSslCertificate(identity.certificate));
+        tlsConfiguration.setPrivateKey(QSslKey(identity.privateKey, QSsl::Rsa));
+        tlsConfiguration.setPeerVerifyMode(QSslSocket::VerifyNone); // Senders are checked by the allowed IP list
+        tlsCertificate = identity.certificate;
+    }
+
+    ssl->setSslConfiguration(tlsConfiguration);
+    ssl->startServerEncryption();
+    return true;
+}
+
+bool FileReceiver::isTls(QTcpSocket *socket) const
+{
+    QSslSocket *ssl = qobject_cast<QSslSocket*>(socket);
+    return ssl && ssl->mode() != QSslSocket::UnencryptedMode;
+}
+
+bool FileReceiver::answerHello(QTcpSocket *socket, QDataStream &in)
+{
+    quint32 clientMagic;
+    quint16 clientVersion;
+    QList<quint8> offered;
+    QList<quint8> ciphers;
+    QByteArray senderKey;
+
+    in >> clientMagic >> clientVersion;
+    if (in.status() != QDataStream::Ok || clientMagic != magic) {
+        return false; // Not one of ours
+    }
+
+    if (clientVersion != version) {
+        socket->write(message(Reject, QString("Unsupported protocol version %1").arg(clientVersion)));
+        socket->disconnectFromHost();
+        return true;
+    }
+
+    in >> offered >> ciphers >> senderKey;
+    if (in.status() != QDataStream::Ok) {
+        return false;
+    }
+
+    // Take the sender's favourite codec that we can decode
+    Compression::Codec codec = Compression::None;
+    for (quint8 candidate : offered) {
+        if (candidate != Compression::None && Compression::isSupported(candidate)) {
+            codec = Compression::Codec(candidate);
+            break;
+        }
+    }
+    connectionCodecs[socket] = codec;
+
+    // Encrypted: our fastest cipher the sender has too, under a key agreed with our
+    // signed agreement key and a fresh nonce, so a recorded session cannot be replayed
+    Crypto::Cipher cipher = Crypto::NoCipher;
+    KeyManager::AgreementKey ownKey;
+    QByteArray nonce;
+    if (!senderKey.isEmpty()) {
+        for (quint8 candidate : Crypto::supportedCiphers()) {
+            if (ciphers.contains(candidate)) {
+                cipher = Crypto::Cipher(candidate);
+                break;
+            }
+        }
+
+        QSharedPointer<Crypto> crypto = QSharedPointer<Crypto>::create();
+        ownKey = KeyManager::shared().agreementKey(rsaPrivateKeyPath);
+        nonce = Crypto::randomKey().left(16);
+        if (cipher == Crypto::NoCipher || !ownKey.key || nonce.isEmpty()
+            || !crypto->agreeKey(cipher, ownKey.key.data(), senderKey, senderKey + ownKey.publicKey + nonce)) {
+            socket->write(message(Reject, QString("Cannot decrypt: no matching private key or cipher on the receiver")));
+            socket->disconnectFromHost();
+            emit statusUpdated("Refused an encrypted connection, set the matching RSA private key.");
+            return true;
+        }
+        connectionCiphers[socket] = crypto;
+    }
+
+    socket->write(message(Accept, version, quint8(codec), quint8(cipher), ownKey.publicKey, ownKey.signature, nonce));
+    return true;
+}
+
+bool FileReceiver::answerResumeQuery(QTcpSocket *socket, QDataStream &in)
+{
+    qint64 token;
+    QString fileName;
+    qint64 fileSize;
+    qint64 modified;
+    QByteArray contentHash;
+
+    in >> token >> fileName >> fileSize >> modified >> contentHash;
+    if (in.status() != QDataStream::Ok) {
+        return false;
+    }
+
+    fileName = QFileInfo(fileName).fileName(); // Never look outside the download location
+    QString filePath = QDir(downloadLocation).filePath(fileName);
+    ByteRanges ranges;
+
+    // A partly received file answers with what is already there
+    if (!fileName.isEmpty() && fileSize > 0 && !incomingFiles->find(filePath, fileSize, modified, ranges)) {
+        QFileInfo existing(filePath);
+
+        if (existing.isFile() && existing.size() == fileSize
+                   && existing.lastModified().toMSecsSinceEpoch() == modified) {
+            ranges.append({0, fileSize}); // Delivered by an earlier transfer
+        } else if (!contentHash.isEmpty()) {
+            // Same bytes may already be here under another name
+            lookupContent(socket, token, filePath, fileSize, contentHash);
+            return true;
+        } else if (canOfferDelta(filePath, fileSize)) {
+            offerDelta(socket, token, filePath);
+            return true;
+        }
+    }
+
+    sendResumeReply(socket, token, ranges);
+    return true;
+}
+
+void FileReceiver::sendResumeReply(QTcpSocket *socket, qint64 token, const ByteRanges &ranges)
+{
+    socket->write(message(ResumeReply, token, ranges));
+}
+
+void FileReceiver::lookupContent(QTcpSocket *socket, qint64 token, const QString &filePath, qint64 fileSize, const QByteArray &contentHash)
+{
+    QPointer<QTcpSocket> target(socket);
+
+    // The lookup may hash same-sized candidates and copy the match, keep it off the socket thread
+    QFutureWatcher<bool> *watcher = new QFutureWatcher<bool>(this);
+    connect(watcher, &QFutureWatcher<bool>::finished, this, [this, watcher, target, token, filePath, fileSize]() {
+        bool found = watcher->result();
+        watcher->deleteLater();
+
+        if (found) {
+            emit statusUpdated("Already had the content, copied locally: " + QFileInfo(filePath).fileName());
+            emit fileReceived(filePath);
+        }
+
+        if (!target) {
+            return;
+        }
+
+        if (found) {
+            sendResumeReply(target, token, {{0, fileSize}});
+        } else if (canOfferDelta(filePath, fileSize)) {
+            offerDelta(target, token, filePath);
+        } else {
+            sendResumeReply(target, token, ByteRanges());
+        }
+    });
+
+    watcher->setFuture(QtConcurrent::run([this, filePath, fileSize, contentHash]() {
+        QString source = contentIndex->find(contentHash, fileSize);
+        if (source.isEmpty()) {
+            return false;
+        }
+        if (QFileInfo(source).absoluteFilePath() == QFileInfo(filePath).absoluteFilePath()) {
+            return true; // The destination itself already has these bytes
+        }
+        if (!ContentIndex::materialize(source, filePath)) {
+            return false;
+        }
+        contentIndex->add(filePath, contentHash);
+        return true;
+    }));
+}
+
+bool FileReceiver::canOfferDelta(const QString &filePath, qint64 fileSize) const
+{
+    // An older copy is here, let the sender send only what changed
+    QFileInfo existing(filePath);
+    return existing.isFile() && existing.size() >= Delta::minimumFileSize && fileSize >= Delta::minimumFileSize;
+}
+
+void FileReceiver::offerDelta(QTcpSocket *socket, qint64 token, const QString &filePath)
+{
+    QPointer<QTcpSocket> target(socket);
+    qint32 blockSize = Delta::blockSizeFor(QFileInfo(filePath).size());
+
+    // Hashing the old copy reads the whole file, keep it off the socket thread
+    QFutureWatcher<Delta::Signatures> *watcher = new QFutureWatcher<Delta::Signatures>(this);
+    connect(watcher, &QFutureWatcher<Delta::Signatures>::finished, this, [watcher, target, token]() {
+        Delta::Signatures signatures = watcher->result();
+        watcher->deleteLater();
+
+        if (!target) {
+            return;
+        }
+
+        if (signatures.weak.isEmpty()) {
+            target->write(message(ResumeReply, token, ByteRanges())); // Old copy unreadable, send it whole
+        } else {
+            target->write(message(DeltaSignatures, token, signatures.fileSize, signatures.blockSize,
+                                  signatures.weak, signatures.strong));
+        }
+    });
+    watcher->setFuture(QtConcurrent::run(Delta::computeSignatures, filePath, blockSize));
+}
+
+bool FileReceiver::readRangeHeader(QTcpSocket *socket, QDataStream &in)
+{
+    qint64 token;
+    QString fileName;
+    qint64 fileSize;
+    qint64 modified;
+    qint64 offset;
+    qint64 length;
+
+    in >> token >> fileName >> fileSize >> modified >> offset >> length;
+    if (in.status() != QDataStream::Ok) {
+        return false;
+    }
+
+    fileName = QFileInfo(fileName).fileName(); // Never write outside the download location
+
+    if (fileName.isEmpty() || fileSize <= 0 || offset < 0 || length <= 0 || offset + length > fileSize) {
+        return false;
+    }
+
+    QString filePath = QDir(downloadLocation).filePath(fileName);
+    QSharedPointer<QFile> file = QSharedPointer<QFile>::create();
+    bool opened = incomingFiles->openRange(filePath, fileSize, modified, *file);
+
+    FileTransferInfo info;
+    info.token = token;
+    info.targetPath = filePath;
+    info.file = file;
+    info.fileName = fileName;
+    info.fileSize = fileSize;
+    info.offset = offset;
+    info.length = length;
+    info.writeFailed = QSharedPointer<QAtomicInt>::create(0);
+
+    // The data frames still arrive, they are skipped and the sender gets a failed ack
+    if (!opened) {
+        emit statusUpdated("Failed to save file: " + fileName);
+        info.failed = true;
+    }
+
+    // Nobody reads a file this big back soon, keep it from crowding the page cache
+    info.dropBehind = !info.failed && cacheBypassThreshold > 0 && fileSize >= cacheBypassThreshold;
+    info.writebackStart = offset;
+    if (info.dropBehind) {
+        PageCache::startBypass(*file);
+    }
+
+    // Keep Qt's read buffer small so most of the range is left in the kernel for splice();
+    // on a TLS connection the kernel only has records Qt must decrypt
+    if (zeroCopy && !info.failed && !isTls(socket)) {
+        if (!splicePipes.contains(socket)) {
+            splicePipes[socket] = QSharedPointer<ZeroCopy::Pipe>::create();
+        }
+        info.limitReads = splicePipes[socket]->isValid();
+    }
+
+    transferInfo[socket] = info;
+    updateReadBuffer(socket);
+    return true;
+}
+
+ReadResult FileReceiver::readSealedChunks(QTcpSocket *socket, bool &ok)
+{
+    // As many whole frames as are there, the crypto workers want a few each
+    const int batchSize = qMin(2 * Crypto::workerCount(), maxOpenBatch);
+    ReadResult result = FrameReady;
+    sealedFrames.clear();
+    while (int(sealedFrames.size()) < batchSize && writer->reserve(jobsPerFrame * int(sealedFrames.size() + 1))) {
+        ChunkFrame frame;
+        if ((result = readChunkFrame(socket, frame, true)) != FrameReady) {
+            break;
+        }
+        sealedFrames.push_back(std::move(frame));
+    }
+    if (sealedFrames.empty() || result == FrameTooLarge) {
+        return result;
+    }
+
+    // Opened in place, in order of arrival, before anything looks at the bytes
+    openChunks.clear();
+    for (ChunkFrame &frame : sealedFrames) {
+        openChunks.append({frame.payload.view(), QByteArrayView(frame.header, sizeof(frame.header)),
+                           frame.payload.data(), frame.tag});
+    }
+    if (!connectionCiphers.value(socket)->decryptChunks(openChunks)) {
+        emit statusUpdated("Encrypted data failed authentication, dropping the connection.");
+        ok = false;
+        return FrameReady;
+    }
+
+    for (ChunkFrame &frame : sealedFrames) {
+        if (!readFileData(socket, frame)) {
+            ok = false;
+            break;
+        }
+    }
+    sealedFrames.clear();
+    return FrameReady; // Whatever stopped the batch is looked at again
+}
+
+bool FileReceiver::readFileData(QTcpSocket *socket, ChunkFrame &chunk)
+{
+    if (!acceptChunk(socket, chunk.codec, chunk.rawSize)) {
+        return false;
+    }
+
+    // Raw chunks are written from the buffer they were read into
+    if (chunk.codec == Compression::None) {
+        if (chunk.payload.size() != chunk.rawSize) {
+            return false;
+        }
+        storeChunk(socket, std::move(chunk.payload));
+        return true;
+    }
+
+    BufferPool::Buffer data = BufferPool::shared().acquire();
+    if (data.isNull() || chunk.rawSize > data.capacity()
+        || !Compression::decompress(Compression::Codec(chunk.codec), chunk.payload.view(), data.data(), chunk.rawSize)) {
+        return false;
+    }
+    data.setSize(chunk.rawSize);
+    chunk.payload.release();
+    storeChunk(socket, std::move(data));
+    return true;
+}
+
+bool FileReceiver::readFileData(QTcpSocket *socket, QDataStream &in)
+{
+    quint8 codec;
+    quint32 rawSize;
+    in >> codec >> rawSize;
+
+    if (in.status() != QDataStream::Ok || !acceptChunk(socket, codec, rawSize)) {
+        return false;
+    }
+
+    QByteArray payload = in.device()->readAll();
+    QSharedPointer<Crypto> crypto = connectionCiphers.value(socket);
+    if (crypto) {
+        // The header as it came, for the tag to be checked against
+        char header[frameHeaderSize + chunkHeaderSize];
+        writeChunkHeader(header, codec, rawSize, payload.size());
+        if (payload.size() < chunkTagSize) {
+            return false;
+        }
+        QByteArray tag = payload.right(chunkTagSize);
+        payload.chop(chunkTagSize);
+        if (!crypto->decryptChunk(payload, QByteArrayView(header, sizeof(header)), tag.constData(), payload.data())) {
+            emit statusUpdated("Encrypted data failed authentication, dropping the connection.");
+            return false;
+        }
+    }
+
+    QByteArray chunk(qsizetype(rawSize), Qt::Uninitialized);
+    if (!Compression::decompress(Compression::Codec(codec), payload, chunk.data(), rawSize)) {
+        return false;
+    }
+
+    // Cut into pool buffers like any other chunk
+    for (qint64 position = 0; position < chunk.size(); position += BufferPool::bufferSize) {
+        BufferPool::Buffer data = BufferPool::shared().acquire();
+        if (data.isNull()) {
+            return false;
+        }
+        data.setSize(qMin(BufferPool::bufferSize, chunk.size() - position));
+        std::memcpy(data.data(), chunk.constData() + position, size_t(data.size()));
+        storeChunk(socket, std::move(data));
+    }
+    return true;
+}
+
+bool FileReceiver::acceptChunk(QTcpSocket *socket, quint8 codec, quint32 rawSize) const
+{
+    auto found = transferInfo.constFind(socket);
+    if (found == transferInfo.constEnd()) {
+        return false; // The range ended before this chunk
+    }
+
+    const FileTransferInfo &info = *found;
+    qint64 remaining = info.delta ? info.fileSize - info.bytesReceived : info.length - info.bytesReceived;
+
+    return rawSize > 0 && rawSize <= Compression::maxChunkSize && rawSize <= remaining
+           && (codec == Compression::None || codec == connectionCodecs.value(socket));
+}
+
+void FileReceiver::storeChunk(QTcpSocket *socket, BufferPool::Buffer data)
+{
+    FileTransferInfo &info = transferInfo[socket];
+    qint64 size = data.size();
+
+    if (info.delta) {
+        writeDeltaOutput(socket, data.view()); // A literal
+        return;
+    }
+
+    if (!info.failed) {
+        // Per file durability: the range's last write carries its fsync
+        bool last = info.bytesReceived + size == info.length;
+        info.synced = last && incomingFiles->durability() == IncomingFiles::SyncEachFile;
+        writer->push({info.file, info.offset + info.bytesReceived, std::move(data), info.writeFailed, nullptr, info.synced});
+    }
+    info.bytesReceived += size;
+
+    if (info.bytesReceived == info.length) {
+        commitRange(socket);
+    } else if (info.bytesReceived - info.bytesJournaled >= checkpointSize) {
+        checkpointRange(socket);
+    }
+}
+
+bool FileReceiver::isSplicing(QTcpSocket *socket) const
+{
+    auto info = transferInfo.constFind(socket);
+    return info != transferInfo.constEnd() && info->spliceRemaining > 0;
+}
+
+bool FileReceiver::startSplice(QTcpSocket *socket)
+{
+    const int headerSize = frameHeaderSize + chunkHeaderSize;
+
+    if (!transferInfo.contains(socket) || !splicePipes.contains(socket) || !splicePipes[socket]->isValid()) {
+        return false;
+    }
+
+    FileTransferInfo &info = transferInfo[socket];
+    if (info.delta || info.failed || connectionCiphers.contains(socket)) {
+        return false;
+    }
+
+    // Once Qt's buffer is drained the next header is still in the kernel, look at it there
+    bool buffered = socket->bytesAvailable() > 0;
+    QByteArray header = buffered ? socket->peek(headerSize)
+                                 : ZeroCopy::receiveBytes(socket->socketDescriptor(), headerSize, true);
+    if (header.size() < headerSize) {
+        return false;
+    }
+
+    QDataStream in(header);
+    quint32 length;
+    quint8 type;
+    quint8 codec;
+    quint32 rawSize;
+    in >> length >> type >> codec >> rawSize;
+
+    // Anything else, including a bad chunk, is for the frame reader to deal with
+    if (type != FileData || codec != Compression::None || qint64(length) != chunkHeaderSize + qint64(rawSize)
+        || rawSize == 0 || rawSize > Compression::maxChunkSize || rawSize > info.length - info.bytesReceived) {
+        return false;
+    }
+
+    if (buffered) {
+        socket->skip(headerSize);
+    } else {
+        ZeroCopy::receiveBytes(socket->socketDescriptor(), headerSize, false); // Already peeked, all there
+    }
+    info.spliceRemaining = rawSize;
+    return true;
+}
+
+void FileReceiver::spliceFileData(QTcpSocket *socket)
+{
+    FileTransferInfo &info = transferInfo[socket];
+    qint64 received = 0;
+    bool ok = true;
+
+    // Whatever Qt already read of the chunk goes to the writer like copied data
+    qint64 buffered = qMin(socket->bytesAvailable(), info.spliceRemaining);
+    while (received < buffered) {
+        BufferPool::Buffer data = BufferPool::shared().acquire();
+        if (data.isNull()) {
+            ok = false;
+            break;
+        }
+        data.setSize(socket->read(data.data(), qMin(data.capacity(), buffered - received)));
+        qint64 size = data.size();
+        if (size <= 0) {
+            ok = false;
+            break;
+        }
+        writer->push({info.file, info.offset + info.bytesReceived + received, std::move(data), info.writeFailed, nullptr});
+        received += size;
+    }
+
+    // The rest is spliced at its own offset, next to the writer's queued chunks
+    if (ok && received < info.spliceRemaining) {
+        qint64 position = info.offset + info.bytesReceived + received;
+        qint64 spliced = splicePipes[socket]->spliceToFile(socket->socketDescriptor(), info.file->handle(), position,
+                                                          info.spliceRemaining - received);
+        ok = spliced >= 0;
+        received += qMax<qint64>(spliced, 0);
+    }
+
+    info.bytesReceived += received;
+    info.spliceRemaining -= received;
+
+    if (!ok) {
+        // Part of the chunk may be stuck in the pipe, the stream cannot go on
+        checkpointRange(socket);
+        info.failed = true;
+        emit statusUpdated("Failed to save file: " + info.fileName);
+        socket->disconnectFromHost();
+        return;
+    }
+
+    if (info.bytesReceived == info.length) {
+        commitRange(socket);
+    } else if (info.bytesReceived - info.bytesJournaled >= checkpointSize) {
+        checkpointRange(socket);
+    }
+}
+
+bool FileReceiver::readDeltaHeader(QTcpSocket *socket, QDataStream &in)
+{
+    qint64 token;
+    QString fileName;
+    qint64 fileSize;
+    qint64 modified;
+    qint64 baseSize;
+    qint32 blockSize;
+
+    in >> token >> fileName >> fileSize >> modified >> baseSize >> blockSize;
+    if (in.status() != QDataStream::Ok) {
+        return false;
+    }
+
+    fileName = QFileInfo(fileName).fileName(); // Never write outside the download location
+
+    if (fileName.isEmpty() || fileSize <= 0 || blockSize <= 0) {
+        return false;
+    }
+
+    FileTransferInfo info;
+    info.delta = true;
+    info.token = token;
+    info.fileName = fileName;
+    info.fileSize = fileSize;
+    info.modified = modified;
+    info.blockSize = blockSize;
+    info.targetPath = QDir(downloadLocation).filePath(fileName);
+    info.baseFile = QSharedPointer<QFile>::create(info.targetPath);
+    info.file = QSharedPointer<QFile>::create(QFileInfo(info.targetPath).dir().filePath("." + fileName + ".lsdelta"));
+    info.hash = QSharedPointer<QCryptographicHash>::create(QCryptographicHash::Md5);
+
+    // The ops still arrive if anything is off, the sender then gets a failed
+    // DeltaResult and sends the whole file
+    if (!info.baseFile->open(QIODevice::ReadOnly) || info.baseFile->size() != baseSize
+        || !info.file->open(QIODevice::WriteOnly)) {
+        info.failed = true;
+    }
+
+    transferInfo[socket] = info;
+    return true;
+}
+
+void FileReceiver::writeDeltaOutput(QTcpSocket *socket, QByteArrayView data)
+{
+    FileTransferInfo &info = transferInfo[socket];
+    if (info.failed) {
+        return;
+    }
+
+    if (info.file->write(data.data(), data.size()) != data.size()) {
+        info.failed = true;
+        return;
+    }
+    info.hash->addData(data);
+    info.bytesReceived += data.size();
+}
+
+void FileReceiver::copyBaseBlocks(QTcpSocket *socket, qint64 firstBlock, qint64 blockCount)
+{
+    FileTransferInfo &info = transferInfo[socket];
+    if (info.failed) {
+        return;
+    }
+
+    qint64 start = firstBlock * info.blockSize;
+    qint64 end = (firstBlock + blockCount) * info.blockSize;
+    if (firstBlock < 0 || blockCount <= 0 || end > info.baseFile->size() || !info.baseFile->seek(start)) {
+        info.failed = true;
+        return;
+    }
+
+    // One pool buffer at a time, whatever the size of the copy
+    BufferPool::Buffer data = BufferPool::shared().acquire();
+    for (qint64 position = start; position < end && !info.failed; ) {
+        data.setSize(data.isNull() ? 0 : info.baseFile->read(data.data(), qMin(data.capacity(), end - position)));
+        if (data.size() <= 0) {
+            info.failed = true;
+            return;
+        }
+        writeDeltaOutput(socket, data.view());
+        position += data.size();
+    }
+}
+
+void FileReceiver::finishDelta(QTcpSocket *socket, const QByteArray &fileHash)
+{
+    FileTransferInfo info = transferInfo.take(socket);
+    info.baseFile->close();
+
+    bool ok = !info.failed && info.bytesReceived == info.fileSize && info.hash->result() == fileHash;
+
+    // Swap the rebuilt file in for the old copy
+    if (ok) {
+        info.file->setFileTime(QDateTime::fromMSecsSinceEpoch(info.modified), QFileDevice::FileModificationTime);
+        ok = incomingFiles->replace(*info.file, info.targetPath);
+    } else {
+        info.file->close();
+        info.file->remove();
+    }
+
+    socket->write(message(DeltaResult, info.token, ok));
+
+    if (ok) {
+        fileInstalled(info.targetPath);
+    } else {
+        emit statusUpdated("Delta rebuild failed, waiting for the full file: " + info.fileName);
+    }
+}
+
+void FileReceiver::checkpointRange(QTcpSocket *socket)
+{
+    FileTransferInfo &info = transferInfo[socket];
+    if (info.failed || info.bytesReceived == info.bytesJournaled) {
+        return;
+    }
+
+    // Data must be on disk before the journal claims it, so the writer records
+    // it after the chunks queued ahead of it
+    QSharedPointer<QFile> file = info.file;
+    QSharedPointer<QAtomicInt> failed = info.writeFailed;
+    IncomingFiles *files = incomingFiles;
+    QString filePath = info.targetPath;
+    qint64 offset = info.offset + info.bytesJournaled;
+    qint64 length = info.bytesReceived - info.bytesJournaled;
+    bool dropBehind = info.dropBehind;
+    qint64 dropStart = info.writebackStart;
+
+    writer->push({file, 0, BufferPool::Buffer(), failed, [file, failed, files, filePath, offset, length, dropBehind, dropStart]() {
+        if (failed->loadRelaxed() || !file->flush()) {
+            return;
+        }
+        files->commit(filePath, offset, length);
+
+        // Start writing this checkpoint back, by the next one it is clean and can be dropped
+        if (dropBehind) {
+            PageCache::startWriteback(*file, offset, length);
+            PageCache::dropWritten(*file, dropStart, offset - dropStart);
+        }
+    }});
+    info.bytesJournaled = info.bytesReceived;
+    info.writebackStart = offset;
+}
+
+void FileReceiver::commitRange(QTcpSocket *socket)
+{
+    checkpointRange(socket);
+
+    FileTransferInfo info = transferInfo.take(socket);
+    updateReadBuffer(socket); // Back to plain reads until the next range header
+
+    // A range that ended in spliced data still needs its fsync
+    bool sync = !info.synced && incomingFiles->durability() == IncomingFiles::SyncEachFile;
+
+    // Acked from this thread once the writer has the whole range on disk. The
+    // range that completes the file, on whichever connection, also renames it
+    // into place; that may fsync, so it stays on the writer thread too.
+    QPointer<QTcpSocket> target(socket);
+    IncomingFiles *files = incomingFiles;
+    bool synced = info.synced || sync;
+    writer->push({info.file, 0, BufferPool::Buffer(), info.writeFailed, [this, target, info, files, synced]() {
+        bool ok = !info.failed && !info.writeFailed->loadRelaxed();
+        if (ok && info.dropBehind) {
+            PageCache::dropWritten(*info.file, info.writebackStart, info.offset + info.length - info.writebackStart);
+        }
+        bool finished = ok && files->finish(info.targetPath);
+        bool installed = finished && files->install(info.targetPath, *info.file, synced);
+        QMetaObject::invokeMethod(this, [this, target, info, ok, finished, installed]() {
+            finishRange(target, info, ok, finished, installed);
+        }, Qt::QueuedConnection);
+    }, sync});
+}
+
+void FileReceiver::finishRange(QTcpSocket *socket, const FileTransferInfo &info, bool ok, bool finished, bool installed)
+{
+    if ((!info.failed && !ok) || (finished && !installed)) {
+        emit statusUpdated("Failed to save file: " + info.fileName);
+    }
+
+    // The sender keeps the range until it hears about it
+    if (socket) {
+        socket->write(message(FileAck, info.token, info.offset, info.length, ok));
+    }
+
+    info.file->close();
+    if (installed) {
+        fileInstalled(info.targetPath);
+    }
+}
+
+void FileReceiver::fileInstalled(const QString &filePath)
+{
+    contentIndex->add(filePath);
+    emit fileReceived(filePath);
+    batchSyncTimer->start(); // Only SyncEachBatch leaves anything for it
+}
@@ -0,0 +1,145 @@
+#ifndef FILERECEIVER_H
+#define FILERECEIVER_H
+
+#include <QObject>
+#include <QTcpSocket>
+#include <QSslSocket>
+#include <QSslConfiguration>
+#include <QSslCertificate>
+#include <QSslKey>
+#include <QFile>
+#include <QMap>
+#include <QSet>
+#include <QDataStream>
+#include <QSharedPointer>
+#include <QCryptographicHash>
+#include <QAtomicInt>
+#include <QTimer>
+#include <vector>
+
+#include "transferprotocol.h"
+#include "delta.h"
+#include "contentindex.h"
+#include "incomingfiles.h"
+#include "compression.h"
+#include "zerocopy.h"
+#include "diskwriter.h"
+#include "pagecache.h"
+#include "bufferpool.h"
+#include "crypto.h"
+#include "keymanager.h"
+
+// Serves the connections FileServer hands it, on its own thread. Everything
+// a connection needs lives here, only the content index and the incoming
+// file journals are shared between receivers. Setters and the slots run on
+// the receiver's thread, FileServer queues them. Range data is written by
+// the receiver's own DiskWriter thread.
+class FileReceiver : public QObject
+{
+    Q_OBJECT
+
+public:
+    FileReceiver(ContentIndex *contentIndex, IncomingFiles *incomingFiles, QObject *parent = nullptr);
+    ~FileReceiver();
+
+    void addConnection(qintptr socketDescriptor); // Any thread, the socket is opened on ours
+    int connectionCount() const;
+    int writeQueueFill() const; // Percent of the disk writer's ring in use, any thread
+
+    void setDownloadLocation(const QString &path);
+    void setAllowedIPs(const QSet<QString> &allowedIPs);
+    void setZeroCopyEnabled(bool enabled);
+    void setRSAPrivateKeyPath(const QString &path); // Signs the key encrypting senders agree on theirs with
+    void setDiskBackend(DiskBackend::Kind kind);
+    void setCacheBypassThreshold(qint64 bytes); // Files this big are dropped from the page cache once written, 0 = never
+
+signals:
+    void fileReceived(const QString &filePath);
+    void statusUpdated(const QString &message);
+
+private:
+    void openConnection(qintptr socketDescriptor);
+    void readFile(QTcpSocket *socket);
+    void resumeStalled(); // The disk writer made room, read the sockets that were waiting for it
+    void updateReadBuffer(QTcpSocket *socket);
+    bool handleFrame(QTcpSocket *socket, const TransferProtocol::Frame &frame); // False drops the connection
+    bool startTls(QTcpSocket *socket); // True if the sender opened with a TLS handshake, which is then answered (or refused)
+    bool isTls(QTcpSocket *socket) const;
+    bool answerHello(QTcpSocket *socket, QDataStream &in);
+    bool readRangeHeader(QTcpSocket *socket, QDataStream &in);
+    TransferProtocol::ReadResult readSealedChunks(QTcpSocket *socket, bool &ok); // A batch of encrypted frames opened at once; ok false if one was refused
+    bool readFileData(QTcpSocket *socket, TransferProtocol::ChunkFrame &chunk); // Already opened if the connection is encrypted
+    bool readFileData(QTcpSocket *socket, QDataStream &in); // Frames too big for a pool buffer, from other senders
+    bool acceptChunk(QTcpSocket *socket, quint8 codec, quint32 rawSize) const;
+    void storeChunk(QTcpSocket *socket, BufferPool::Buffer data); // Range data to the writer, a literal to the delta file
+    bool isSplicing(QTcpSocket *socket) const;
+    bool startSplice(QTcpSocket *socket); // Takes the next raw FileData header if its chunk can be spliced
+    void spliceFileData(QTcpSocket *socket);
+    bool answerResumeQuery(QTcpSocket *socket, QDataStream &in);
+    void sendResumeReply(QTcpSocket *socket, qint64 token, const TransferProtocol::ByteRanges &ranges);
+    void lookupContent(QTcpSocket *socket, qint64 token, const QString &filePath, qint64 fileSize, const QByteArray &contentHash);
+    bool canOfferDelta(const QString &filePath, qint64 fileSize) const;
+    void offerDelta(QTcpSocket *socket, qint64 token, const QString &filePath);
+    bool readDeltaHeader(QTcpSocket *socket, QDataStream &in);
+    void writeDeltaOutput(QTcpSocket *socket, QByteArrayView data);
+    void copyBaseBlocks(QTcpSocket *socket, qint64 firstBlock, qint64 blockCount);
+    void finishDelta(QTcpSocket *socket, const QByteArray &fileHash);
+    void checkpointRange(QTcpSocket *socket);
+    void commitRange(QTcpSocket *socket);
+    void fileInstalled(const QString &filePath); // In place under its real name
+
+    // One byte range of a file arriving on one connection. A file sent over
+    // a single stream is just one range covering the whole file.
+    struct FileTransferInfo {
+        QSharedPointer<QFile> file;
+        QString fileName;
+        qint64 fileSize = 0;
+        qint64 offset = 0;
+        qint64 length = 0;
+        qint64 bytesReceived = 0;
+        qint64 bytesJournaled = 0; // Prefix of this range already recorded in the journal
+        qint64 token = 0;          // Sender's file index, echoed in the ack
+        QString targetPath;        // Final name, the data goes to a hidden temp file until the end
+        bool failed = false;       // Keep consuming data frames, but the result will be thrown away
+        bool synced = false;       // The last chunk went to the writer with an fsync behind it
+        qint64 spliceRemaining = 0; // Bytes of the current raw chunk still to come straight from the socket
+        bool limitReads = false;    // Zero-copy range, Qt's read buffer is kept small
+        QSharedPointer<QAtomicInt> writeFailed; // Set by the disk writer
+        bool dropBehind = false;    // Huge file, written data is dropped from the page cache
+        qint64 writebackStart = 0;  // Written back at the last checkpoint but still cached, from here on
+
+        // Delta transfers rebuild the file in a temp file from the old copy plus literal data
+        bool delta = false;
+        qint64 modified = 0;
+        QSharedPointer<QFile> baseFile;
+        qint32 blockSize = 0;
+        QSharedPointer<QCryptographicHash> hash;
+    };
+
+    // Ack once the writer is done; finished when the range completed the file, installed once it is in place
+    void finishRange(QTcpSocket *socket, const FileTransferInfo &info, bool ok, bool finished, bool installed);
+
+    ContentIndex *contentIndex;   // What is already under downloadLocation, by content hash
+    IncomingFiles *incomingFiles; // Partial files, shared with the other receivers
+    QString downloadLocation;
+    QString rsaPrivateKeyPath;
+    QByteArray tlsCertificate;            // What tlsConfiguration was built from
+    QSslConfiguration tlsConfiguration;
+    QSet<QString> allowedIPs;
+    bool zeroCopy;
+    qint64 cacheBypassThreshold;
+    QAtomicInt connections;
+    DiskWriter *writer;
+    QSet<QTcpSocket*> stalledSockets; // Not read until the disk writer has room again
+    QTimer *batchSyncTimer;           // Restarted by every received file, fires once they stop coming
+
+    QMap<QTcpSocket*, FileTransferInfo> transferInfo;
+    QMap<QTcpSocket*, Compression::Codec> connectionCodecs; // Connections past the handshake, and their codec
+    QMap<QTcpSocket*, QSharedPointer<ZeroCopy::Pipe>> splicePipes; // Connections that received a range zero-copy
+    QMap<QTcpSocket*, QSharedPointer<Crypto>> connectionCiphers;     // Encrypted connections, keyed by their Hello
+    std::vector<TransferProtocol::ChunkFrame> sealedFrames;          // The batch being opened, reused
+    QList<Crypto::Chunk> openChunks;
+
+};
+
+#endif // FILERECEIVER_H
@@ -1,106 +1,121 @@
 #include "fileserver.h"
-#include <QFileInfo>
 #include <QDebug>
 #include <QDir>
-#include <QMessagebox>
 
-FileServer::FileServer(QObject *parent) : QTcpServer(parent), downloadLocation(QDir::homePath())
+namespace {
+
+const int maxReceivers = 8; // Threads serving connections, however many cores there are
+
+}
+
+FileServer::FileServer(QObject *parent) : QTcpServer(parent)
+{
+    int receiverCount = qBound(1, QThread::idealThreadCount(), maxReceivers);
+    for (int i = 0; i < receiverCount; ++i) {
+        QThread *thread = new QThread(this);
+        FileReceiver *receiver = new FileReceiver(&contentIndex, &incomingFiles);
+        receiver->moveToThread(thread);
+
+        // Emitted straight from the receiver's thread, so each connection's signals keep their order
+        connect(receiver, &FileReceiver::fileReceived, this, &FileServer::fileReceived, Qt::DirectConnection);
+        connect(receiver, &FileReceiver::statusUpdated, this, &FileServer::statusUpdated, Qt::DirectConnection);
+
+        thread->start();
+        receiverThreads.append(thread);
+        receivers.append(receiver);
+    }
+
+    setDownloadLocation(QDir::homePath());
+    listen(QHostAddress::Any, TransferProtocol::port);
+}
+
+FileServer::~FileServer()
 {
-    listen(QHostAddress::Any, 12345);
+    close();
+
+    for (QThread *thread : receiverThreads) {
+        thread->quit();
+        thread->wait();
+    }
+
+    // Their threads are gone, so the receivers and their sockets can go from here
+    qDeleteAll(receivers);
+    incomingFiles.syncBatch(); // Files still waiting for the end of their batch
 }
 
 void FileServer::setDownloadLocation(const QString &path)
 {
-    downloadLocation = path;
+    contentIndex.setRoot(path);
+    forEachReceiver([path](FileReceiver *receiver) { receiver->setDownloadLocation(path); });
 }
 
 void FileServer::setAllowedIPs(const QSet<QString> &allowedIPs)
 {
-    this->allowedIPs = allowedIPs;
-    // qDebug() << "I am in server code: " << this->allowedIPs ;
+    forEachReceiver([allowedIPs](FileReceiver *receiver) { receiver->setAllowedIPs(allowedIPs); });
+    // qDebug() << "I am in server code: " << allowedIPs ;
 }
 
-// bool FileServer::isListening() const
-// {
-//     return QTcpServer::isListening();
-// }
-
-void FileServer::incomingConnection(qintptr socketDescriptor)
+void FileServer::setZeroCopyEnabled(bool enabled)
 {
-    QTcpSocket *socket = new QTcpSocket(this);
-    socket->setSocketDescriptor(socketDescriptor);
-
-    QString clientIP = socket->peerAddress().toString();
-    clientIP = clientIP.remove("::ffff:"); // Normalize IPv4-mapped IPv6
-
-    if (allowedIPs.isEmpty() || !allowedIPs.contains(clientIP)) {
-        // qDebug() << "Blocked connection from" << clientIP;
-        socket->write("BLOCKED");  // Send a rejection message
-        socket->flush();
-        socket->waitForBytesWritten(500); // Ensure message is sent before disconnect
-        socket->disconnectFromHost();
-        emit statusUpdated("Blocked " + clientIP + " for attempting to connect");
-        return;
-    }
-
-    qDebug() << "Connection allowed from" << clientIP;
-    connect(socket, &QTcpSocket::readyRead, this, [this, socket]() { readFile(socket); });
-    connect(socket, &QTcpSocket::disconnected, socket, &QTcpSocket::deleteLater);
+    forEachReceiver([enabled](FileReceiver *receiver) { receiver->setZeroCopyEnabled(enabled); });
 }
 
-
-void FileServer::readFile(QTcpSocket *socket)
+void FileServer::setRSAPrivateKeyPath(const QString &path)
 {
-    if (!transferInfo.contains(socket)) {
-        QDataStream in(socket);
-        in.setVersion(QDataStream::Qt_6_8);
+    rsaPrivateKeyPath = path;
+    forEachReceiver([path](FileReceiver *receiver) { receiver->setRSAPrivateKeyPath(path); });
+}
 
-        if (socket->bytesAvailable() < sizeof(qint64) * 2) {
-            return;
-        }
+void FileServer::setDurability(IncomingFiles::Durability durability)
+{
+    incomingFiles.setDurability(durability);
+}
 
-        QString fileName;
-        qint64 fileSize;
-        in >> fileName >> fileSize;
+void FileServer::syncBatch()
+{
+    incomingFiles.syncBatch();
+}
 
-        if (fileName.isEmpty() || fileSize <= 0) {
-            emit statusUpdated("Invalid metadata received.");
-            socket->disconnectFromHost();
-            return;
-        }
+void FileServer::setDiskBackend(DiskBackend::Kind kind)
+{
+    for (FileReceiver *receiver : receivers) {
+        receiver->setDiskBackend(kind); // Thread safe, the writer switches between jobs
+    }
+}
 
-        QString filePath = QDir(downloadLocation).filePath(fileName);
-        QSharedPointer<QFile> file = QSharedPointer<QFile>::create(filePath);
-        if (!file->open(QIODevice::WriteOnly)) {
-            emit statusUpdated("Failed to save file: " + fileName);
-            socket->disconnectFromHost();
-            return;
-        }
+void FileServer::setCacheBypassThreshold(qint64 bytes)
+{
+    forEachReceiver([bytes](FileReceiver *receiver) { receiver->setCacheBypassThreshold(bytes); });
+}
 
-        transferInfo[socket] = {file, fileName, fileSize, 0};
+int FileServer::writeQueueFill() const
+{
+    // Near full while receiving means the disk is the bottleneck, near empty means the network is
+    int fill = 0;
+    for (FileReceiver *receiver : receivers) {
+        fill = qMax(fill, receiver->writeQueueFill());
     }
+    return fill;
+}
 
-    FileTransferInfo &info = transferInfo[socket];
-    const qint64 chunkSize = 64 * 1024;
+// bool FileServer::isListening() const
+// {
+//     return QTcpServer::isListening();
+// }
 
-    while (info.bytesReceived < info.fileSize) {
-        if (socket->bytesAvailable() < qMin(chunkSize, info.fileSize - info.bytesReceived)) {
-            return;
-        }
+void FileServer::incomingConnection(qintptr socketDescriptor)
+{
+    // The receiver opens the socket on its own thread, including the allowed IP check
+    leastBusyReceiver()->addConnection(socketDescriptor);
+}
 
-        QByteArray chunk = socket->read(qMin(chunkSize, info.fileSize - info.bytesReceived));
-        if (chunk.isEmpty()) {
-            emit statusUpdated("Failed to read file chunk.");
-            socket->disconnectFromHost();
-            return;
+FileReceiver *FileServer::leastBusyReceiver() const
+{
+    FileReceiver *best = receivers.first();
+    for (FileReceiver *receiver : receivers) {
+        if (receiver->connectionCount() < best->connectionCount()) {
+            best = receiver;
         }
-
-        //chunk = qUncompress(chunk);
-
-        info.file->write(chunk);
-        info.bytesReceived += chunk.size();
     }
-
-    emit fileReceived(info.file->fileName());
-    transferInfo.remove(socket);
+    return best;
 }
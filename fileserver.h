@@ -2,26 +2,35 @@
 #define FILESERVER_H
 
 #include <QTcpServer>
-#include <QTcpSocket>
-#include <QFile>
-#include <QMap>
-#include <QDataStream>
-#include <QSharedPointer>
-
-#include <openssl/rsa.h>
-#include <openssl/evp.h>
-#include <openssl/pem.h>
-
+#include <QThread>
+#include <QList>
+#include <QSet>
+
+#include "contentindex.h"
+#include "incomingfiles.h"
+#include "filereceiver.h"
+
+// Listens on the transfer port and hands each connection to one of a fixed
+// pool of FileReceivers, each running its own event loop, so several senders
+// are served on several cores. A connection stays on its receiver, so its
+// signals arrive in order.
 class FileServer : public QTcpServer
 {
     Q_OBJECT
 
 public:
     explicit FileServer(QObject *parent = nullptr);
+    ~FileServer();
     void setDownloadLocation(const QString &path);
     bool isListening() const;
     void setAllowedIPs(const QSet<QString> &allowedIPs);
     void setRSAPrivateKeyPath(const QString &path);
+    void setZeroCopyEnabled(bool enabled); // Linux: splice() raw range data from the socket into the file
+    void setDurability(IncomingFiles::Durability durability); // When received files are fsync()ed
+    void syncBatch(); // Syncs what SyncEachBatch still holds back now instead of once transfers go quiet, any thread
+    void setDiskBackend(DiskBackend::Kind kind); // How the receivers' disk writers write
+    void setCacheBypassThreshold(qint64 bytes);  // Received files this big skip the page cache, 0 = never
+    int writeQueueFill() const; // Percent of the fullest receiver's disk queue, any thread
 
 signals:
     void fileReceived(const QString &filePath);
@@ -31,18 +40,20 @@ protected:
     void incomingConnection(qintptr socketDescriptor) override;
 
 private:
-    void readFile(QTcpSocket *socket);
-    QString downloadLocation;
-    QSet<QString> allowedIPs;
-
-    struct FileTransferInfo {
-        QSharedPointer<QFile> file;
-        QString fileName;
-        qint64 fileSize;
-        qint64 bytesReceived;
-    };
-
-    QMap<QTcpSocket*, FileTransferInfo> transferInfo;
+    FileReceiver *leastBusyReceiver() const;
+
+    template <typename Setter>
+    void forEachReceiver(Setter setter) // Runs setter on every receiver's own thread
+    {
+        for (FileReceiver *receiver : receivers) {
+            QMetaObject::invokeMethod(receiver, [receiver, setter]() { setter(receiver); }, Qt::QueuedConnection);
+        }
+    }
+
+    ContentIndex contentIndex;   // What is already under the download location, by content hash
+    IncomingFiles incomingFiles; // Partial files and their journals
+    QList<QThread*> receiverThreads;
+    QList<FileReceiver*> receivers;
 
     QString rsaPrivateKeyPath;
 
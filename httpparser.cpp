@@ -0,0 +1,227 @@
+#include "httpparser.h"
+
+namespace {
+
+// RFC 9110 token characters, what methods and field names are made of
+bool isTokenChar(char c)
+{
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+        return true;
+    }
+    switch (c) {
+    case '!': case '#': case '$': case '%': case '&': case '\'': case '*': case '+':
+    case '-': case '.': case '^': case '_': case '`': case '|': case '~':
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool isToken(QByteArrayView text)
+{
+    if (text.isEmpty()) {
+        return false;
+    }
+    for (char c : text) {
+        if (!isTokenChar(c)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool isWhitespace(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+QByteArrayView trimWhitespace(QByteArrayView text)
+{
+    while (!text.isEmpty() && isWhitespace(text.front())) {
+        text = text.sliced(1);
+    }
+    while (!text.isEmpty() && isWhitespace(text.back())) {
+        text.chop(1);
+    }
+    return text;
+}
+
+}
+
+QByteArrayView HttpParser::Request::header(QByteArrayView name) const
+{
+    for (const Header &field : headers) {
+        if (field.name.compare(name, Qt::CaseInsensitive) == 0) {
+            return field.value;
+        }
+    }
+    return QByteArrayView();
+}
+
+bool HttpParser::Request::hasToken(QByteArrayView name, QByteArrayView token) const
+{
+    // The field may come more than once, each a list of its own
+    for (const Header &field : headers) {
+        if (field.name.compare(name, Qt::CaseInsensitive) != 0) {
+            continue;
+        }
+        QByteArrayView rest = field.value;
+        while (!rest.isEmpty()) {
+            qsizetype comma = rest.indexOf(',');
+            QByteArrayView item = comma < 0 ? rest : rest.first(comma);
+            if (trimWhitespace(item).compare(token, Qt::CaseInsensitive) == 0) {
+                return true;
+            }
+            rest = comma < 0 ? QByteArrayView() : rest.sliced(comma + 1);
+        }
+    }
+    return false;
+}
+
+HttpParser::Result HttpParser::parse(QByteArrayView data)
+{
+    if (state == Done) {
+        return RequestReady;
+    }
+    if (state == Failed) {
+        return Invalid;
+    }
+
+    while (true) {
+        qsizetype lineFeed = data.indexOf('\n', position + scanned);
+        if (lineFeed < 0) {
+            scanned = data.size() - position;
+            if (state == RequestLine && scanned > maxRequestLineSize) {
+                return fail(414);
+            }
+            return data.size() > maxHeadSize ? fail(431) : NeedMoreData;
+        }
+
+        // CRLF, or a bare LF as RFC 9112 lets a server accept
+        qsizetype lineEnd = lineFeed > position && data[lineFeed - 1] == '\r' ? lineFeed - 1 : lineFeed;
+        QByteArrayView line = data.sliced(position, lineEnd - position);
+        qsizetype at = position;
+        position = lineFeed + 1;
+        scanned = 0;
+        if (position > maxHeadSize) {
+            return fail(state == RequestLine ? 414 : 431);
+        }
+
+        if (state == RequestLine) {
+            if (line.isEmpty()) {
+                continue; // Blank lines ahead of a request are skipped
+            }
+            if (!parseRequestLine(line, at)) {
+                return Invalid;
+            }
+            state = HeaderLine;
+        } else if (!line.isEmpty()) {
+            if (!parseHeaderLine(line, at)) {
+                return Invalid;
+            }
+        } else {
+            // Views only now, data may have moved since the lines were parsed
+            current.method = data.sliced(method.start, method.size);
+            current.target = data.sliced(target.start, target.size);
+            current.minorVersion = minorVersion;
+            current.headers.clear();
+            for (const HeaderSpan &span : std::as_const(headerSpans)) {
+                current.headers.append({data.sliced(span.name.start, span.name.size),
+                                        data.sliced(span.value.start, span.value.size)});
+            }
+            current.size = position;
+            state = Done;
+            return RequestReady;
+        }
+    }
+}
+
+void HttpParser::reset()
+{
+    state = RequestLine;
+    position = 0;
+    scanned = 0;
+    method = Span();
+    target = Span();
+    minorVersion = 1;
+    headerSpans.clear();
+    current = Request();
+    status = 0;
+}
+
+bool HttpParser::parseRequestLine(QByteArrayView line, qsizetype at)
+{
+    if (line.size() > maxRequestLineSize) {
+        fail(414);
+        return false;
+    }
+
+    // method SP request-target SP HTTP-version, single spaces
+    qsizetype firstSpace = line.indexOf(' ');
+    qsizetype lastSpace = line.lastIndexOf(' ');
+    if (firstSpace <= 0 || lastSpace <= firstSpace + 1) {
+        fail(400);
+        return false;
+    }
+
+    QByteArrayView methodText = line.first(firstSpace);
+    QByteArrayView targetText = line.sliced(firstSpace + 1, lastSpace - firstSpace - 1);
+    QByteArrayView versionText = line.sliced(lastSpace + 1);
+    if (!isToken(methodText)) {
+        fail(400);
+        return false;
+    }
+    for (char c : targetText) {
+        if (uchar(c) <= ' ' || c == 0x7f) {
+            fail(400);
+            return false;
+        }
+    }
+
+    if (versionText.size() != 8 || !versionText.startsWith("HTTP/") || versionText[6] != '.'
+        || versionText[5] < '0' || versionText[5] > '9' || versionText[7] < '0' || versionText[7] > '9') {
+        fail(400);
+        return false;
+    }
+    if (versionText[5] != '1') {
+        fail(505);
+        return false;
+    }
+
+    method = {at, methodText.size()};
+    target = {at + firstSpace + 1, targetText.size()};
+    minorVersion = versionText[7] - '0';
+    return true;
+}
+
+bool HttpParser::parseHeaderLine(QByteArrayView line, qsizetype at)
+{
+    // A line starting with whitespace continues the last one (obs-fold), which RFC 9112 lets a server reject
+    qsizetype colon = line.indexOf(':');
+    if (isWhitespace(line.front()) || colon <= 0 || !isToken(line.first(colon))) {
+        fail(400);
+        return false;
+    }
+    if (headerSpans.size() >= maxHeaderCount) {
+        fail(431);
+        return false;
+    }
+
+    QByteArrayView value = trimWhitespace(line.sliced(colon + 1));
+    for (char c : value) {
+        if ((uchar(c) < ' ' && c != '\t') || c == 0x7f) {
+            fail(400);
+            return false;
+        }
+    }
+
+    headerSpans.append({{at, colon}, {at + (value.data() - line.data()), value.size()}});
+    return true;
+}
+
+HttpParser::Result HttpParser::fail(int errorStatus)
+{
+    state = Failed;
+    status = errorStatus;
+    return Invalid;
+}
@@ -0,0 +1,82 @@
+#ifndef HTTPPARSER_H
+#define HTTPPARSER_H
+
+#include <QByteArrayView>
+#include <QVarLengthArray>
+#include <QtGlobal>
+
+// Incremental parser for the head of an HTTP/1.x request: the request line
+// and the header fields, never a body. Call parse() with the bytes received
+// so far, from the start of the request, each time more arrive; lines already
+// parsed are not looked at again. Only offsets are kept, so a parsed request
+// is views into the bytes last passed in and nothing is copied. The parser
+// touches no sockets and keeps no other state, so any bytes can be fed to it,
+// from a fuzzer or a benchmark as well as from a connection.
+class HttpParser
+{
+public:
+    static constexpr qsizetype maxRequestLineSize = 8 * 1024;
+    static constexpr qsizetype maxHeadSize = 32 * 1024; // Request line and header fields together
+    static constexpr int maxHeaderCount = 64;
+
+    enum Result {
+        NeedMoreData,
+        RequestReady, // request() holds it
+        Invalid       // Answer errorStatus() and close, the stream cannot be trusted past here
+    };
+
+    struct Header {
+        QByteArrayView name;
+        QByteArrayView value; // Without the whitespace around it
+    };
+
+    struct Request {
+        QByteArrayView method;
+        QByteArrayView target;
+        int minorVersion = 1; // HTTP/1.x
+        QVarLengthArray<Header, 16> headers;
+        qsizetype size = 0; // Bytes of the head, blank line included; a pipelined request starts there
+
+        QByteArrayView header(QByteArrayView name) const; // First field of that name, any case; null if absent
+        bool hasToken(QByteArrayView name, QByteArrayView token) const; // A comma-separated field such as Connection lists token
+    };
+
+    Result parse(QByteArrayView data);
+    const Request &request() const { return current; }
+    int errorStatus() const { return status; } // 400, 414, 431 or 505 once parse() returned Invalid
+    void reset(); // Before the request that follows, with data starting at its first byte
+
+private:
+    enum State {
+        RequestLine,
+        HeaderLine,
+        Done,
+        Failed
+    };
+
+    struct Span {
+        qsizetype start = 0;
+        qsizetype size = 0;
+    };
+
+    struct HeaderSpan {
+        Span name;
+        Span value;
+    };
+
+    bool parseRequestLine(QByteArrayView line, qsizetype at);
+    bool parseHeaderLine(QByteArrayView line, qsizetype at);
+    Result fail(int errorStatus);
+
+    State state = RequestLine;
+    qsizetype position = 0; // Start of the first line not parsed yet
+    qsizetype scanned = 0;  // Bytes from position known to hold no line end
+    Span method;
+    Span target;
+    int minorVersion = 1;
+    QVarLengthArray<HeaderSpan, 16> headerSpans;
+    Request current;
+    int status = 0;
+};
+
+#endif // HTTPPARSER_H
@@ -1,13 +1,146 @@
 #include "httpserver.h"
+#include <QBuffer>
+#include <QDebug>
 #include <QDateTime>
 #include <QFileInfo>
 #include <QDir>
 #include <QUrl>
 #include <QRegularExpression>
 #include <QRandomGenerator>
+#include <QLocale>
+#include <QTimeZone>
+#include <QCryptographicHash>
+#include <algorithm>
+
+namespace {
+
+struct ByteRange {
+    qint64 first;
+    qint64 last; // Inclusive, as in Content-Range
+};
+
+// HTTP-date (IMF-fixdate), what Last-Modified carries and If-Range echoes
+QString httpDate(const QDateTime &time)
+{
+    return QLocale::c().toString(time.toUTC(), "ddd, dd MMM yyyy hh:mm:ss 'GMT'");
+}
+
+// Invalid unless in the form httpDate() writes, which is the one browsers echo back
+QDateTime parseHttpDate(QByteArrayView text)
+{
+    QDateTime time = QLocale::c().toDateTime(QString::fromLatin1(text), "ddd, dd MMM yyyy hh:mm:ss 'GMT'");
+    time.setTimeZone(QTimeZone::utc());
+    return time;
+}
+
+QByteArray validatorHeaders(const QByteArray &etag, const QDateTime &modified)
+{
+    // no-cache: the browser may keep a copy but asks first, and the answer is a 304 while it is current
+    return "ETag: " + etag + "\r\nLast-Modified: " + httpDate(modified).toLatin1() + "\r\nCache-Control: no-cache\r\n";
+}
+
+// RFC 9110 13.2.2: If-None-Match decides when present, If-Modified-Since only counts without it
+bool isNotModified(const HttpParser::Request &request, const QByteArray &etag, const QDateTime &modified)
+{
+    QByteArrayView ifNoneMatch = request.header("if-none-match");
+    if (!ifNoneMatch.isNull()) {
+        while (!ifNoneMatch.isEmpty()) {
+            qsizetype comma = ifNoneMatch.indexOf(',');
+            QByteArrayView candidate = (comma < 0 ? ifNoneMatch : ifNoneMatch.first(comma)).trimmed();
+            if (candidate.startsWith("W/")) {
+                candidate = candidate.sliced(2); // Weak comparison, as If-None-Match uses
+            }
+            if (candidate == QByteArrayView("*") || candidate == QByteArrayView(etag)) {
+                return true;
+            }
+            ifNoneMatch = comma < 0 ? QByteArrayView() : ifNoneMatch.sliced(comma + 1);
+        }
+        return false;
+    }
+
+    QByteArrayView ifModifiedSince = request.header("if-modified-since");
+    QDateTime since = ifModifiedSince.isNull() ? QDateTime() : parseHttpDate(ifModifiedSince);
+    return since.isValid() && modified.toSecsSinceEpoch() <= since.toSecsSinceEpoch(); // The header has whole seconds
+}
+
+// The satisfiable ranges of a "bytes=" Range header against size bytes,
+// sorted with overlapping and adjacent ones merged; none left means 416.
+// False if the header is malformed or asks for too many ranges: it is then
+// ignored and the whole file sent.
+bool parseRanges(const QString &header, qint64 size, int maxRanges, QList<ByteRange> &ranges)
+{
+    ranges.clear();
+    if (!header.startsWith("bytes=")) {
+        return false;
+    }
+
+    const QStringList specs = header.mid(6).split(',');
+    for (const QString &spec : specs) {
+        QString trimmed = spec.trimmed();
+        qsizetype dash = trimmed.indexOf('-');
+        if (trimmed.isEmpty() || dash < 0) {
+            return false;
+        }
+
+        bool firstOk = true;
+        bool lastOk = true;
+        QString firstText = trimmed.left(dash).trimmed();
+        QString lastText = trimmed.mid(dash + 1).trimmed();
+        qint64 first = firstText.isEmpty() ? -1 : firstText.toLongLong(&firstOk);
+        qint64 last = lastText.isEmpty() ? -1 : lastText.toLongLong(&lastOk);
+        if (!firstOk || !lastOk || (first < 0 && last < 0) || (first >= 0 && last >= 0 && last < first)) {
+            return false;
+        }
+
+        if (first < 0) {
+            // Suffix: the last "last" bytes
+            if (last == 0 || size == 0) {
+                continue;
+            }
+            ranges.append({qMax<qint64>(0, size - last), size - 1});
+        } else if (first < size) {
+            ranges.append({first, last < 0 ? size - 1 : qMin(last, size - 1)});
+        }
+    }
+
+    std::sort(ranges.begin(), ranges.end(), [](const ByteRange &a, const ByteRange &b) { return a.first < b.first; });
+    QList<ByteRange> merged;
+    for (const ByteRange &range : std::as_const(ranges)) {
+        if (!merged.isEmpty() && range.first <= merged.last().last + 1) {
+            merged.last().last = qMax(merged.last().last, range.last);
+        } else {
+            merged.append(range);
+        }
+    }
+    ranges = merged;
+    return ranges.size() <= maxRanges;
+}
+
+// Changes whenever the file is replaced or written to, as far as size and mtime tell
+QByteArray entityTag(qint64 size, const QDateTime &modified)
+{
+    return '"' + QByteArray::number(modified.toMSecsSinceEpoch(), 16) + '-' + QByteArray::number(size, 16) + '"';
+}
+
+QString statusLine(int status)
+{
+    switch (status) {
+    case 414: return "414 URI Too Long";
+    case 431: return "431 Request Header Fields Too Large";
+    case 505: return "505 HTTP Version Not Supported";
+    default: return "400 Bad Request";
+    }
+}
+
+QByteArray contentRange(const ByteRange &range, qint64 size)
+{
+    return "bytes " + QByteArray::number(range.first) + "-" + QByteArray::number(range.last) + "/" + QByteArray::number(size);
+}
+
+}
 
 HttpServer::HttpServer(QObject *parent)
-    : QObject(parent), tcpServer(new QTcpServer(this)), port(11234)
+    : QObject(parent), tcpServer(new QTcpServer(this)), sharedFilesChanged(QDateTime::currentDateTimeUtc()), port(11234)
 {
     //ok buggy program, i think that is all. I cannot waste too much time on this small project.
     //need to learn more C++ and computer system stuff now. This app should be enough for me
@@ -85,17 +218,28 @@ bool HttpServer::isRunning() const {
 
 void HttpServer::cleanupClients() {
     QMutexLocker locker(&clientMutex);
-    for (QTcpSocket *clientSocket : buffers.keys()) {
-        clientSocket->disconnectFromHost();
-        clientSocket->deleteLater();
+    for (auto it = clients.cbegin(); it != clients.cend(); ++it) {
+        dropResponse(it.key());
+        it.key()->disconnectFromHost();
+        it.key()->deleteLater();
+        delete it.value()->idleTimer;
+        delete it.value();
     }
-    buffers.clear();
-    sizes.clear();
+    clients.clear();
 }
 
 void HttpServer::setSharedFiles(const QStringList &files)
 {
+    QMutexLocker locker(&sharedFilesMutex);
     sharedFiles = files;
+    invalidateListing();
+    sharedIndex.clear();
+    for (const QString &filePath : files) {
+        QString fileName = QFileInfo(filePath).fileName();
+        if (!sharedIndex.contains(fileName)) {
+            sharedIndex.insert(fileName, describeFile(filePath));
+        }
+    }
 }
 
 QString HttpServer::generateSessionKey()
@@ -139,35 +283,144 @@ void HttpServer::handleNewConnection()
     // Proceed with normal handling
     connect(clientSocket, &QTcpSocket::readyRead, this, &HttpServer::readClient);
     connect(clientSocket, &QTcpSocket::disconnected, this, &HttpServer::discardClient);
-    buffers.insert(clientSocket, new QByteArray());
-    sizes.insert(clientSocket, new qint64(0));
+    connect(clientSocket, &QTcpSocket::bytesWritten, this, &HttpServer::onBytesWritten);
+    clientSocket->setReadBufferSize(HttpParser::maxHeadSize); // What we do not take yet stays in the kernel
+
+    Client *client = new Client;
+    client->idleTimer = new QTimer();
+    client->idleTimer->setSingleShot(true);
+    client->idleTimer->setInterval(keepAliveTimeout * 1000);
+    connect(client->idleTimer, &QTimer::timeout, clientSocket, [clientSocket]() { clientSocket->disconnectFromHost(); });
+    client->idleTimer->start(); // Also bounds the wait for the first request
+    clients.insert(clientSocket, client);
 }
 
 
 void HttpServer::readClient()
 {
-    QTcpSocket *clientSocket = static_cast<QTcpSocket*>(sender());
-    QByteArray *buffer = buffers.value(clientSocket);
-    qint64 *s = sizes.value(clientSocket);
+    receive(static_cast<QTcpSocket*>(sender()));
+}
+
+void HttpServer::receive(QTcpSocket *clientSocket)
+{
+    Client *client = clients.value(clientSocket);
+    if (!client) {
+        return;
+    }
+    if (client->closing) {
+        clientSocket->skip(clientSocket->bytesAvailable());
+        return;
+    }
+
+    // While a response is out at most one more head waits here, the rest stays in the socket
+    qint64 wanted = clientSocket->bytesAvailable();
+    if (client->response) {
+        wanted = qMin<qint64>(wanted, HttpParser::maxHeadSize - client->buffer.size());
+    }
+    if (wanted > 0) {
+        qsizetype used = client->buffer.size();
+        client->buffer.resize(used + wanted);
+        qint64 read = clientSocket->read(client->buffer.data() + used, wanted);
+        client->buffer.resize(used + qMax<qint64>(read, 0));
+    }
+    handleRequests(clientSocket);
+}
 
-    qint64 bytesAvailable = clientSocket->bytesAvailable();
-    buffer->append(clientSocket->read(bytesAvailable));
+void HttpServer::handleRequests(QTcpSocket *clientSocket)
+{
+    Client *client = clients.value(clientSocket);
+    if (!client) {
+        return;
+    }
 
-    if (buffer->contains("\r\n\r\n")) {
-        QString request = QString(*buffer);
-        QRegularExpression regex("GET /([^ ]+) HTTP/1.1");
-        QRegularExpressionMatch match = regex.match(request);
+    // A request waits in the buffer while the one before it is still being sent
+    client->handling = true;
+    while (!client->response && !client->closing) {
+        HttpParser::Result result = client->parser.parse(client->buffer);
+        if (result == HttpParser::NeedMoreData) {
+            break;
+        }
+        client->idleTimer->stop();
+
+        if (result == HttpParser::Invalid) {
+            // Where the next request would start is anyone's guess now
+            client->closing = true;
+            client->headOnly = false;
+            sendErrorResponse(clientSocket, statusLine(client->parser.errorStatus()), "Bad request.");
+            break;
+        }
 
-        if (match.hasMatch()) {
-            QString path = match.captured(1);
-            handleGetRequest(clientSocket, path);
+        // HTTP/1.1 keeps the connection unless told otherwise, HTTP/1.0 only when asked to
+        const HttpParser::Request &request = client->parser.request();
+        bool keepAlive = request.minorVersion >= 1 ? !request.hasToken("connection", "close")
+                                                   : request.hasToken("connection", "keep-alive");
+        if (!keepAlive || ++client->requests >= maxRequestsPerConnection) {
+            client->closing = true;
         }
+        client->headOnly = request.method == QByteArrayView("HEAD");
+        handleRequest(clientSocket, request);
 
-        clientSocket->disconnectFromHost();
+        // The request's views are spent, the next one starts where it ended
+        client->buffer.remove(0, request.size);
+        client->parser.reset();
+    }
+    client->handling = false;
+
+    // Bytes held back in the socket while a response was out bring no readyRead of their own
+    if (!client->response && !client->closing && clientSocket->bytesAvailable() > 0) {
+        receive(clientSocket);
+        return;
+    }
+
+    // A streamed body comes back here through finishResponse() once it is all out
+    if (!client->response) {
+        if (client->closing) {
+            clientSocket->disconnectFromHost(); // Flushes what is queued first
+        } else {
+            client->idleTimer->start();
+        }
+    }
+}
+
+void HttpServer::handleRequest(QTcpSocket *clientSocket, const HttpParser::Request &request)
+{
+    Client *client = clients.value(clientSocket);
+    if (request.method != QByteArrayView("GET") && request.method != QByteArrayView("HEAD")) {
+        sendResponse(clientSocket, "405 Method Not Allowed", "text/html", "<h1><center>Method not allowed. </center></h1>",
+                     "Allow: GET, HEAD\r\n");
+        return;
+    }
+
+    // No request here has a body; one we will not read leaves no way to find the next request
+    bool contentLengthOk = true;
+    QByteArrayView contentLength = request.header("content-length");
+    if (!request.header("transfer-encoding").isNull()
+        || (!contentLength.isNull() && contentLength.toLongLong(&contentLengthOk) != 0) || !contentLengthOk) {
+        client->closing = true;
+        sendErrorResponse(clientSocket, "413 Content Too Large", "Request bodies are not accepted.");
+        return;
+    }
+
+    // origin-form, the path without the leading slash and without a query
+    QByteArrayView target = request.target;
+    if (!target.startsWith('/')) {
+        sendErrorResponse(clientSocket, "400 Bad Request", "Bad request.");
+        return;
     }
+    qsizetype query = target.indexOf('?');
+    handleGetRequest(clientSocket, QString::fromUtf8(target.sliced(1, (query < 0 ? target.size() : query) - 1)), request);
 }
 
-void HttpServer::handleGetRequest(QTcpSocket *clientSocket, const QString &path) {
+void HttpServer::finishResponse(QTcpSocket *clientSocket)
+{
+    dropResponse(clientSocket);
+    Client *client = clients.value(clientSocket);
+    if (client && !client->handling) {
+        receive(clientSocket); // Takes in what waited in the socket, then the next pipelined request
+    }
+}
+
+void HttpServer::handleGetRequest(QTcpSocket *clientSocket, const QString &path, const HttpParser::Request &request) {
     // qDebug() << "Requested path:" << path; // Debug: Print the requested path
 
     // Check if the path starts with the session key
@@ -178,36 +431,34 @@ void HttpServer::handleGetRequest(QTcpSocket *clientSocket, const QString &path)
         // If the file path is empty, return the file list
         if (filePath.isEmpty()) {
             // qDebug() << "Requested directory, returning file list.";
-            sendResponse(clientSocket, "200 OK", "text/html", generateFileListHtml().toUtf8());
+            Listing current = currentListing();
+            QByteArray validators = validatorHeaders(current.etag, current.modified);
+            if (isNotModified(request, current.etag, current.modified)) {
+                sendNotModified(clientSocket, validators);
+                return;
+            }
+            QBuffer *page = new QBuffer();
+            page->setData(current.page); // Shares the cached bytes
+            page->open(QIODevice::ReadOnly);
+            streamResponse(clientSocket, "200 OK", "text/html", validators, page, {{QByteArray(), 0, page->size()}});
             return;
         }
 
-        bool fileFound = false;
-
-        for (const QString &sharedFile : sharedFiles) {
-            QFileInfo fileInfo(sharedFile);
-            // qDebug() << "Checking shared file:" << fileInfo.fileName(); // Debug: Print each shared file name
-
-            if (fileInfo.fileName() == filePath) {
-                qDebug() << "File found:" << sharedFile; // Debug: Print the matched file
-                QFile file(sharedFile);
-                if (file.open(QIODevice::ReadOnly)) {
-                    QString mimeType = getMimeType(sharedFile);
-                    if (mimeType == "application/octet-stream") {
-                        // Force download for unsupported file types
-                        sendResponse(clientSocket, "200 OK", "application/octet-stream", file.readAll());
-                    } else {
-                        // Display in browser for supported file types
-                        sendResponse(clientSocket, "200 OK", mimeType, file.readAll());
-                    }
-                    file.close();
-                    fileFound = true;
-                    break;
-                }
-            }
-        }
+        QMutexLocker locker(&sharedFilesMutex);
+        auto found = sharedIndex.find(filePath);
+        QFile *file = found != sharedIndex.end() ? new QFile(found->path) : nullptr;
+        bool fileFound = file && file->open(QIODevice::ReadOnly);
 
-        if (!fileFound) {
+        if (fileFound) {
+            // Both from the open file, so this stat is the only one the request costs
+            if (file->size() != found->size || file->fileTime(QFileDevice::FileModificationTime) != found->modified) {
+                *found = describeFile(found->path);
+            }
+            SharedFile shared = *found;
+            locker.unlock();
+            sendFile(clientSocket, file, shared, request);
+        } else {
+            delete file;
             // qDebug() << "File not found:" << filePath; // Debug: Print if the file is not found
             sendErrorResponse(clientSocket, "404 Not Found", "File not found.");
         }
@@ -218,29 +469,201 @@ void HttpServer::handleGetRequest(QTcpSocket *clientSocket, const QString &path)
 }
 
 
-void HttpServer::sendResponse(QTcpSocket *clientSocket, const QString &status, const QString &contentType, const QByteArray &body)
+void HttpServer::sendFile(QTcpSocket *clientSocket, QFile *file, const SharedFile &shared, const HttpParser::Request &request)
+{
+    // application/octet-stream makes the browser download what it cannot show
+    const QString &mimeType = shared.mimeType;
+    qint64 size = shared.size;
+    QByteArray validators = "Accept-Ranges: bytes\r\n" + validatorHeaders(shared.etag, shared.modified);
+    if (isNotModified(request, shared.etag, shared.modified)) {
+        delete file;
+        sendNotModified(clientSocket, validators);
+        return;
+    }
+
+    // If-Range: the ranges only apply to the copy the client already has part of, by strong ETag or exact date
+    QList<ByteRange> ranges;
+    QByteArrayView range = request.header("range");
+    QByteArrayView ifRange = request.header("if-range");
+    bool sameCopy = ifRange.isNull() || ifRange == QByteArrayView(shared.etag) || ifRange == httpDate(shared.modified).toLatin1();
+    bool ranged = !range.isNull() && sameCopy && parseRanges(QString::fromLatin1(range), size, maxRanges, ranges);
+
+    if (!ranged) {
+        streamResponse(clientSocket, "200 OK", mimeType, validators, file, {{QByteArray(), 0, size}});
+    } else if (ranges.isEmpty()) {
+        delete file;
+        sendResponse(clientSocket, "416 Range Not Satisfiable", "text/html", QByteArray(),
+                     validators + "Content-Range: bytes */" + QByteArray::number(size) + "\r\n");
+    } else if (ranges.size() == 1) {
+        const ByteRange &only = ranges.first();
+        streamResponse(clientSocket, "206 Partial Content", mimeType, validators + "Content-Range: " + contentRange(only, size) + "\r\n",
+                       file, {{QByteArray(), only.first, only.last - only.first + 1}});
+    } else {
+        // multipart/byteranges, each part with its own header ahead of its bytes
+        QByteArray boundary = "LetsShareRange" + QByteArray::number(QRandomGenerator::global()->generate64(), 16);
+        QList<BodyPart> parts;
+        for (const ByteRange &range : std::as_const(ranges)) {
+            QByteArray partHeader = "\r\n--" + boundary + "\r\nContent-Type: " + mimeType.toUtf8()
+                                    + "\r\nContent-Range: " + contentRange(range, size) + "\r\n\r\n";
+            parts.append({partHeader, range.first, range.last - range.first + 1});
+        }
+        parts.append({"\r\n--" + boundary + "--\r\n", 0, 0});
+        streamResponse(clientSocket, "206 Partial Content", "multipart/byteranges; boundary=" + boundary, validators, file, parts);
+    }
+}
+
+void HttpServer::sendNotModified(QTcpSocket *clientSocket, const QByteArray &validators)
+{
+    QByteArray header = responseHeader(clientSocket, "304 Not Modified", QString(), -1, validators);
+    clientSocket->write(header.data(), header.size());
+}
+
+QByteArray HttpServer::responseHeader(QTcpSocket *clientSocket, const QString &status, const QString &contentType, qint64 contentLength,
+                                      const QByteArray &extraHeaders)
 {
-    QByteArray response = "HTTP/1.1 " + status.toUtf8() + "\r\n";
-    response += "Content-Type: " + contentType.toUtf8() + "\r\n";
-    response += "Content-Length: " + QByteArray::number(body.size()) + "\r\n";
-    response += "\r\n";
-    response += body;
+    // Blocked clients never become a Client, so they are told the connection closes too
+    Client *client = clients.value(clientSocket);
+    bool keepAlive = client && !client->closing;
+
+    QByteArray header = "HTTP/1.1 " + status.toUtf8() + "\r\n";
+    if (contentLength >= 0) { // A 304 describes the body it leaves out, so it carries neither
+        header += "Content-Type: " + contentType.toUtf8() + "\r\n";
+        header += "Content-Length: " + QByteArray::number(contentLength) + "\r\n";
+    }
+    header += extraHeaders;
+    if (keepAlive) {
+        header += "Connection: keep-alive\r\n";
+        header += "Keep-Alive: timeout=" + QByteArray::number(keepAliveTimeout)
+                  + ", max=" + QByteArray::number(maxRequestsPerConnection - client->requests) + "\r\n";
+    } else {
+        header += "Connection: close\r\n";
+    }
+    header += "\r\n";
+    return header;
+}
+
+void HttpServer::sendResponse(QTcpSocket *clientSocket, const QString &status, const QString &contentType, const QByteArray &body,
+                              const QByteArray &extraHeaders)
+{
+    QByteArray response = responseHeader(clientSocket, status, contentType, body.size(), extraHeaders);
+    Client *client = clients.value(clientSocket);
+    if (!client || !client->headOnly) {
+        response += body;
+    }
     clientSocket->write(response.data(), response.size());
 }
 
+void HttpServer::streamResponse(QTcpSocket *clientSocket, const QString &status, const QString &contentType, const QByteArray &extraHeaders,
+                                QIODevice *body, const QList<BodyPart> &parts)
+{
+    qint64 contentLength = 0;
+    for (const BodyPart &part : parts) {
+        contentLength += part.prefix.size() + part.length;
+    }
+    QByteArray header = responseHeader(clientSocket, status, contentType, contentLength, extraHeaders);
+    clientSocket->write(header.data(), header.size());
+
+    Client *client = clients.value(clientSocket);
+    if (!client || client->headOnly) {
+        delete body;
+        return;
+    }
+    client->response = new Response;
+    client->response->body = body;
+    client->response->parts = parts;
+    sendMoreBody(clientSocket);
+}
+
+void HttpServer::sendMoreBody(QTcpSocket *clientSocket)
+{
+    Client *client = clients.value(clientSocket);
+    Response *response = client ? client->response : nullptr;
+    if (!response) {
+        return;
+    }
+
+    // Never more than the watermark plus a chunk is held for a client, whatever the file size
+    QByteArray chunk;
+    bool failed = false;
+    while (!failed && !response->parts.isEmpty() && clientSocket->bytesToWrite() < writeHighWatermark) {
+        BodyPart &part = response->parts.first();
+        if (!part.started) {
+            part.started = true;
+            clientSocket->write(part.prefix);
+            failed = part.length > 0 && !response->body->seek(part.offset);
+        } else if (part.length == 0) {
+            response->parts.removeFirst();
+        } else {
+            chunk.resize(qMin(bodyChunkSize, part.length));
+            qint64 read = response->body->read(chunk.data(), chunk.size());
+            failed = read <= 0;
+            if (!failed) {
+                clientSocket->write(chunk.constData(), read);
+                part.length -= read;
+            }
+        }
+    }
+
+    if (failed) {
+        // The file shrank or failed under us, the client must not take a short body for the whole one
+        // Aborted from the event loop, the disconnect would otherwise free the client under our callers
+        client->closing = true;
+        dropResponse(clientSocket);
+        QMetaObject::invokeMethod(clientSocket, &QTcpSocket::abort, Qt::QueuedConnection);
+        return;
+    }
+
+    if (response->parts.isEmpty()) {
+        finishResponse(clientSocket);
+    }
+}
+
+void HttpServer::dropResponse(QTcpSocket *clientSocket)
+{
+    Client *client = clients.value(clientSocket);
+    if (client && client->response) {
+        delete client->response->body;
+        delete client->response;
+        client->response = nullptr;
+    }
+}
+
+void HttpServer::onBytesWritten()
+{
+    sendMoreBody(static_cast<QTcpSocket*>(sender()));
+}
+
 void HttpServer::sendErrorResponse(QTcpSocket *clientSocket, const QString &status, const QString &message)
 {
     QByteArray body = "<h1><center>" + message.toUtf8() + " </center></h1>";
     sendResponse(clientSocket, status, "text/html", body);
 }
 
+HttpServer::Listing HttpServer::currentListing()
+{
+    QMutexLocker locker(&sharedFilesMutex);
+    if (!listing.valid || listing.sessionKey != sessionKey) {
+        listing.page = generateFileListHtml().toUtf8();
+        listing.etag = '"' + QCryptographicHash::hash(listing.page, QCryptographicHash::Sha1).toHex().left(20) + '"';
+        listing.modified = sharedFilesChanged;
+        listing.sessionKey = sessionKey;
+        listing.valid = true;
+    }
+    return listing;
+}
+
+void HttpServer::invalidateListing()
+{
+    listing.valid = false;
+    sharedFilesChanged = QDateTime::currentDateTimeUtc();
+}
+
 QString HttpServer::generateFileListHtml() {
     QString html = "<h1>Shared Files</h1><ul>";
     for (const QString &filePath : sharedFiles) {
-        QFileInfo fileInfo(filePath);
-        QString fileName = fileInfo.fileName();
+        QString fileName = QFileInfo(filePath).fileName(); // Only the path is looked at, no stat
         QString fileUrl = "/" + sessionKey + "/Share/" + QUrl::toPercentEncoding(fileName); // Include session key in the URL
-        QString mimeType = getMimeType(filePath);
+        QString mimeType = sharedIndex.value(fileName).mimeType;
 
         html += "<li>";
         if (mimeType == "application/octet-stream") {
@@ -284,9 +707,13 @@ void HttpServer::discardClient()
 {
     QTcpSocket *clientSocket = static_cast<QTcpSocket*>(sender());
     if (clientSocket) {
-        // Clean up buffers and sizes
-        delete buffers.take(clientSocket);
-        delete sizes.take(clientSocket);
+        // Clean up what was kept for the connection
+        dropResponse(clientSocket);
+        Client *client = clients.take(clientSocket);
+        if (client) {
+            delete client->idleTimer;
+            delete client;
+        }
 
         // Disconnect and delete the socket
         clientSocket->disconnectFromHost();
@@ -299,10 +726,44 @@ void HttpServer::addSharedFile(const QString &filePath) {
     QMutexLocker locker(&sharedFilesMutex);
     if (!sharedFiles.contains(filePath)) {
         sharedFiles.append(filePath);
+        invalidateListing();
+        QString fileName = QFileInfo(filePath).fileName();
+        if (!sharedIndex.contains(fileName)) {
+            sharedIndex.insert(fileName, describeFile(filePath));
+        }
     }
 }
 
 void HttpServer::removeSharedFile(const QString &filePath) {
     QMutexLocker locker(&sharedFilesMutex);
-    sharedFiles.removeAll(filePath);
+    if (sharedFiles.removeAll(filePath) > 0) {
+        invalidateListing();
+    }
+    QFileInfo fileInfo(filePath);
+    if (sharedIndex.value(fileInfo.fileName()).path == fileInfo.absoluteFilePath()) {
+        indexName(fileInfo.fileName()); // Another shared file of the same name takes its place
+    }
+}
+
+HttpServer::SharedFile HttpServer::describeFile(const QString &filePath)
+{
+    QFileInfo fileInfo(filePath);
+    SharedFile shared;
+    shared.path = fileInfo.absoluteFilePath();
+    shared.size = fileInfo.size();
+    shared.modified = fileInfo.lastModified();
+    shared.mimeType = getMimeType(filePath);
+    shared.etag = entityTag(shared.size, shared.modified);
+    return shared;
+}
+
+void HttpServer::indexName(const QString &fileName)
+{
+    for (const QString &filePath : std::as_const(sharedFiles)) {
+        if (QFileInfo(filePath).fileName() == fileName) {
+            sharedIndex.insert(fileName, describeFile(filePath));
+            return;
+        }
+    }
+    sharedIndex.remove(fileName);
 }
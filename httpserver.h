@@ -12,6 +12,13 @@
 #include <QRegularExpression>
 #include <QRandomGenerator>
 #include <QMutex>
+#include <QSet>
+#include <QHash>
+#include <QDateTime>
+#include <QTimer>
+
+#include "httpparser.h"
+#include <QFileInfo>
 
 class HttpServer : public QObject
 {
@@ -41,13 +48,69 @@ private slots:
     void handleNewConnection();
     void readClient();
     void discardClient();
+    void onBytesWritten();
     void onStopServer();
 
 private:
+    static constexpr qint64 bodyChunkSize = 64 * 1024;  // Read from the body per write
+    static constexpr qint64 writeHighWatermark = 256 * 1024; // Bytes queued in the socket before we wait for bytesWritten
+
+    static constexpr int maxRanges = 16; // More in one Range header and the whole file is sent instead
+    static constexpr int keepAliveTimeout = 15; // s a kept-alive connection may sit idle between requests
+    static constexpr int maxRequestsPerConnection = 100; // The last one is answered with Connection: close
+
+    // length bytes of the body from offset, after prefix (a multipart part header, say)
+    struct BodyPart {
+        QByteArray prefix;
+        qint64 offset = 0;
+        qint64 length = 0;
+        bool started = false; // Prefix queued and the body positioned
+    };
+
+    // A body being fed to the client, a chunk at a time as the socket drains
+    struct Response {
+        QIODevice *body = nullptr; // A QFile, or a QBuffer over a generated page; owned
+        QList<BodyPart> parts;     // Still to send, in order
+    };
+
+    // Everything kept for one connection
+    struct Client {
+        QByteArray buffer;            // Received and not answered yet, pipelined requests included
+        HttpParser parser;            // Over buffer, from the first byte of the next request
+        Response *response = nullptr; // Only while a body is still being sent
+        QTimer *idleTimer = nullptr;  // Closes a kept-alive connection nobody uses
+        int requests = 0;             // Answered or being answered
+        bool closing = false;         // Close once the current response is out, read nothing more
+        bool headOnly = false;        // Answering a HEAD, the body is left out
+        bool handling = false;        // In handleRequests(), which goes on by itself once a response is out
+    };
+
+    // What serving a shared file needs, looked up by its URL name instead of
+    // scanning and stat()ing every shared file per request. Checked against the
+    // opened file when served, and described again if it changed on disk.
+    struct SharedFile {
+        QString path; // Absolute
+        qint64 size = -1;
+        QDateTime modified;
+        QString mimeType;
+        QByteArray etag; // Strong, from size and mtime
+    };
+
     QTcpServer *tcpServer;
-    QMap<QTcpSocket*, QByteArray*> buffers;
-    QMap<QTcpSocket*, qint64*> sizes;
+    QMap<QTcpSocket*, Client*> clients;
     QStringList sharedFiles; // Changed from sharedFolders
+    QHash<QString, SharedFile> sharedIndex; // By file name, the first shared file with that name
+
+    // The listing page as last rendered, kept until the shared set (or the session key in its links) changes
+    struct Listing {
+        QByteArray page;
+        QByteArray etag; // From the page itself, so it survives a restart that shares the same files
+        QDateTime modified;
+        QString sessionKey;
+        bool valid = false;
+    };
+    Listing listing;
+    QDateTime sharedFilesChanged; // Last-Modified of the listing
     QString sessionKey;
     quint16 port;
     qint64 uploadSizeLimit; // Upload size limit per file
@@ -56,10 +119,30 @@ private:
     QMutex clientMutex;
     QSet<QString> allowedIPs;
 
-    void handleGetRequest(QTcpSocket *clientSocket, const QString &path);
-    void sendResponse(QTcpSocket *clientSocket, const QString &status, const QString &contentType, const QByteArray &body);
+    void receive(QTcpSocket *clientSocket); // Into the client's buffer, then handleRequests()
+    // Answers the buffered requests one at a time, in order, so pipelined responses cannot interleave
+    void handleRequests(QTcpSocket *clientSocket);
+    void handleRequest(QTcpSocket *clientSocket, const HttpParser::Request &request);
+    void finishResponse(QTcpSocket *clientSocket); // Close, or go on with the next pipelined request
+    void handleGetRequest(QTcpSocket *clientSocket, const QString &path, const HttpParser::Request &request);
+    // 200, or 206/416 when the request has a Range that still applies to the file
+    void sendFile(QTcpSocket *clientSocket, QFile *file, const SharedFile &shared, const HttpParser::Request &request);
+    SharedFile describeFile(const QString &filePath);
+    void indexName(const QString &fileName); // Point it at the first shared file that has it, or drop it
+    void sendResponse(QTcpSocket *clientSocket, const QString &status, const QString &contentType, const QByteArray &body,
+                      const QByteArray &extraHeaders = QByteArray());
+    // Headers now, then the parts of body (taken over) as the socket drains
+    void streamResponse(QTcpSocket *clientSocket, const QString &status, const QString &contentType, const QByteArray &extraHeaders,
+                        QIODevice *body, const QList<BodyPart> &parts);
+    void sendMoreBody(QTcpSocket *clientSocket);
+    void dropResponse(QTcpSocket *clientSocket);
+    QByteArray responseHeader(QTcpSocket *clientSocket, const QString &status, const QString &contentType, qint64 contentLength,
+                              const QByteArray &extraHeaders);
     void sendErrorResponse(QTcpSocket *clientSocket, const QString &status, const QString &message);
-    QString generateFileListHtml();
+    Listing currentListing(); // Rendered again only if the cached one is stale
+    void invalidateListing(); // Called with sharedFilesMutex held
+    QString generateFileListHtml(); // Called with sharedFilesMutex held
+    void sendNotModified(QTcpSocket *clientSocket, const QByteArray &validators);
     QString getMimeType(const QString &filePath); // Add this line
     void cleanupClients();
     void resetServer(); // Reset the server state
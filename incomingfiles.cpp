@@ -0,0 +1,289 @@
+#include "incomingfiles.h"
+#include "diskbackend.h"
+
+#include <QFileInfo>
+#include <QDir>
+#include <QDateTime>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+
+#ifdef Q_OS_UNIX
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef Q_OS_WIN
+#include <windows.h>
+#endif
+
+using namespace TransferProtocol;
+
+namespace {
+
+// Reserves the whole file in one go so the file system can lay it out in
+// one piece, instead of growing it range by range
+bool preallocate(QFile &file, qint64 size)
+{
+#ifdef Q_OS_LINUX
+    if (::fallocate(file.handle(), 0, 0, off_t(size)) == 0) {
+        return true;
+    }
+#endif
+    return file.resize(size); // Sparse where fallocate() is missing or refused
+}
+
+// Atomic where the platform allows it, the target never goes missing in between
+bool renameOver(const QString &from, const QString &to)
+{
+#ifdef Q_OS_UNIX
+    return ::rename(QFile::encodeName(from).constData(), QFile::encodeName(to).constData()) == 0;
+#elif defined(Q_OS_WIN)
+    return MoveFileExW(reinterpret_cast<LPCWSTR>(QDir::toNativeSeparators(from).utf16()),
+                       reinterpret_cast<LPCWSTR>(QDir::toNativeSeparators(to).utf16()),
+                       MOVEFILE_REPLACE_EXISTING);
+#else
+    QFile::remove(to);
+    return QFile::rename(from, to);
+#endif
+}
+
+}
+
+IncomingFiles::IncomingFiles() : policy(NoSync)
+{
+}
+
+void IncomingFiles::setDurability(Durability durability)
+{
+    policy.storeRelaxed(durability);
+}
+
+IncomingFiles::Durability IncomingFiles::durability() const
+{
+    return Durability(policy.loadRelaxed());
+}
+
+QString IncomingFiles::partPath(const QString &filePath)
+{
+    QFileInfo target(filePath);
+    return target.dir().filePath("." + target.fileName() + ".lspart");
+}
+
+bool IncomingFiles::find(const QString &filePath, qint64 fileSize, qint64 modified, ByteRanges &committed)
+{
+    QMutexLocker locker(&mutex);
+    if (!findLocked(filePath, fileSize, modified)) {
+        return false;
+    }
+
+    committed = files[filePath].committed;
+    return true;
+}
+
+bool IncomingFiles::openRange(const QString &filePath, qint64 fileSize, qint64 modified, QFile &file)
+{
+    // Held while creating the file so two streams of it cannot both start it over
+    QMutexLocker locker(&mutex);
+    file.setFileName(partPath(filePath));
+
+    if (findLocked(filePath, fileSize, modified)) {
+        return file.open(QIODevice::ReadWrite);
+    }
+
+    // First range of this file, start from an empty file of the final size
+    // so every range can be written at its own offset
+    if (!file.open(QIODevice::WriteOnly) || !preallocate(file, fileSize)) {
+        file.remove();
+        return false;
+    }
+
+    files[filePath] = {fileSize, modified, ByteRanges()};
+    saveJournalLocked(filePath);
+    return true;
+}
+
+void IncomingFiles::commit(const QString &filePath, qint64 offset, qint64 length)
+{
+    QMutexLocker locker(&mutex);
+    if (!files.contains(filePath)) {
+        return;
+    }
+
+    Entry &entry = files[filePath];
+    entry.committed.append({offset, length});
+    entry.committed = mergeRanges(entry.committed);
+    saveJournalLocked(filePath);
+}
+
+bool IncomingFiles::finish(const QString &filePath)
+{
+    QMutexLocker locker(&mutex);
+    if (!files.contains(filePath)) {
+        return false;
+    }
+
+    // The file is only done once every range has arrived
+    Entry &entry = files[filePath];
+    if (entry.finishing || !missingRanges(entry.committed, entry.fileSize).isEmpty()) {
+        return false;
+    }
+
+    // Stays known until it is installed, a resume query in between hears it is all here
+    entry.finishing = true;
+    return true;
+}
+
+bool IncomingFiles::install(const QString &filePath, QFile &file, bool synced)
+{
+    qint64 modified;
+    {
+        QMutexLocker locker(&mutex);
+        modified = files.value(filePath).modified;
+    }
+
+    // Carry the sender's mtime over so a repeated send can tell the file is already here
+    file.setFileTime(QDateTime::fromMSecsSinceEpoch(modified), QFileDevice::FileModificationTime);
+    bool ok = replace(file, filePath, synced);
+
+    // Only now, a crash before the rename leaves the journal to resume from
+    QMutexLocker locker(&mutex);
+    files.remove(filePath);
+    QFile::remove(journalPath(filePath));
+    return ok;
+}
+
+bool IncomingFiles::replace(QFile &file, const QString &targetPath, bool synced)
+{
+    Durability policy = durability();
+    QString tempPath = file.fileName();
+
+    bool ok = policy == SyncEachFile && !synced ? DiskBackend::syncFile(file) : file.flush();
+    file.close();
+
+    if (!ok || !renameOver(tempPath, targetPath)) {
+        QFile::remove(tempPath);
+        return false;
+    }
+
+    if (policy == SyncEachFile) {
+        DiskBackend::syncPath(QFileInfo(targetPath).absolutePath()); // The rename itself
+    } else if (policy == SyncEachBatch) {
+        QMutexLocker locker(&mutex);
+        unsynced.insert(targetPath);
+    }
+    return true;
+}
+
+void IncomingFiles::syncBatch()
+{
+    QSet<QString> batch;
+    {
+        QMutexLocker locker(&mutex);
+        batch.swap(unsynced);
+    }
+
+    QSet<QString> directories;
+    for (const QString &path : batch) {
+        directories.insert(QFileInfo(path).absolutePath());
+    }
+
+#ifdef Q_OS_LINUX
+    // One syncfs() per file system covers every file of the batch, and the renames
+    QSet<quint64> devices;
+    for (const QString &directory : directories) {
+        int fd = ::open(QFile::encodeName(directory).constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        struct stat status;
+        if (fd < 0) {
+            continue;
+        }
+        if (::fstat(fd, &status) == 0 && !devices.contains(quint64(status.st_dev))) {
+            devices.insert(quint64(status.st_dev));
+            ::syncfs(fd);
+        }
+        ::close(fd);
+    }
+#else
+    // Still one pass at the end of the batch, off the transfer's critical path
+    for (const QString &path : batch) {
+        DiskBackend::syncPath(path);
+    }
+    for (const QString &directory : directories) {
+        DiskBackend::syncPath(directory);
+    }
+#endif
+}
+
+QString IncomingFiles::journalPath(const QString &filePath)
+{
+    // Hidden next to the part file, neither shows up in the download folder
+    QFileInfo target(filePath);
+    return target.dir().filePath("." + target.fileName() + ".lsjournal");
+}
+
+bool IncomingFiles::findLocked(const QString &filePath, qint64 fileSize, qint64 modified)
+{
+    auto known = files.constFind(filePath);
+    if (known == files.cend()) {
+        return loadJournalLocked(filePath, fileSize, modified);
+    }
+    if (known->fileSize == fileSize && known->modified == modified) {
+        return true;
+    }
+
+    // The sender has a different version now, what we have of the old one is useless
+    files.erase(known);
+    QFile::remove(partPath(filePath));
+    QFile::remove(journalPath(filePath));
+    return false;
+}
+
+bool IncomingFiles::loadJournalLocked(const QString &filePath, qint64 fileSize, qint64 modified)
+{
+    QFile journal(journalPath(filePath));
+    if (!journal.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    QJsonObject state = QJsonDocument::fromJson(journal.readAll()).object();
+    journal.close();
+
+    // A journal for a different version of the file is useless, start over
+    if (state["size"].toInteger() != fileSize || state["modified"].toInteger() != modified
+        || QFileInfo(partPath(filePath)).size() != fileSize) {
+        QFile::remove(journalPath(filePath));
+        return false;
+    }
+
+    Entry entry = {fileSize, modified, ByteRanges()};
+    for (const QJsonValue &value : state["ranges"].toArray()) {
+        QJsonArray range = value.toArray();
+        entry.committed.append({range[0].toInteger(), range[1].toInteger()});
+    }
+    entry.committed = mergeRanges(entry.committed);
+    files[filePath] = entry;
+    return true;
+}
+
+void IncomingFiles::saveJournalLocked(const QString &filePath)
+{
+    const Entry &entry = files[filePath];
+
+    QJsonArray ranges;
+    for (const ByteRange &range : entry.committed) {
+        ranges.append(QJsonArray{range.first, range.second});
+    }
+
+    QJsonObject state;
+    state["name"] = QFileInfo(filePath).fileName();
+    state["size"] = entry.fileSize;
+    state["modified"] = entry.modified;
+    state["ranges"] = ranges;
+
+    QFile journal(journalPath(filePath));
+    if (journal.open(QIODevice::WriteOnly)) {
+        journal.write(QJsonDocument(state).toJson(QJsonDocument::Compact));
+        journal.close();
+    }
+}
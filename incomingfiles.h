@@ -0,0 +1,75 @@
+#ifndef INCOMINGFILES_H
+#define INCOMINGFILES_H
+
+#include <QString>
+#include <QFile>
+#include <QMap>
+#include <QSet>
+#include <QMutex>
+#include <QAtomicInt>
+
+#include "transferprotocol.h"
+
+// Destination files being assembled from byte ranges, possibly by several
+// connections on different receiver threads at once. Each one is written
+// under a hidden temp name, preallocated at full size, and renamed into place
+// once the last byte is in, so the real name never shows a partial file. A
+// journal next to it lets a later connection pick up where an earlier one
+// stopped. Thread safe.
+class IncomingFiles
+{
+public:
+    // How hard a finished file is pushed to the disk before it counts as received
+    enum Durability {
+        NoSync,       // Left to the OS, a crash can lose files already acked
+        SyncEachFile, // fsync() before the rename, slow for many small files
+        SyncEachBatch // Renamed right away, one sync once the transfers go quiet
+    };
+
+    IncomingFiles();
+
+    void setDurability(Durability durability); // Any time, applies to files finished after it
+    Durability durability() const;
+
+    static QString partPath(const QString &filePath); // The hidden name a file is assembled under
+
+    // What is already on disk of this version of the file, false if nothing is known about it
+    bool find(const QString &filePath, qint64 fileSize, qint64 modified, TransferProtocol::ByteRanges &committed);
+
+    // Opens file under partPath(filePath) for writing one range, the first one creates it at full size
+    bool openRange(const QString &filePath, qint64 fileSize, qint64 modified, QFile &file);
+
+    void commit(const QString &filePath, qint64 offset, qint64 length); // Bytes that are on disk
+    bool finish(const QString &filePath); // True once, when the last range is in
+
+    // Renames the finished file into place with the sender's mtime and drops
+    // the journal. Syncs per the durability policy, so keep it off the socket
+    // threads; synced says its data was already fsync()ed by the disk writer.
+    bool install(const QString &filePath, QFile &file, bool synced = false);
+
+    // Closes file and moves it over targetPath, synced per the durability
+    // policy. The temp file is removed if that fails.
+    bool replace(QFile &file, const QString &targetPath, bool synced = false);
+
+    void syncBatch(); // Flushes the files SyncEachBatch has renamed since the last call
+
+private:
+    struct Entry {
+        qint64 fileSize;
+        qint64 modified; // Sender's mtime in ms, applied once the file is complete
+        TransferProtocol::ByteRanges committed;
+        bool finishing = false; // Claimed by finish(), kept until it is installed
+    };
+
+    static QString journalPath(const QString &filePath);
+    bool findLocked(const QString &filePath, qint64 fileSize, qint64 modified); // Starts over on a version mismatch
+    bool loadJournalLocked(const QString &filePath, qint64 fileSize, qint64 modified);
+    void saveJournalLocked(const QString &filePath);
+
+    QMutex mutex;
+    QMap<QString, Entry> files; // Keyed by destination path
+    QSet<QString> unsynced;     // Renamed into place, waiting for syncBatch()
+    QAtomicInt policy; // Durability
+};
+
+#endif // INCOMINGFILES_H
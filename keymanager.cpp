@@ -0,0 +1,212 @@
+#include "keymanager.h"
+#include "crypto.h"
+#include <QDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QtEndian>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <openssl/x509.h>
+
+namespace {
+
+const char agreementKeyLabel[] = "LetsShare agreement key";
+const long certificateLifetime = 10L * 365 * 24 * 3600; // s, the key is what is trusted, not the dates
+
+EVP_PKEY *readKey(const QString &path, bool isPrivate)
+{
+    FILE *file = fopen(QFile::encodeName(path).constData(), "rb");
+    if (!file) {
+        qDebug() << "Failed to open RSA key file" << path;
+        return nullptr;
+    }
+
+    EVP_PKEY *key = isPrivate ? PEM_read_PrivateKey(file, nullptr, nullptr, nullptr)
+                              : PEM_read_PUBKEY(file, nullptr, nullptr, nullptr);
+    fclose(file);
+    if (!key) {
+        qDebug() << "Failed to read RSA key" << path;
+    }
+    return key;
+}
+
+QByteArray readBio(BIO *bio)
+{
+    char *data = nullptr;
+    long size = BIO_get_mem_data(bio, &data);
+    return size > 0 ? QByteArray(data, qsizetype(size)) : QByteArray();
+}
+
+// Self-signed, nobody checks it against a CA
+KeyManager::TlsIdentity makeIdentity(EVP_PKEY *key)
+{
+    KeyManager::TlsIdentity identity;
+    X509 *certificate = X509_new();
+    BIO *bio = BIO_new(BIO_s_mem());
+    unsigned char serial[8];
+    X509_NAME *name = certificate ? X509_get_subject_name(certificate) : nullptr;
+
+    bool made = certificate && bio && name && RAND_bytes(serial, sizeof(serial)) == 1
+                && X509_set_version(certificate, 2) > 0
+                && ASN1_INTEGER_set_uint64(X509_get_serialNumber(certificate), qFromUnaligned<quint64>(serial) >> 1) > 0
+                && X509_gmtime_adj(X509_getm_notBefore(certificate), -24 * 3600)
+                && X509_gmtime_adj(X509_getm_notAfter(certificate), certificateLifetime)
+                && X509_set_pubkey(certificate, key) > 0
+                && X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>("LetsShare"), -1, -1, 0) > 0
+                && X509_set_issuer_name(certificate, name) > 0
+                && X509_sign(certificate, key, EVP_sha256()) > 0
+                && PEM_write_bio_X509(bio, certificate) > 0;
+    if (made) {
+        identity.certificate = readBio(bio);
+        made = BIO_reset(bio) > 0 && PEM_write_bio_PrivateKey(bio, key, nullptr, nullptr, 0, nullptr, nullptr) > 0;
+        identity.privateKey = made ? readBio(bio) : QByteArray();
+    }
+    if (!made) {
+        qDebug() << "Failed to make the TLS certificate.";
+        identity = KeyManager::TlsIdentity();
+    }
+
+    BIO_free(bio);
+    X509_free(certificate);
+    return identity;
+}
+
+}
+
+KeyManager &KeyManager::shared()
+{
+    static KeyManager manager;
+    return manager;
+}
+
+QSharedPointer<EVP_PKEY> KeyManager::publicKey(const QString &path)
+{
+    QMutexLocker locker(&mutex);
+    return cachedKey(publicKeys, path, false);
+}
+
+QSharedPointer<EVP_PKEY> KeyManager::privateKey(const QString &path)
+{
+    QMutexLocker locker(&mutex);
+    return cachedKey(privateKeys, path, true);
+}
+
+KeyManager::AgreementKey KeyManager::agreementKey(const QString &privateKeyPath)
+{
+    QMutexLocker locker(&mutex);
+    QSharedPointer<EVP_PKEY> signer = cachedKey(privateKeys, privateKeyPath, true);
+    if (!signer) {
+        agreementKeys.remove(privateKeyPath);
+        return AgreementKey();
+    }
+
+    auto found = agreementKeys.constFind(privateKeyPath);
+    if (found != agreementKeys.constEnd() && found->signer == signer && found->age.elapsed() < agreementKeyLifetime) {
+        return found->agreement;
+    }
+
+    // One RSA signature per lifetime, every connection until then only pays for X25519
+    SignedKey fresh;
+    fresh.agreement.key = Crypto::newAgreementKey();
+    fresh.agreement.publicKey = Crypto::agreementPublicKey(fresh.agreement.key.data());
+    fresh.agreement.signature = fresh.agreement.publicKey.isEmpty()
+                                    ? QByteArray() : Crypto::sign(signer.data(), signedData(fresh.agreement.publicKey));
+    if (fresh.agreement.signature.isEmpty()) {
+        return AgreementKey();
+    }
+    fresh.signer = signer;
+    fresh.age.start();
+    agreementKeys.insert(privateKeyPath, fresh);
+    return fresh.agreement;
+}
+
+bool KeyManager::verifyAgreementKey(const QString &publicKeyPath, const QByteArray &agreementPublicKey, const QByteArray &signature)
+{
+    QMutexLocker locker(&mutex);
+    QSharedPointer<EVP_PKEY> verifier = cachedKey(publicKeys, publicKeyPath, false);
+    if (!verifier || agreementPublicKey.isEmpty() || signature.isEmpty()) {
+        return false;
+    }
+
+    auto found = verifiedKeys.constFind(publicKeyPath);
+    if (found != verifiedKeys.constEnd() && found->verifier == verifier
+        && found->publicKey == agreementPublicKey && found->signature == signature) {
+        return true;
+    }
+
+    if (!Crypto::verify(verifier.data(), signedData(agreementPublicKey), signature)) {
+        return false;
+    }
+    verifiedKeys.insert(publicKeyPath, {verifier, agreementPublicKey, signature});
+    return true;
+}
+
+QByteArray KeyManager::signedData(const QByteArray &agreementPublicKey)
+{
+    return QByteArray(agreementKeyLabel) + agreementPublicKey;
+}
+
+KeyManager::TlsIdentity KeyManager::tlsIdentity(const QString &privateKeyPath)
+{
+    QMutexLocker locker(&mutex);
+    QSharedPointer<EVP_PKEY> signer = cachedKey(privateKeys, privateKeyPath, true);
+    if (!signer) {
+        tlsIdentities.remove(privateKeyPath);
+        return TlsIdentity();
+    }
+
+    auto found = tlsIdentities.constFind(privateKeyPath);
+    if (found != tlsIdentities.constEnd() && found->signer == signer) {
+        return found->identity;
+    }
+
+    SignedIdentity fresh{makeIdentity(signer.data()), signer};
+    if (fresh.identity.certificate.isEmpty()) {
+        return TlsIdentity();
+    }
+    tlsIdentities.insert(privateKeyPath, fresh);
+    return fresh.identity;
+}
+
+QByteArray KeyManager::publicKeyPem(const QString &publicKeyPath)
+{
+    QSharedPointer<EVP_PKEY> key = publicKey(publicKeyPath);
+    BIO *bio = key ? BIO_new(BIO_s_mem()) : nullptr;
+    QByteArray pem = bio && PEM_write_bio_PUBKEY(bio, key.data()) > 0 ? readBio(bio) : QByteArray();
+    BIO_free(bio);
+    return pem;
+}
+
+void KeyManager::preload(const QString &publicKeyPath, const QString &privateKeyPath)
+{
+    if (!publicKeyPath.isEmpty()) {
+        publicKey(publicKeyPath);
+    }
+    if (!privateKeyPath.isEmpty()) {
+        agreementKey(privateKeyPath);
+        tlsIdentity(privateKeyPath);
+    }
+}
+
+QSharedPointer<EVP_PKEY> KeyManager::cachedKey(QHash<QString, CachedKey> &cache, const QString &path, bool isPrivate)
+{
+    if (path.isEmpty()) {
+        return QSharedPointer<EVP_PKEY>();
+    }
+
+    // A stat per connection is all an unchanged key costs
+    QFileInfo info(path);
+    qint64 size = info.exists() ? info.size() : -1;
+    qint64 modified = info.exists() ? info.lastModified().toMSecsSinceEpoch() : 0;
+    CachedKey &cached = cache[path];
+    if (cached.key && cached.size == size && cached.modified == modified) {
+        return cached.key;
+    }
+
+    EVP_PKEY *key = size >= 0 ? readKey(path, isPrivate) : nullptr;
+    cached.size = size;
+    cached.modified = modified;
+    cached.key = key ? QSharedPointer<EVP_PKEY>(key, EVP_PKEY_free) : QSharedPointer<EVP_PKEY>();
+    return cached.key;
+}
@@ -0,0 +1,96 @@
+#ifndef KEYMANAGER_H
+#define KEYMANAGER_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QString>
+#include <openssl/evp.h>
+
+// The RSA keys set on the Configure tab, parsed once and shared by every
+// connection and thread. A key file is looked at again (size and mtime) on
+// each use and read again only when it changed, so editing the file or the
+// path takes effect on the next connection.
+//
+// The receiver's X25519 agreement key lives here too. It is made on first
+// use, signed once with the RSA private key, and replaced after
+// agreementKeyLifetime: a connection costs the receiver no RSA work, and a
+// key taken later opens no session older than that.
+//
+// For TLS the receiver presents a self-signed certificate made from its RSA
+// key, and the sender trusts it for carrying the configured public key.
+class KeyManager
+{
+public:
+    static constexpr qint64 agreementKeyLifetime = 10 * 60 * 1000; // ms
+
+    struct AgreementKey {
+        QSharedPointer<EVP_PKEY> key; // Null if the private key cannot be read
+        QByteArray publicKey;         // Raw X25519, sent in the Accept
+        QByteArray signature;         // Over signedData(publicKey) by the RSA private key
+    };
+
+    struct TlsIdentity {
+        QByteArray certificate; // PEM, empty if the private key cannot be read
+        QByteArray privateKey;  // PEM
+    };
+
+    static KeyManager &shared();
+
+    QSharedPointer<EVP_PKEY> publicKey(const QString &path); // Null if it cannot be read
+    QSharedPointer<EVP_PKEY> privateKey(const QString &path);
+
+    AgreementKey agreementKey(const QString &privateKeyPath);
+
+    // The signature checked against the public key; a pair that passed is
+    // remembered, so repeated connections to one receiver skip the RSA work
+    bool verifyAgreementKey(const QString &publicKeyPath, const QByteArray &agreementPublicKey, const QByteArray &signature);
+
+    static QByteArray signedData(const QByteArray &agreementPublicKey); // What the signature covers
+
+    TlsIdentity tlsIdentity(const QString &privateKeyPath); // Made once per key
+    QByteArray publicKeyPem(const QString &publicKeyPath);  // What the receiver's certificate must carry, empty if unreadable
+
+    // Read the keys (and make the agreement key and certificate) now instead of on the first connection
+    void preload(const QString &publicKeyPath, const QString &privateKeyPath);
+
+private:
+    KeyManager() = default;
+    Q_DISABLE_COPY(KeyManager)
+
+    struct CachedKey {
+        qint64 size = -1;
+        qint64 modified = 0;
+        QSharedPointer<EVP_PKEY> key;
+    };
+
+    struct SignedKey {
+        AgreementKey agreement;
+        QSharedPointer<EVP_PKEY> signer; // The RSA key it was signed with, a reload means a new one
+        QElapsedTimer age;
+    };
+
+    struct SignedIdentity {
+        TlsIdentity identity;
+        QSharedPointer<EVP_PKEY> signer;
+    };
+
+    struct VerifiedKey {
+        QSharedPointer<EVP_PKEY> verifier;
+        QByteArray publicKey;
+        QByteArray signature;
+    };
+
+    QSharedPointer<EVP_PKEY> cachedKey(QHash<QString, CachedKey> &cache, const QString &path, bool isPrivate); // Called with the mutex held
+
+    QMutex mutex;
+    QHash<QString, CachedKey> publicKeys;  // By path
+    QHash<QString, CachedKey> privateKeys;
+    QHash<QString, SignedKey> agreementKeys; // By private key path
+    QHash<QString, VerifiedKey> verifiedKeys; // By public key path, the last receiver key that passed
+    QHash<QString, SignedIdentity> tlsIdentities; // By private key path
+};
+
+#endif // KEYMANAGER_H
@@ -1,5 +1,6 @@
 #include "mainwindow.h"
 #include "scriptdialog.h"
+#include "keymanager.h"
 
 #include <QNetworkInterface>
 #include <QDir>
@@ -42,6 +43,20 @@ MainWindow::MainWindow(QWidget *parent)
     connect(fileClient, &FileClient::statusUpdated, this, &MainWindow::updateStatus);
     connect(fileClient, &FileClient::progressUpdated, this, &MainWindow::updateProgress);
 
+    // How full the receiver's disk queue is, only shown while something is waiting for the disk
+    writeQueueLabel = new QLabel(this);
+    writeQueueLabel->setToolTip("Received data waiting to be written. Staying high means the disk is slower than the network.");
+    writeQueueLabel->hide();
+    statusBar->addPermanentWidget(writeQueueLabel);
+
+    QTimer *writeQueueTimer = new QTimer(this);
+    connect(writeQueueTimer, &QTimer::timeout, this, [this]() {
+        int fill = fileServer->writeQueueFill();
+        writeQueueLabel->setText(QString("Disk queue: %1%").arg(fill));
+        writeQueueLabel->setVisible(fill > 0);
+    });
+    writeQueueTimer->start(1000);
+
     // Initialize HTTP server
     httpServer = new HttpServer();
 
@@ -290,6 +305,130 @@ void MainWindow::setupConfigureTab(QWidget *tab)
     layout->addLayout(allowedIPLayout);
     layout->addWidget(allowedIPsList);
 
+    // Parallel streams used for large files, "Auto" keeps adding streams while it helps
+    QLabel *streamCountLabel = new QLabel("Parallel Streams:", tab);
+    streamCountComboBox = new QComboBox(tab);
+    streamCountComboBox->addItem("1", 1);
+    streamCountComboBox->addItem("2", 2);
+    streamCountComboBox->addItem("4", 4);
+    streamCountComboBox->addItem("8", 8);
+    streamCountComboBox->addItem("Auto", 0);
+    streamCountComboBox->setFixedWidth(120);
+    connect(streamCountComboBox, &QComboBox::currentIndexChanged, this, &MainWindow::onStreamCountChanged);
+
+    QHBoxLayout *streamCountLayout = new QHBoxLayout();
+    streamCountLayout->addWidget(streamCountLabel);
+    streamCountLayout->addWidget(streamCountComboBox);
+    streamCountLayout->addStretch();
+    layout->addLayout(streamCountLayout);
+
+    // Content hash check before sending, the receiver copies what it already has
+    deduplicateCheckBox = new QCheckBox("Skip files the receiver already has (hashes files before sending)", tab);
+    deduplicateCheckBox->setChecked(true);
+    connect(deduplicateCheckBox, &QCheckBox::toggled, this, [this](bool checked) {
+        fileClient->setDeduplicationEnabled(checked);
+    });
+    layout->addWidget(deduplicateCheckBox);
+
+    // Worth it on slow links with compressible data, chunks that do not shrink go raw
+    compressCheckBox = new QCheckBox("Compress data while sending", tab);
+    compressCheckBox->setChecked(false);
+    connect(compressCheckBox, &QCheckBox::toggled, this, [this](bool checked) {
+        fileClient->setCompressionEnabled(checked);
+    });
+    layout->addWidget(compressCheckBox);
+
+    // Fast links where copying every chunk through memory is the bottleneck; falls back on its own
+    zeroCopyCheckBox = new QCheckBox("Zero-copy transfers (Linux only)", tab);
+    zeroCopyCheckBox->setChecked(false);
+    zeroCopyCheckBox->setEnabled(ZeroCopy::isAvailable());
+    connect(zeroCopyCheckBox, &QCheckBox::toggled, this, [this](bool checked) {
+        fileClient->setZeroCopyEnabled(checked);
+        fileServer->setZeroCopyEnabled(checked);
+    });
+    layout->addWidget(zeroCopyCheckBox);
+
+    // Many reads and writes in flight at once instead of one blocking call at a time, for fast SSDs
+    ioUringCheckBox = new QCheckBox("Asynchronous disk I/O (io_uring, Linux only)", tab);
+    ioUringCheckBox->setChecked(false);
+    ioUringCheckBox->setEnabled(DiskBackend::isAvailable(DiskBackend::IoUring));
+    connect(ioUringCheckBox, &QCheckBox::toggled, this, [this](bool checked) {
+        DiskBackend::Kind kind = checked ? DiskBackend::IoUring : DiskBackend::Portable;
+        fileClient->setDiskBackend(kind);
+        fileServer->setDiskBackend(kind);
+    });
+    layout->addWidget(ioUringCheckBox);
+
+    // Multi-gigabyte images would otherwise push everything else out of the page cache on both ends
+    cacheBypassCheckBox = new QCheckBox("Keep files over", tab);
+    cacheBypassCheckBox->setChecked(false);
+    cacheBypassCheckBox->setEnabled(PageCache::isAvailable());
+    cacheBypassSpinBox = new QSpinBox(tab);
+    cacheBypassSpinBox->setRange(1, 1024);
+    cacheBypassSpinBox->setValue(4);
+    cacheBypassSpinBox->setSuffix(" GB");
+    cacheBypassSpinBox->setEnabled(PageCache::isAvailable());
+    QLabel *cacheBypassLabel = new QLabel("out of the page cache", tab);
+    connect(cacheBypassCheckBox, &QCheckBox::toggled, this, &MainWindow::applyCacheBypass);
+    connect(cacheBypassSpinBox, &QSpinBox::valueChanged, this, &MainWindow::applyCacheBypass);
+
+    QHBoxLayout *cacheBypassLayout = new QHBoxLayout();
+    cacheBypassLayout->addWidget(cacheBypassCheckBox);
+    cacheBypassLayout->addWidget(cacheBypassSpinBox);
+    cacheBypassLayout->addWidget(cacheBypassLabel);
+    cacheBypassLayout->addStretch();
+    layout->addLayout(cacheBypassLayout);
+
+    // How received files are flushed to disk; per batch costs one sync for a whole folder of small files
+    QLabel *durabilityLabel = new QLabel("Sync Received Files:", tab);
+    durabilityComboBox = new QComboBox(tab);
+    durabilityComboBox->addItem("Never (fastest)", IncomingFiles::NoSync);
+    durabilityComboBox->addItem("Per batch", IncomingFiles::SyncEachBatch);
+    durabilityComboBox->addItem("Per file (safest)", IncomingFiles::SyncEachFile);
+    durabilityComboBox->setFixedWidth(150);
+    connect(durabilityComboBox, &QComboBox::currentIndexChanged, this, [this]() {
+        fileServer->setDurability(IncomingFiles::Durability(durabilityComboBox->currentData().toInt()));
+    });
+
+    QHBoxLayout *durabilityLayout = new QHBoxLayout();
+    durabilityLayout->addWidget(durabilityLabel);
+    durabilityLayout->addWidget(durabilityComboBox);
+    durabilityLayout->addStretch();
+    layout->addLayout(durabilityLayout);
+
+    // Range data sealed with AES-GCM or ChaCha20-Poly1305 under a key agreed with the receiver's signed X25519 key
+    encryptCheckBox = new QCheckBox("Encrypt data while sending", tab);
+    encryptCheckBox->setChecked(false);
+    connect(encryptCheckBox, &QCheckBox::toggled, this, &MainWindow::applyEncryption);
+    layout->addWidget(encryptCheckBox);
+
+    // The whole connection in TLS 1.3 instead; the receiver answers either kind on the same port
+    tlsCheckBox = new QCheckBox("Send over TLS 1.3", tab);
+    tlsCheckBox->setChecked(false);
+    tlsCheckBox->setEnabled(QSslSocket::supportsSsl());
+    connect(tlsCheckBox, &QCheckBox::toggled, this, &MainWindow::applyEncryption);
+    layout->addWidget(tlsCheckBox);
+
+    QLabel *rsaPublicKeyLabel = new QLabel("Receiver's Public Key:", tab);
+    rsaPublicKeyPathInput = new QLineEdit(tab);
+    rsaPublicKeyPathInput->setPlaceholderText("PEM file, for sending");
+    connect(rsaPublicKeyPathInput, &QLineEdit::editingFinished, this, &MainWindow::applyEncryption);
+
+    QHBoxLayout *rsaPublicKeyLayout = new QHBoxLayout();
+    rsaPublicKeyLayout->addWidget(rsaPublicKeyLabel);
+    rsaPublicKeyLayout->addWidget(rsaPublicKeyPathInput);
+    layout->addLayout(rsaPublicKeyLayout);
+
+    QLabel *rsaPrivateKeyLabel = new QLabel("Own Private Key:", tab);
+    rsaPrivateKeyPathInput = new QLineEdit(tab);
+    rsaPrivateKeyPathInput->setPlaceholderText("PEM file, for receiving");
+    connect(rsaPrivateKeyPathInput, &QLineEdit::editingFinished, this, &MainWindow::applyEncryption);
+
+    QHBoxLayout *rsaPrivateKeyLayout = new QHBoxLayout();
+    rsaPrivateKeyLayout->addWidget(rsaPrivateKeyLabel);
+    rsaPrivateKeyLayout->addWidget(rsaPrivateKeyPathInput);
+    layout->addLayout(rsaPrivateKeyLayout);
+
     // Save Configuration Button
     QPushButton *saveConfigButton = new QPushButton("Save Configuration", tab);
     saveConfigButton->setFixedWidth(150);
@@ -299,6 +438,11 @@ void MainWindow::setupConfigureTab(QWidget *tab)
     tab->setLayout(layout);
 }
 
+void MainWindow::onStreamCountChanged(int index)
+{
+    fileClient->setStreamCount(streamCountComboBox->itemData(index).toInt());
+}
+
 void MainWindow::updateAllowedIPs()
 {
     QSet<QString> allowedIPs;
@@ -365,6 +509,27 @@ void MainWindow::removeSelectedIPs()
     updateStatus("Selected IPs removed.");
 }
 
+void MainWindow::applyCacheBypass()
+{
+    qint64 threshold = cacheBypassCheckBox->isChecked() ? qint64(cacheBypassSpinBox->value()) * 1024 * 1024 * 1024 : 0;
+    fileClient->setCacheBypassThreshold(threshold);
+    fileServer->setCacheBypassThreshold(threshold);
+}
+
+void MainWindow::applyEncryption()
+{
+    QString publicKeyPath = rsaPublicKeyPathInput->text();
+    QString privateKeyPath = rsaPrivateKeyPathInput->text();
+    fileClient->setEncryption(encryptCheckBox->isChecked(), publicKeyPath);
+    fileClient->setTlsEnabled(tlsCheckBox->isChecked());
+    fileServer->setRSAPrivateKeyPath(privateKeyPath);
+
+    // Parse the keys and sign the agreement key now, not on the first connection
+    QThreadPool::globalInstance()->start([publicKeyPath, privateKeyPath]() {
+        KeyManager::shared().preload(publicKeyPath, privateKeyPath);
+    });
+}
+
 void MainWindow::saveConfiguration()
 {
     QSet<QString> allowedIPs;
@@ -374,6 +539,18 @@ void MainWindow::saveConfiguration()
 
     QJsonObject config;
     config["allowedIPs"] = QJsonArray::fromStringList(allowedIPs.values());
+    config["streamCount"] = streamCountComboBox->currentData().toInt();
+    config["deduplicate"] = deduplicateCheckBox->isChecked();
+    config["compress"] = compressCheckBox->isChecked();
+    config["zeroCopy"] = zeroCopyCheckBox->isChecked();
+    config["ioUring"] = ioUringCheckBox->isChecked();
+    config["cacheBypass"] = cacheBypassCheckBox->isChecked();
+    config["cacheBypassGB"] = cacheBypassSpinBox->value();
+    config["durability"] = durabilityComboBox->currentData().toInt();
+    config["encrypt"] = encryptCheckBox->isChecked();
+    config["tls"] = tlsCheckBox->isChecked();
+    config["rsaPublicKeyPath"] = rsaPublicKeyPathInput->text();
+    config["rsaPrivateKeyPath"] = rsaPrivateKeyPathInput->text();
 
     QFile configFile("config.json");
     if (configFile.open(QIODevice::WriteOnly)) {
@@ -411,6 +588,39 @@ void MainWindow::loadConfiguration()
     }
     fileServer->setAllowedIPs(allowedIPs);
     httpServer->setAllowedIPs(allowedIPs);
+
+    int streamIndex = streamCountComboBox->findData(config["streamCount"].toInt(1));
+    streamCountComboBox->setCurrentIndex(streamIndex >= 0 ? streamIndex : 0);
+    onStreamCountChanged(streamCountComboBox->currentIndex());
+
+    deduplicateCheckBox->setChecked(config["deduplicate"].toBool(true));
+    fileClient->setDeduplicationEnabled(deduplicateCheckBox->isChecked());
+
+    compressCheckBox->setChecked(config["compress"].toBool(false));
+    fileClient->setCompressionEnabled(compressCheckBox->isChecked());
+
+    zeroCopyCheckBox->setChecked(config["zeroCopy"].toBool(false));
+    fileClient->setZeroCopyEnabled(zeroCopyCheckBox->isChecked());
+    fileServer->setZeroCopyEnabled(zeroCopyCheckBox->isChecked());
+
+    ioUringCheckBox->setChecked(config["ioUring"].toBool(false) && ioUringCheckBox->isEnabled());
+    DiskBackend::Kind diskBackend = ioUringCheckBox->isChecked() ? DiskBackend::IoUring : DiskBackend::Portable;
+    fileClient->setDiskBackend(diskBackend);
+    fileServer->setDiskBackend(diskBackend);
+
+    cacheBypassCheckBox->setChecked(config["cacheBypass"].toBool(false) && cacheBypassCheckBox->isEnabled());
+    cacheBypassSpinBox->setValue(config["cacheBypassGB"].toInt(4));
+    applyCacheBypass();
+
+    int durabilityIndex = durabilityComboBox->findData(config["durability"].toInt(IncomingFiles::NoSync));
+    durabilityComboBox->setCurrentIndex(durabilityIndex >= 0 ? durabilityIndex : 0);
+    fileServer->setDurability(IncomingFiles::Durability(durabilityComboBox->currentData().toInt()));
+
+    encryptCheckBox->setChecked(config["encrypt"].toBool(false));
+    tlsCheckBox->setChecked(config["tls"].toBool(false) && tlsCheckBox->isEnabled());
+    rsaPublicKeyPathInput->setText(config["rsaPublicKeyPath"].toString());
+    rsaPrivateKeyPathInput->setText(config["rsaPrivateKeyPath"].toString());
+    applyEncryption();
 }
 
 void MainWindow::updateProgress(int percentage)
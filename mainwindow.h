@@ -15,6 +15,7 @@
 #include <QProgressBar>
 #include <QLineEdit>
 #include <QCheckBox>
+#include <QSpinBox>
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QSslSocket>
@@ -22,6 +23,7 @@
 #include <QSslCertificate>
 #include <QSslKey>
 #include <QSet>
+#include <QTimer>
 
 #include "fileserver.h"
 #include "fileclient.h"
@@ -56,6 +58,9 @@ private slots:
     void addAllowedIP();
     void showAllowedIPsContextMenu(const QPoint &pos);
     void removeSelectedIPs();
+    void onStreamCountChanged(int index);
+    void applyCacheBypass(); // Threshold from the Configure tab to both sides
+    void applyEncryption();  // Checkbox and key paths from the Configure tab to both sides
 
     void onHttpServerStarted(const QString &url);
     void onHttpServerStopped();
@@ -70,6 +75,7 @@ private:
     QListWidget *sentFilesWidget;
     QListWidget *receivedFilesWidget;
     QStatusBar *statusBar;
+    QLabel *writeQueueLabel;
     QComboBox *ipComboBox;
     QPushButton *browseDownloadLocationButton;
     QLabel *downloadLocationLabel;
@@ -86,6 +92,16 @@ private:
     QPushButton *disconnectButton;
     QListWidget *allowedIPsList;
     QLineEdit *allowedIPInput;
+    QComboBox *streamCountComboBox;
+    QComboBox *durabilityComboBox;
+    QCheckBox *deduplicateCheckBox;
+    QCheckBox *compressCheckBox;
+    QCheckBox *zeroCopyCheckBox;
+    QCheckBox *ioUringCheckBox;
+    QCheckBox *cacheBypassCheckBox;
+    QSpinBox *cacheBypassSpinBox; // GB
+    QCheckBox *encryptCheckBox;
+    QCheckBox *tlsCheckBox;
 
     QLineEdit *rsaPublicKeyPathInput;
     QLineEdit *rsaPrivateKeyPathInput;
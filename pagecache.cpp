@@ -0,0 +1,65 @@
+#include "pagecache.h"
+
+#if defined(Q_OS_LINUX) || defined(Q_OS_MACOS)
+#include <fcntl.h>
+#endif
+
+namespace PageCache {
+
+bool isAvailable()
+{
+#if defined(Q_OS_LINUX) || defined(Q_OS_MACOS)
+    return true;
+#else
+    return false;
+#endif
+}
+
+void startBypass(QFile &file)
+{
+#if defined(Q_OS_LINUX)
+    ::posix_fadvise(file.handle(), 0, 0, POSIX_FADV_SEQUENTIAL); // Bigger read-ahead, dropped as we go
+#elif defined(Q_OS_MACOS)
+    ::fcntl(file.handle(), F_NOCACHE, 1); // No per-range calls needed after this
+#else
+    Q_UNUSED(file);
+#endif
+}
+
+void dropRead(QFile &file, qint64 offset, qint64 length)
+{
+#ifdef Q_OS_LINUX
+    ::posix_fadvise(file.handle(), off_t(offset), off_t(length), POSIX_FADV_DONTNEED);
+#else
+    Q_UNUSED(file);
+    Q_UNUSED(offset);
+    Q_UNUSED(length);
+#endif
+}
+
+void startWriteback(QFile &file, qint64 offset, qint64 length)
+{
+#ifdef Q_OS_LINUX
+    ::sync_file_range(file.handle(), off64_t(offset), off64_t(length), SYNC_FILE_RANGE_WRITE);
+#else
+    Q_UNUSED(file);
+    Q_UNUSED(offset);
+    Q_UNUSED(length);
+#endif
+}
+
+void dropWritten(QFile &file, qint64 offset, qint64 length)
+{
+#ifdef Q_OS_LINUX
+    // Not an fsync: no metadata, no cache flush on the drive, just this range's pages
+    ::sync_file_range(file.handle(), off64_t(offset), off64_t(length),
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    ::posix_fadvise(file.handle(), off_t(offset), off_t(length), POSIX_FADV_DONTNEED);
+#else
+    Q_UNUSED(file);
+    Q_UNUSED(offset);
+    Q_UNUSED(length);
+#endif
+}
+
+}
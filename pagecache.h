@@ -0,0 +1,28 @@
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include <QFile>
+#include <QtGlobal>
+
+// Keeps one huge transfer from pushing everything else out of the page
+// cache. Its data is dropped from the cache a little behind the point where
+// it was read or written, instead of staying there to be evicted by the
+// kernel later, at the expense of whatever else was cached. Linux uses
+// posix_fadvise() and sync_file_range(), macOS turns caching off for the
+// file. Elsewhere isAvailable() is false and the calls do nothing.
+namespace PageCache {
+
+bool isAvailable();
+
+void startBypass(QFile &file); // About to read or write it once, start to end
+
+void dropRead(QFile &file, qint64 offset, qint64 length);
+
+// Written data is only dropped once it is clean. startWriteback() gets the
+// disk going on it, dropWritten() waits for that to finish and drops it.
+void startWriteback(QFile &file, qint64 offset, qint64 length);
+void dropWritten(QFile &file, qint64 offset, qint64 length);
+
+}
+
+#endif // PAGECACHE_H
@@ -0,0 +1,59 @@
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#include <atomic>
+#include <utility>
+#include <vector>
+
+// Bounded lock-free queue for exactly one producer thread and one consumer
+// thread. One slot is kept free to tell full from empty.
+template <typename T>
+class SpscRing
+{
+public:
+    explicit SpscRing(int capacity) : slots(size_t(capacity) + 1) {}
+
+    int capacity() const { return int(slots.size()) - 1; }
+
+    int size() const
+    {
+        int head = this->head.load(std::memory_order_acquire);
+        int tail = this->tail.load(std::memory_order_acquire);
+        return tail >= head ? tail - head : tail + int(slots.size()) - head;
+    }
+
+    // Producer only. Leaves item alone and returns false when full.
+    bool push(T &item)
+    {
+        int tail = this->tail.load(std::memory_order_relaxed);
+        int next = advance(tail);
+        if (next == head.load(std::memory_order_acquire)) {
+            return false;
+        }
+        slots[size_t(tail)] = std::move(item);
+        this->tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only
+    bool pop(T &item)
+    {
+        int head = this->head.load(std::memory_order_relaxed);
+        if (head == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = std::move(slots[size_t(head)]);
+        slots[size_t(head)] = T(); // Drop what the slot held now, not when it is reused
+        this->head.store(advance(head), std::memory_order_release);
+        return true;
+    }
+
+private:
+    int advance(int index) const { return index + 1 == int(slots.size()) ? 0 : index + 1; }
+
+    std::vector<T> slots;
+    alignas(64) std::atomic<int> head{0}; // Next slot to pop, moved by the consumer
+    alignas(64) std::atomic<int> tail{0}; // Next slot to fill, moved by the producer
+};
+
+#endif // SPSCRING_H
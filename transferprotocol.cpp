@@ -0,0 +1,145 @@
+#include "transferprotocol.h"
+
+#include <QtEndian>
+
+#include <algorithm>
+
+namespace TransferProtocol {
+
+QByteArray frame(MessageType type, const QByteArray &payload)
+{
+    QByteArray bytes = frameHeader(type, payload.size());
+    bytes.reserve(frameHeaderSize + payload.size());
+    bytes.append(payload);
+    return bytes;
+}
+
+QByteArray frameHeader(MessageType type, qint64 payloadSize)
+{
+    QByteArray bytes;
+    QDataStream out(&bytes, QIODevice::WriteOnly);
+    out << quint32(payloadSize) << quint8(type);
+    return bytes;
+}
+
+ReadResult readFrame(QIODevice *device, Frame &frame)
+{
+    QByteArray header = device->peek(frameHeaderSize);
+    if (header.size() < frameHeaderSize) {
+        return NeedMoreData;
+    }
+
+    QDataStream in(header);
+    quint32 length;
+    quint8 type;
+    in >> length >> type;
+
+    if (length > maxPayloadSize) {
+        return FrameTooLarge;
+    }
+    if (device->bytesAvailable() < frameHeaderSize + qint64(length)) {
+        return NeedMoreData;
+    }
+
+    device->skip(frameHeaderSize);
+    frame.type = type;
+    frame.payload = device->read(length);
+    return FrameReady;
+}
+
+ReadResult readChunkFrame(QIODevice *device, ChunkFrame &chunk, bool sealed)
+{
+    char *header = chunk.header;
+    const qint64 headerSize = sizeof(chunk.header);
+    const quint32 trailer = sealed ? chunkTagSize : 0;
+
+    qint64 peeked = device->peek(header, headerSize);
+    if (peeked < frameHeaderSize) {
+        return NeedMoreData;
+    }
+
+    // Anything else, including a malformed chunk, goes through readFrame()
+    quint32 length = qFromBigEndian<quint32>(header);
+    if (quint8(header[4]) != FileData || length < quint32(chunkHeaderSize) + trailer
+        || length - chunkHeaderSize - trailer > quint64(BufferPool::bufferSize)) {
+        return OtherFrame;
+    }
+    if (peeked < headerSize || device->bytesAvailable() < frameHeaderSize + qint64(length)) {
+        return NeedMoreData;
+    }
+
+    BufferPool::Buffer payload = BufferPool::shared().acquire();
+    if (payload.isNull()) {
+        return OtherFrame;
+    }
+
+    qint64 payloadSize = length - chunkHeaderSize - trailer;
+    device->skip(headerSize);
+    payload.setSize(device->read(payload.data(), payloadSize));
+    if (payload.size() != payloadSize || device->read(chunk.tag, trailer) != trailer) {
+        return FrameTooLarge; // Was there a moment ago, the connection is broken
+    }
+
+    chunk.codec = quint8(header[5]);
+    chunk.rawSize = qFromBigEndian<quint32>(header + 6);
+    chunk.payload = std::move(payload);
+    return FrameReady;
+}
+
+void writeChunkHeader(char *out, quint8 codec, qint64 rawSize, qint64 payloadSize)
+{
+    qToBigEndian(quint32(chunkHeaderSize + payloadSize), out);
+    out[4] = char(FileData);
+    out[5] = char(codec);
+    qToBigEndian(quint32(rawSize), out + 6);
+}
+
+ByteRanges mergeRanges(ByteRanges ranges)
+{
+    std::sort(ranges.begin(), ranges.end());
+
+    ByteRanges merged;
+    for (const ByteRange &range : ranges) {
+        if (range.second <= 0) {
+            continue;
+        }
+        if (!merged.isEmpty() && range.first <= merged.last().first + merged.last().second) {
+            ByteRange &last = merged.last();
+            qint64 end = qMax(last.first + last.second, range.first + range.second);
+            last.second = end - last.first;
+        } else {
+            merged.append(range);
+        }
+    }
+    return merged;
+}
+
+ByteRanges missingRanges(const ByteRanges &ranges, qint64 size)
+{
+    ByteRanges missing;
+    qint64 position = 0;
+    for (const ByteRange &range : mergeRanges(ranges)) {
+        if (range.first > position) {
+            missing.append({position, qMin(range.first, size) - position});
+        }
+        position = qMax(position, range.first + range.second);
+        if (position >= size) {
+            break;
+        }
+    }
+    if (position < size) {
+        missing.append({position, size - position});
+    }
+    return missing;
+}
+
+qint64 rangesSize(const ByteRanges &ranges)
+{
+    qint64 total = 0;
+    for (const ByteRange &range : ranges) {
+        total += range.second;
+    }
+    return total;
+}
+
+}
@@ -0,0 +1,100 @@
+#ifndef TRANSFERPROTOCOL_H
+#define TRANSFERPROTOCOL_H
+
+#include <QByteArray>
+#include <QDataStream>
+#include <QIODevice>
+#include <QList>
+#include <QPair>
+#include <QtGlobal>
+
+#include "bufferpool.h"
+
+// Frames exchanged on the file transfer port. Every frame is a 5 byte header
+// (quint32 payload length, quint8 type) followed by the payload, whose fields
+// are serialized with QDataStream (Qt_6_8).
+//
+// The sender opens each connection with a Hello and may send anything once
+// the receiver answers Accept. Frames never wait on each other, so queries,
+// headers and data for many files go out back to back. A connection may
+// instead open with a TLS 1.3 handshake, the frames then follow inside it.
+namespace TransferProtocol {
+
+const quint16 port = 12345;
+const quint32 magic = 0x4c534852; // "LSHR"
+const quint16 version = 3;
+
+const int frameHeaderSize = 5;
+const int chunkHeaderSize = 5; // FileData codec and raw length, ahead of the chunk bytes
+const int chunkTagSize = 16;   // After the bytes of a FileData frame on an encrypted connection
+const qint64 maxPayloadSize = 17 * 1024 * 1024; // A compressed 16 MB chunk plus slack
+
+enum MessageType : quint8 {
+    Hello = 1,           // magic, version, Compression::Codec values the sender can use, best first,
+                         // Crypto::Cipher values it can use, sender's X25519 public key (both empty: plaintext)
+    Accept = 2,          // version, codec picked for FileData frames on this connection, cipher picked (0 for plaintext),
+                         // receiver's X25519 public key, its RSA signature, 16 random bytes (all empty for plaintext)
+    Reject = 3,          // reason; the receiver closes the connection after it
+    ResumeQuery = 4,     // token, fileName, fileSize, modified, SHA-256 of the content (empty if not computed)
+    ResumeReply = 5,     // token, ranges the receiver already has
+    FileHeader = 6,      // token, fileName, fileSize, modified, offset, length; FileData frames follow
+    FileData = 7,        // codec, raw length, then the payload (range bytes or a delta literal); when encrypted
+                         // the payload is sealed, with the frame and chunk header as associated data, and its tag follows
+    FileAck = 8,         // token, offset, length, whether the range reached the disk
+    DeltaSignatures = 9, // token, old size, block size, weak sums, strong sums (sent instead of a ResumeReply)
+    DeltaHeader = 10,    // token, fileName, fileSize, modified, old size, block size; DeltaCopy/FileData follow
+    DeltaCopy = 11,      // first block, block count to take from the old copy
+    DeltaEnd = 12,       // MD5 of the rebuilt file
+    DeltaResult = 13     // token, whether the rebuilt file matched; the sender falls back to a full send if not
+};
+
+struct Frame {
+    quint8 type = 0;
+    QByteArray payload;
+};
+
+// A FileData frame read straight into a pool buffer, the chunk header fields apart
+struct ChunkFrame {
+    char header[frameHeaderSize + chunkHeaderSize]; // As received, what the tag covers
+    quint8 codec = 0;
+    quint32 rawSize = 0;
+    BufferPool::Buffer payload;
+    char tag[chunkTagSize]; // Set when read with sealed
+};
+
+enum ReadResult {
+    FrameReady,
+    NeedMoreData,
+    FrameTooLarge,
+    OtherFrame // readChunkFrame(): the next frame is not a FileData chunk that fits a pool buffer
+};
+
+typedef QPair<qint64, qint64> ByteRange; // offset, length
+typedef QList<ByteRange> ByteRanges;
+
+QByteArray frame(MessageType type, const QByteArray &payload);
+QByteArray frameHeader(MessageType type, qint64 payloadSize); // For payloads written separately
+ReadResult readFrame(QIODevice *device, Frame &frame); // Leaves a partial frame in the device
+ReadResult readChunkFrame(QIODevice *device, ChunkFrame &chunk, bool sealed); // Same, for the data frames only
+
+// Frame header and FileData fields into the frameHeaderSize + chunkHeaderSize bytes at out
+void writeChunkHeader(char *out, quint8 codec, qint64 rawSize, qint64 payloadSize);
+
+// Frame whose payload is the given fields, in order
+template <typename... Fields>
+QByteArray message(MessageType type, const Fields &...fields)
+{
+    QByteArray payload;
+    QDataStream out(&payload, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_6_8);
+    (out << ... << fields);
+    return frame(type, payload);
+}
+
+ByteRanges mergeRanges(ByteRanges ranges);                     // Sorted, overlapping and touching ranges joined
+ByteRanges missingRanges(const ByteRanges &ranges, qint64 size); // Parts of [0, size) not covered by ranges
+qint64 rangesSize(const ByteRanges &ranges);
+
+}
+
+#endif // TRANSFERPROTOCOL_H
@@ -0,0 +1,231 @@
+#include "zerocopy.h"
+
+#ifdef Q_OS_LINUX
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace ZeroCopy {
+
+namespace {
+
+#ifdef Q_OS_LINUX
+const int pipeSize = 1024 * 1024; // Asked for, the kernel may grant less
+const qint64 copySize = 256 * 1024;
+
+bool writeAt(int fileHandle, const char *data, qint64 size, qint64 offset)
+{
+    while (size > 0) {
+        ssize_t written = ::pwrite(fileHandle, data, size_t(size), off_t(offset));
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+    return true;
+}
+#endif
+
+}
+
+bool isAvailable()
+{
+#ifdef Q_OS_LINUX
+    return true;
+#else
+    return false;
+#endif
+}
+
+qint64 sendBytes(qintptr socket, const QByteArray &bytes)
+{
+#ifdef Q_OS_LINUX
+    ssize_t sent;
+    do {
+        sent = ::send(int(socket), bytes.constData(), size_t(bytes.size()), MSG_NOSIGNAL | MSG_MORE);
+    } while (sent < 0 && errno == EINTR);
+
+    if (sent < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    return sent;
+#else
+    Q_UNUSED(socket);
+    Q_UNUSED(bytes);
+    return -1;
+#endif
+}
+
+qint64 sendFile(qintptr socket, int fileHandle, qint64 offset, qint64 length)
+{
+#ifdef Q_OS_LINUX
+    off_t position = off_t(offset);
+    ssize_t sent;
+    do {
+        sent = ::sendfile(int(socket), fileHandle, &position, size_t(length));
+    } while (sent < 0 && errno == EINTR);
+
+    if (sent < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    if (sent == 0 && length > 0) {
+        return -1; // The file is shorter than it was, let the read path report it
+    }
+    return sent;
+#else
+    Q_UNUSED(socket);
+    Q_UNUSED(fileHandle);
+    Q_UNUSED(offset);
+    Q_UNUSED(length);
+    return -1;
+#endif
+}
+
+QByteArray receiveBytes(qintptr socket, qint64 size, bool peek)
+{
+#ifdef Q_OS_LINUX
+    QByteArray bytes(qsizetype(size), Qt::Uninitialized);
+    ssize_t received;
+    do {
+        received = ::recv(int(socket), bytes.data(), size_t(size), MSG_DONTWAIT | (peek ? MSG_PEEK : 0));
+    } while (received < 0 && errno == EINTR);
+
+    bytes.resize(received > 0 ? qsizetype(received) : 0);
+    return bytes;
+#else
+    Q_UNUSED(socket);
+    Q_UNUSED(size);
+    Q_UNUSED(peek);
+    return QByteArray();
+#endif
+}
+
+Pipe::Pipe() : readEnd(-1), writeEnd(-1), capacity(0), fileSplice(true)
+{
+#ifdef Q_OS_LINUX
+    int fds[2];
+    if (::pipe2(fds, O_CLOEXEC) != 0) {
+        return;
+    }
+    readEnd = fds[0];
+    writeEnd = fds[1];
+
+    // A bigger pipe means fewer splice() round trips per chunk
+    int granted = ::fcntl(writeEnd, F_SETPIPE_SZ, pipeSize);
+    capacity = granted > 0 ? granted : ::fcntl(writeEnd, F_GETPIPE_SZ);
+    if (capacity <= 0) {
+        capacity = 64 * 1024;
+    }
+#endif
+}
+
+Pipe::~Pipe()
+{
+#ifdef Q_OS_LINUX
+    if (readEnd >= 0) {
+        ::close(readEnd);
+        ::close(writeEnd);
+    }
+#endif
+}
+
+bool Pipe::isValid() const
+{
+    return readEnd >= 0;
+}
+
+qint64 Pipe::spliceToFile(qintptr socket, int fileHandle, qint64 offset, qint64 length)
+{
+#ifdef Q_OS_LINUX
+    qint64 moved = 0;
+
+    while (moved < length) {
+        ssize_t in = ::splice(int(socket), nullptr, writeEnd, nullptr, size_t(qMin(capacity, length - moved)),
+                              SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (in < 0 && errno == EINTR) {
+            continue;
+        }
+        if (in < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break; // The rest is still on its way
+        }
+        if (in < 0 && errno == EINVAL && moved == 0) {
+            // This socket cannot splice, copy the chunk instead
+            QByteArray data = receiveBytes(socket, qMin(copySize, length), false);
+            if (data.isEmpty()) {
+                return 0;
+            }
+            return writeAt(fileHandle, data.constData(), data.size(), offset) ? data.size() : -1;
+        }
+        if (in < 0) {
+            return moved > 0 ? moved : -1;
+        }
+        if (in == 0) {
+            break; // Closed by the peer, the disconnect handler takes over
+        }
+
+        // Empty the pipe before reading more, so nothing is left in it on return
+        qint64 position = offset + moved;
+        qint64 left = in;
+        while (left > 0 && fileSplice) {
+            loff_t target = loff_t(position);
+            ssize_t out = ::splice(readEnd, nullptr, fileHandle, &target, size_t(left), SPLICE_F_MOVE);
+            if (out < 0 && errno == EINTR) {
+                continue;
+            }
+            if (out <= 0) {
+                fileSplice = false; // Not on this file system, copy from now on
+                break;
+            }
+            position += out;
+            left -= out;
+        }
+        if (left > 0 && !drainToFile(fileHandle, position, left)) {
+            return -1;
+        }
+
+        moved += in;
+    }
+
+    return moved;
+#else
+    Q_UNUSED(socket);
+    Q_UNUSED(fileHandle);
+    Q_UNUSED(offset);
+    Q_UNUSED(length);
+    return -1;
+#endif
+}
+
+bool Pipe::drainToFile(int fileHandle, qint64 offset, qint64 length)
+{
+#ifdef Q_OS_LINUX
+    QByteArray buffer(qsizetype(qMin(copySize, length)), Qt::Uninitialized);
+    while (length > 0) {
+        ssize_t got = ::read(readEnd, buffer.data(), size_t(qMin<qint64>(buffer.size(), length)));
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0 || !writeAt(fileHandle, buffer.constData(), got, offset)) {
+            return false;
+        }
+        offset += got;
+        length -= got;
+    }
+    return true;
+#else
+    Q_UNUSED(fileHandle);
+    Q_UNUSED(offset);
+    Q_UNUSED(length);
+    return false;
+#endif
+}
+
+}
@@ -0,0 +1,55 @@
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+
+#include <QByteArray>
+#include <QtGlobal>
+
+// Linux zero-copy helpers for the transfer port. The sender hands file pages
+// to the socket with sendfile(), the receiver moves socket data into the
+// destination file with splice() through a pipe. Everything here works on raw
+// descriptors behind QTcpSocket's back, so callers only use it while the
+// socket's own buffers are empty. Elsewhere isAvailable() is false and the
+// calls fail, callers keep to the QIODevice path.
+namespace ZeroCopy {
+
+bool isAvailable();
+
+// Bytes written straight to the socket, -1 on error. Flagged MSG_MORE so a
+// frame header leaves in the same segment as the file data after it.
+qint64 sendBytes(qintptr socket, const QByteArray &bytes);
+
+// Bytes of the file queued on the socket with sendfile(), 0 when the socket
+// buffer is full, -1 when sendfile() cannot be used for this file or socket
+qint64 sendFile(qintptr socket, int fileHandle, qint64 offset, qint64 length);
+
+// Up to size bytes waiting on the socket, left there when peek is set
+QByteArray receiveBytes(qintptr socket, qint64 size, bool peek);
+
+// A pipe for splice(), one per receiving connection
+class Pipe
+{
+public:
+    Pipe();
+    ~Pipe();
+
+    bool isValid() const;
+
+    // Moves up to length bytes from the socket into the file at offset.
+    // Returns the bytes written, 0 when nothing is waiting, -1 on a socket or
+    // disk error. Falls back to copying when the file system cannot splice.
+    qint64 spliceToFile(qintptr socket, int fileHandle, qint64 offset, qint64 length);
+
+private:
+    Q_DISABLE_COPY(Pipe)
+
+    bool drainToFile(int fileHandle, qint64 offset, qint64 length); // Copy what splice left in the pipe
+
+    int readEnd;
+    int writeEnd;
+    qint64 capacity;
+    bool fileSplice; // Cleared once the file system refuses splice()
+};
+
+}
+
+#endif // ZEROCOPY_H